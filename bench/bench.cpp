@@ -0,0 +1,735 @@
+// Benchmark harness comparing aa_tree with std::map, std::set and a flat
+// sorted vector.
+//
+//     aa_tree_bench [--sizes=1e3,1e4,1e5,1e6] [--filter=a,b,...]
+//
+// Every run is one (container, key type, workload, N) combination and
+// reports the mean time per operation, the heap footprint per element of
+// the populated container and, where the container can tell, rotations per
+// operation. --filter keeps runs whose "container/key/workload" name
+// contains any of the comma-separated substrings. 1e7 and 1e8 need
+// several GiB and are opt-in; at 1e8 the compact_links rows (aa_arena,
+// aa_pf) outgrow their 2 GiB span and report "over span".
+
+#include <aa/aa_tree.hpp>
+#include <aa/arena.hpp>
+#include <aa/frozen.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <new>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define AA_BENCH_HEAP_ACCOUNTING 1
+#endif
+
+// Heap accounting. Every global allocation is charged at its usable size,
+// so bytes/node includes allocator rounding and, for the arena, unused slab
+// tails.
+
+#ifdef AA_BENCH_HEAP_ACCOUNTING
+namespace {
+std::size_t heap_in_use = 0;
+
+void* counted_alloc(std::size_t n, std::size_t align) {
+    void* p = align <= alignof(std::max_align_t)
+                  ? std::malloc(n ? n : 1)
+                  : std::aligned_alloc(align, (std::max<std::size_t>(n, 1) + align - 1) / align * align);
+    if (!p)
+        throw std::bad_alloc();
+    heap_in_use += malloc_usable_size(p);
+    return p;
+}
+
+void counted_free(void* p) noexcept {
+    if (!p)
+        return;
+    heap_in_use -= malloc_usable_size(p);
+    std::free(p);
+}
+} // namespace
+
+void* operator new(std::size_t n) { return counted_alloc(n, 0); }
+void* operator new[](std::size_t n) { return counted_alloc(n, 0); }
+void* operator new(std::size_t n, std::align_val_t a) {
+    return counted_alloc(n, static_cast<std::size_t>(a));
+}
+void* operator new[](std::size_t n, std::align_val_t a) {
+    return counted_alloc(n, static_cast<std::size_t>(a));
+}
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete[](void* p) noexcept { counted_free(p); }
+void operator delete(void* p, std::size_t) noexcept { counted_free(p); }
+void operator delete[](void* p, std::size_t) noexcept { counted_free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { counted_free(p); }
+#endif
+
+namespace {
+
+std::size_t heap_bytes() {
+#ifdef AA_BENCH_HEAP_ACCOUNTING
+    return heap_in_use;
+#else
+    return 0;
+#endif
+}
+
+volatile std::uint64_t sink;
+
+// Keys.
+
+struct key64 {
+    std::uint64_t w[8];
+
+    friend bool operator<(const key64& a, const key64& b) {
+        return std::lexicographical_compare(a.w, a.w + 8, b.w, b.w + 8);
+    }
+    friend bool operator==(const key64& a, const key64& b) {
+        return std::equal(a.w, a.w + 8, b.w);
+    }
+};
+static_assert(sizeof(key64) == 64, "key64 must be 64 bytes");
+
+std::uint64_t mix(std::uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Each make_key is strictly increasing in x, so sequential inputs stay
+// sequential for every key type.
+template <class K>
+K make_key(std::uint64_t x);
+
+template <>
+std::uint64_t make_key<std::uint64_t>(std::uint64_t x) {
+    return x;
+}
+
+// 20 characters: past the small-string buffer, like most real string keys.
+template <>
+std::string make_key<std::string>(std::uint64_t x) {
+    char buf[24];
+    std::snprintf(buf, sizeof buf, "key:%016llx", static_cast<unsigned long long>(x));
+    return buf;
+}
+
+template <>
+key64 make_key<key64>(std::uint64_t x) {
+    key64 k;
+    k.w[0] = x;
+    for (int i = 1; i < 8; ++i)
+        k.w[i] = mix(x + i);
+    return k;
+}
+
+template <class K>
+const char* key_name();
+template <>
+const char* key_name<std::uint64_t>() { return "u64"; }
+template <>
+const char* key_name<std::string>() { return "string"; }
+template <>
+const char* key_name<key64>() { return "struct64"; }
+
+class rng {
+public:
+    explicit rng(std::uint64_t seed) : s_(seed) {}
+    std::uint64_t operator()() { return mix(s_++); }
+    double unit() { return static_cast<double>((*this)() >> 11) * 0x1.0p-53; }
+
+private:
+    std::uint64_t s_;
+};
+
+// Zipfian ranks in [0, n) with skew theta (Gray et al., "Quickly generating
+// billion-record synthetic databases"), the generator YCSB uses.
+class zipf_generator {
+public:
+    explicit zipf_generator(std::uint64_t n, double theta = 0.99)
+        : n_(n), theta_(theta), alpha_(1 / (1 - theta)), zetan_(zeta(n, theta)),
+          eta_((1 - std::pow(2.0 / static_cast<double>(n), 1 - theta)) /
+               (1 - zeta(2, theta) / zetan_)) {}
+
+    std::uint64_t operator()(rng& r) const {
+        double u = r.unit();
+        double uz = u * zetan_;
+        if (uz < 1)
+            return 0;
+        if (uz < 1 + std::pow(0.5, theta_))
+            return n_ > 1 ? 1 : 0;
+        auto k = static_cast<std::uint64_t>(static_cast<double>(n_) *
+                                            std::pow(eta_ * u - eta_ + 1, alpha_));
+        return std::min(k, n_ - 1);
+    }
+
+private:
+    static double zeta(std::uint64_t n, double theta) {
+        double s = 0;
+        for (std::uint64_t i = 1; i <= n; ++i)
+            s += 1 / std::pow(static_cast<double>(i), theta);
+        return s;
+    }
+
+    std::uint64_t n_;
+    double theta_;
+    double alpha_;
+    double zetan_;
+    double eta_;
+};
+
+// Containers. Each adapter exposes insert, find, erase and scan over a key
+// type K with a uint64_t payload, plus rotations() when the container can
+// count them (negative otherwise). find_many resolves a batch of keys,
+// through find_batch where the container has one.
+
+// Keys per find_many call, as in one RPC's worth of lookups.
+constexpr std::size_t batch_size = 128;
+
+template <class Map, class = void>
+struct counts_rotations : std::false_type {};
+
+template <class Map>
+struct counts_rotations<Map, std::void_t<decltype(std::declval<const Map&>().stats().rotations())>>
+    : std::true_type {};
+
+template <class Map, class = void>
+struct batches_finds : std::false_type {};
+
+template <class Map>
+struct batches_finds<Map, std::void_t<decltype(std::declval<const Map&>().find_batch(
+                              std::declval<const typename Map::key_type*>(),
+                              std::declval<const typename Map::key_type*>(),
+                              std::declval<typename Map::const_iterator*>()))>>
+    : std::true_type {};
+
+template <class C, class K>
+std::uint64_t find_many(const C& c, const K* first, const K* last) {
+    std::uint64_t found = 0;
+    for (; first != last; ++first)
+        found += c.find(*first);
+    return found;
+}
+
+template <class Map>
+struct map_adapter {
+    Map m;
+
+    bool insert(const typename Map::key_type& k) { return m.emplace(k, 1).second; }
+    bool find(const typename Map::key_type& k) const { return m.find(k) != m.end(); }
+    bool erase(const typename Map::key_type& k) { return m.erase(k) != 0; }
+    std::uint64_t scan(const typename Map::key_type& k, std::size_t n) const {
+        std::uint64_t s = 0;
+        for (auto it = m.lower_bound(k); it != m.end() && n; ++it, --n)
+            s += it->second;
+        return s;
+    }
+    std::size_t size() const { return m.size(); }
+    double rotations() const {
+        if constexpr (counts_rotations<Map>::value)
+            return static_cast<double>(m.stats().rotations());
+        else
+            return -1;
+    }
+    friend std::uint64_t find_many(const map_adapter& c, const typename Map::key_type* first,
+                                   const typename Map::key_type* last) {
+        if constexpr (batches_finds<Map>::value) {
+            typename Map::const_iterator out[batch_size];
+            std::uint64_t found = 0;
+            while (first != last) {
+                auto n = std::min<std::size_t>(static_cast<std::size_t>(last - first), batch_size);
+                c.m.find_batch(first, first + n, out);
+                for (std::size_t i = 0; i < n; ++i)
+                    found += out[i] != c.m.end();
+                first += n;
+            }
+            return found;
+        } else {
+            std::uint64_t found = 0;
+            for (; first != last; ++first)
+                found += c.find(*first);
+            return found;
+        }
+    }
+};
+
+template <class K>
+struct set_adapter {
+    std::set<K> m;
+
+    bool insert(const K& k) { return m.insert(k).second; }
+    bool find(const K& k) const { return m.find(k) != m.end(); }
+    bool erase(const K& k) { return m.erase(k) != 0; }
+    std::uint64_t scan(const K& k, std::size_t n) const {
+        std::uint64_t s = 0;
+        for (auto it = m.lower_bound(k); it != m.end() && n; ++it, --n)
+            ++s;
+        return s;
+    }
+    std::size_t size() const { return m.size(); }
+    double rotations() const { return -1; }
+};
+
+template <class K>
+struct flat_adapter {
+    std::vector<std::pair<K, std::uint64_t>> v;
+
+    static bool less(const std::pair<K, std::uint64_t>& e, const K& k) { return e.first < k; }
+
+    auto lower(const K& k) const { return std::lower_bound(v.begin(), v.end(), k, less); }
+
+    // Sorting once beats N quadratic inserts when only lookups are timed.
+    void load(const std::vector<K>& keys) {
+        for (const K& k : keys)
+            v.emplace_back(k, 1);
+        std::sort(v.begin(), v.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        v.erase(std::unique(v.begin(), v.end(),
+                            [](const auto& a, const auto& b) { return a.first == b.first; }),
+                v.end());
+    }
+
+    bool insert(const K& k) {
+        auto it = lower(k);
+        if (it != v.end() && !(k < it->first))
+            return false;
+        v.emplace(it, k, 1);
+        return true;
+    }
+    bool find(const K& k) const {
+        auto it = lower(k);
+        return it != v.end() && !(k < it->first);
+    }
+    bool erase(const K& k) {
+        auto it = lower(k);
+        if (it == v.end() || k < it->first)
+            return false;
+        v.erase(it);
+        return true;
+    }
+    std::uint64_t scan(const K& k, std::size_t n) const {
+        std::uint64_t s = 0;
+        for (auto it = lower(k); it != v.end() && n; ++it, --n)
+            s += it->second;
+        return s;
+    }
+    std::size_t size() const { return v.size(); }
+    double rotations() const { return -1; }
+};
+
+// Read-only: loaded through an aa_tree and frozen.
+template <class K>
+struct frozen_adapter {
+    aa::frozen_map<K, std::uint64_t> m;
+
+    bool insert(const K&) { return false; }
+    void load(const std::vector<K>& keys) {
+        aa::aa_tree<K, std::uint64_t> staging;
+        for (const K& k : keys)
+            staging.emplace(k, 1);
+        m = staging.freeze();
+    }
+    bool find(const K& k) const { return m.find(k) != m.end(); }
+    bool erase(const K&) { return false; }
+    std::uint64_t scan(const K& k, std::size_t n) const {
+        std::uint64_t s = 0;
+        for (auto it = m.lower_bound(k); it != m.end() && n; ++it, --n)
+            s += it->second;
+        return s;
+    }
+    std::size_t size() const { return m.size(); }
+    double rotations() const { return -1; }
+};
+
+struct compact_traits : aa::default_tree_traits {
+    using layout = aa::compact_links;
+};
+
+struct prefetch_traits : compact_traits {
+    static constexpr bool prefetch = true;
+};
+
+struct stats_traits : aa::default_tree_traits {
+    using stats = aa::tree_stats;
+};
+
+template <class K>
+using aa_default = map_adapter<aa::aa_tree<K, std::uint64_t>>;
+
+template <class K>
+using aa_arena = map_adapter<
+    aa::aa_tree<K, std::uint64_t, std::less<K>,
+                aa::arena_allocator<std::pair<const K, std::uint64_t>>, compact_traits>>;
+
+template <class K>
+using aa_prefetch = map_adapter<
+    aa::aa_tree<K, std::uint64_t, std::less<K>,
+                aa::arena_allocator<std::pair<const K, std::uint64_t>>, prefetch_traits>>;
+
+template <class K>
+using aa_stats = map_adapter<aa::aa_tree<K, std::uint64_t, std::less<K>,
+                                         std::allocator<std::pair<const K, std::uint64_t>>,
+                                         stats_traits>>;
+
+template <class K>
+using std_map = map_adapter<std::map<K, std::uint64_t>>;
+
+// Workloads.
+
+enum class workload {
+    insert_seq,
+    insert_rand,
+    insert_zipf,
+    find_rand,
+    find_zipf,
+    find_batch,
+    erase_rand,
+    scan_100,
+};
+
+const char* workload_name(workload w) {
+    switch (w) {
+    case workload::insert_seq: return "insert_seq";
+    case workload::insert_rand: return "insert_rand";
+    case workload::insert_zipf: return "insert_zipf";
+    case workload::find_rand: return "find_rand";
+    case workload::find_zipf: return "find_zipf";
+    case workload::find_batch: return "find_batch";
+    case workload::erase_rand: return "erase_rand";
+    case workload::scan_100: return "scan_100";
+    }
+    return "?";
+}
+
+constexpr workload all_workloads[] = {
+    workload::insert_seq, workload::insert_rand, workload::insert_zipf, workload::find_rand,
+    workload::find_zipf,  workload::find_batch,  workload::erase_rand, workload::scan_100,
+};
+
+constexpr std::size_t scan_length = 100;
+
+// Key sequences for one (key type, N), shared by all containers.
+template <class K>
+struct inputs {
+    std::vector<K> sequential;  // 0, 1, ..., N-1
+    std::vector<K> random;      // N distinct keys in random order
+    std::vector<K> zipf;        // N draws, most of them repeats
+    std::vector<K> probes;      // N members of `random`, uniformly chosen
+    std::vector<K> shuffled;    // `random` in another random order
+
+    explicit inputs(std::size_t n) {
+        sequential.reserve(n);
+        random.reserve(n);
+        zipf.reserve(n);
+        probes.reserve(n);
+        shuffled.reserve(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            sequential.push_back(make_key<K>(i));
+            random.push_back(make_key<K>(mix(i)));
+        }
+        rng r(n);
+        zipf_generator z(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            zipf.push_back(make_key<K>(mix(z(r))));
+            probes.push_back(random[r() % n]);
+        }
+        shuffled = random;
+        for (std::size_t i = n; i > 1; --i)
+            std::swap(shuffled[i - 1], shuffled[r() % i]);
+    }
+};
+
+struct result {
+    double ns_per_op = 0;
+    double bytes_per_node = 0;
+    double rotations_per_op = -1;
+    // Why the run produced no numbers, or null when it did.
+    const char* skipped = nullptr;
+};
+
+using clock_type = std::chrono::steady_clock;
+
+double elapsed_ns(clock_type::time_point t0) {
+    return std::chrono::duration<double, std::nano>(clock_type::now() - t0).count();
+}
+
+// How a container copes with inserts and erases. Quadratic ones on the
+// flat vector stop being informative (and finishing) long before the trees
+// do; read-only containers skip them altogether.
+enum class updates { cheap, quadratic, none };
+
+constexpr std::size_t quadratic_update_limit = 100000;
+
+// Containers with load() fill up that way before lookups and scans.
+template <class C, class K, class = void>
+struct loads : std::false_type {};
+
+template <class C, class K>
+struct loads<C, K, std::void_t<decltype(std::declval<C&>().load(std::declval<const std::vector<K>&>()))>>
+    : std::true_type {};
+
+template <class C, class K>
+result run_once(workload w, const inputs<K>& in, updates u) {
+    std::size_t n = in.random.size();
+    result res;
+    bool update = w == workload::insert_seq || w == workload::insert_rand ||
+                  w == workload::insert_zipf || w == workload::erase_rand;
+    if (update && (u == updates::none ||
+                   (u == updates::quadratic && n > quadratic_update_limit &&
+                    w != workload::insert_seq))) {
+        res.skipped = "skipped";
+        return res;
+    }
+
+    std::size_t heap0 = heap_bytes();
+    C c;
+    auto populate = [&] {
+        if constexpr (loads<C, K>::value) {
+            c.load(in.random);
+        } else {
+            for (const K& k : in.random)
+                c.insert(k);
+        }
+    };
+
+    std::uint64_t acc = 0;
+    double ns = 0, ops = static_cast<double>(n);
+    double rot0 = 0;
+    std::size_t footprint = 0;
+
+    switch (w) {
+    case workload::insert_seq:
+    case workload::insert_rand:
+    case workload::insert_zipf: {
+        const std::vector<K>& keys = w == workload::insert_seq    ? in.sequential
+                                     : w == workload::insert_rand ? in.random
+                                                                  : in.zipf;
+        auto t0 = clock_type::now();
+        for (const K& k : keys)
+            acc += c.insert(k);
+        ns = elapsed_ns(t0);
+        footprint = heap_bytes() - heap0;
+        break;
+    }
+    case workload::find_rand:
+    case workload::find_zipf: {
+        populate();
+        footprint = heap_bytes() - heap0;
+        rot0 = c.rotations();
+        const std::vector<K>& keys = w == workload::find_rand ? in.probes : in.zipf;
+        auto t0 = clock_type::now();
+        for (const K& k : keys)
+            acc += c.find(k);
+        ns = elapsed_ns(t0);
+        break;
+    }
+    case workload::find_batch: {
+        populate();
+        footprint = heap_bytes() - heap0;
+        rot0 = c.rotations();
+        auto t0 = clock_type::now();
+        for (std::size_t i = 0; i < n; i += batch_size) {
+            const K* first = in.probes.data() + i;
+            acc += find_many(c, first, first + std::min(batch_size, n - i));
+        }
+        ns = elapsed_ns(t0);
+        break;
+    }
+    case workload::erase_rand: {
+        populate();
+        footprint = heap_bytes() - heap0;
+        rot0 = c.rotations();
+        auto t0 = clock_type::now();
+        for (const K& k : in.shuffled)
+            acc += c.erase(k);
+        ns = elapsed_ns(t0);
+        break;
+    }
+    case workload::scan_100: {
+        populate();
+        footprint = heap_bytes() - heap0;
+        rot0 = c.rotations();
+        std::size_t scans = std::max<std::size_t>(n / scan_length, 1000);
+        auto t0 = clock_type::now();
+        for (std::size_t i = 0; i < scans; ++i)
+            acc += c.scan(in.probes[i % n], scan_length);
+        ns = elapsed_ns(t0);
+        ops = static_cast<double>(scans * scan_length);
+        break;
+    }
+    }
+
+    sink = acc;
+    std::size_t size = w == workload::erase_rand ? n : std::max<std::size_t>(c.size(), 1);
+    res.ns_per_op = ns / ops;
+    res.bytes_per_node = static_cast<double>(footprint) / static_cast<double>(size);
+    double rot = c.rotations();
+    if (rot >= 0)
+        res.rotations_per_op = (rot - rot0) / ops;
+    return res;
+}
+
+// Repeats small runs so that each row covers at least ~2^20 operations.
+template <class C, class K>
+result run(workload w, const inputs<K>& in, updates u) {
+    std::size_t n = in.random.size();
+    std::size_t reps = std::max<std::size_t>((std::size_t(1) << 20) / std::max<std::size_t>(n, 1), 1);
+    result sum;
+    sum.rotations_per_op = 0;
+    for (std::size_t i = 0; i < reps; ++i) {
+        result r;
+        try {
+            r = run_once<C>(w, in, u);
+        } catch (const std::length_error&) {
+            // compact_links nodes must lie within 2 GiB of each other;
+            // past that the tree refuses the node that would not fit.
+            r.skipped = "over span";
+        }
+        if (r.skipped)
+            return r;
+        sum.ns_per_op += r.ns_per_op;
+        sum.bytes_per_node += r.bytes_per_node;
+        sum.rotations_per_op = r.rotations_per_op < 0 ? -1 : sum.rotations_per_op + r.rotations_per_op;
+    }
+    sum.ns_per_op /= static_cast<double>(reps);
+    sum.bytes_per_node /= static_cast<double>(reps);
+    if (sum.rotations_per_op >= 0)
+        sum.rotations_per_op /= static_cast<double>(reps);
+    return sum;
+}
+
+struct options {
+    std::vector<std::size_t> sizes{1000, 10000, 100000, 1000000};
+    std::vector<std::string> filters;
+
+    // True when id contains any filter, or there are none.
+    bool wants(const std::string& id) const {
+        if (filters.empty())
+            return true;
+        for (const std::string& f : filters)
+            if (id.find(f) != std::string::npos)
+                return true;
+        return false;
+    }
+};
+
+void print_header() {
+    std::printf("%-10s %-9s %-12s %10s %10s %11s %8s\n", "container", "key", "workload", "N",
+                "ns/op", "bytes/node", "rot/op");
+}
+
+void print_row(const char* container, const char* key, workload w, std::size_t n, const result& r) {
+    std::printf("%-10s %-9s %-12s %10zu ", container, key, workload_name(w), n);
+    if (r.skipped) {
+        std::printf("%10s %11s %8s\n", r.skipped, "-", "-");
+        return;
+    }
+    std::printf("%10.1f ", r.ns_per_op);
+#ifdef AA_BENCH_HEAP_ACCOUNTING
+    std::printf("%11.1f ", r.bytes_per_node);
+#else
+    std::printf("%11s ", "-");
+#endif
+    if (r.rotations_per_op >= 0)
+        std::printf("%8.3f\n", r.rotations_per_op);
+    else
+        std::printf("%8s\n", "-");
+    std::fflush(stdout);
+}
+
+template <class C, class K>
+void run_container(const char* name, const options& opt, const inputs<K>& in,
+                   updates u = updates::cheap) {
+    for (workload w : all_workloads) {
+        std::string id = std::string(name) + "/" + key_name<K>() + "/" + workload_name(w);
+        if (!opt.wants(id))
+            continue;
+        print_row(name, key_name<K>(), w, in.random.size(), run<C>(w, in, u));
+    }
+}
+
+template <class K>
+void run_key(const options& opt, std::initializer_list<const char*> containers) {
+    // Generating inputs dominates at large N; skip key types the filter
+    // rules out.
+    bool wanted = false;
+    for (const char* c : containers)
+        for (workload w : all_workloads)
+            wanted |= opt.wants(std::string(c) + "/" + key_name<K>() + "/" + workload_name(w));
+    if (!wanted)
+        return;
+    for (std::size_t n : opt.sizes) {
+        inputs<K> in(n);
+        run_container<aa_default<K>>("aa_tree", opt, in);
+        run_container<aa_arena<K>>("aa_arena", opt, in);
+        run_container<aa_prefetch<K>>("aa_pf", opt, in);
+        run_container<aa_stats<K>>("aa_stats", opt, in);
+        run_container<std_map<K>>("std::map", opt, in);
+        run_container<set_adapter<K>>("std::set", opt, in);
+        run_container<flat_adapter<K>>("flat_vec", opt, in, updates::quadratic);
+        run_container<frozen_adapter<K>>("frozen", opt, in, updates::none);
+    }
+}
+
+std::vector<std::size_t> parse_sizes(const char* s) {
+    std::vector<std::size_t> out;
+    while (*s) {
+        char* end;
+        double v = std::strtod(s, &end);
+        if (end == s || v < 1) {
+            std::fprintf(stderr, "bad size list\n");
+            std::exit(2);
+        }
+        out.push_back(static_cast<std::size_t>(v));
+        s = *end == ',' ? end + 1 : end;
+    }
+    return out;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    options opt;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--sizes=", 8) == 0) {
+            opt.sizes = parse_sizes(argv[i] + 8);
+        } else if (std::strncmp(argv[i], "--filter=", 9) == 0) {
+            for (const char* f = argv[i] + 9; *f;) {
+                const char* end = std::strchr(f, ',');
+                opt.filters.emplace_back(f, end ? end : f + std::strlen(f));
+                f = end ? end + 1 : f + std::strlen(f);
+            }
+        } else {
+            std::fprintf(stderr, "usage: %s [--sizes=1e3,1e4,...] [--filter=a,b,...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // aa_tree: default layout, global heap. aa_arena: compact_links nodes
+    // in an arena_allocator slab. aa_pf: aa_arena with prefetching
+    // searches. aa_stats: aa_tree with tree_stats, which
+    // supplies rot/op at the price of an atomic add per hook. std::set
+    // stores keys only. frozen: aa_tree::freeze() output, lookups only.
+    print_header();
+    auto containers = {"aa_tree", "aa_arena", "aa_pf", "aa_stats", "std::map", "std::set", "flat_vec", "frozen"};
+    run_key<std::uint64_t>(opt, containers);
+    run_key<std::string>(opt, containers);
+    run_key<key64>(opt, containers);
+}
@@ -0,0 +1,1994 @@
+// Header-only AA-tree (Andersson tree) ordered map.
+//
+// An AA-tree is a red-black tree in which red nodes may only be right
+// children. Balance is expressed through an integer level per node and
+// restored with two local rotations, skew and split. The container mirrors
+// the std::map interface so it can be dropped into existing code.
+
+#ifndef AA_AA_TREE_HPP
+#define AA_AA_TREE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "augment.hpp"
+#include "frozen.hpp"
+#include "node_layout.hpp"
+#include "stats.hpp"
+
+namespace aa {
+
+// Compile-time options for aa_tree. Derive from this struct and override
+// the members that should differ:
+//
+//     struct compact : aa::default_tree_traits {
+//         using layout = aa::compact_links;
+//     };
+//     aa::aa_tree<std::uint64_t, std::uint32_t, std::less<>,
+//                 std::allocator<...>, compact> index;
+struct default_tree_traits {
+    // How nodes store children and level; see node_layout.hpp.
+    using layout = plain_links;
+    // Per-node data maintained across rotations; see augment.hpp.
+    using augment = no_augment;
+    // Rebalancing and search-path instrumentation; see stats.hpp.
+    using stats = no_stats;
+    // Searches prefetch both children of each node before comparing at it,
+    // so the next level's miss overlaps the current comparison. Pays off on
+    // trees much larger than the last-level cache.
+    static constexpr bool prefetch = false;
+    // Nodes also link to their in-order neighbours, so iterator increment
+    // and decrement follow one pointer instead of walking the tree. The
+    // links cost two raw pointers per node, and are kept up by inserts,
+    // erases, batches, join and split_off; set algebra relinks its whole
+    // result in O(n).
+    static constexpr bool threaded = false;
+};
+
+namespace detail {
+
+// Upper bound on the height of any AA-tree whose size fits in size_t:
+// a tree of height h holds at least 2^(h/2) - 1 nodes.
+inline constexpr std::size_t max_height = 2 * std::numeric_limits<std::size_t>::digits;
+
+struct serial_access;
+
+// Hands the root node of a tree to code that walks its structure, such as
+// the invariant checks of the tests.
+struct root_access {
+    template <class Tree>
+    static auto root(const Tree& t) noexcept {
+        return t.root_node();
+    }
+};
+
+// Element count of a tree produced by split_off until size() recounts it.
+inline constexpr std::size_t unknown_size = std::numeric_limits<std::size_t>::max();
+
+// Successor and predecessor links of threaded trees; empty otherwise.
+template <class Node, bool Threaded>
+struct thread_links {
+    static constexpr bool threaded = false;
+};
+
+template <class Node>
+struct thread_links<Node, true> {
+    static constexpr bool threaded = true;
+
+    Node* next = nullptr;
+    Node* prev = nullptr;
+};
+
+// Whether Node keeps thread_links. Node types that share tree_base and the
+// iterators without deriving from thread_links, such as the shared nodes
+// of persistent trees, count as unthreaded.
+template <class Node, class = void>
+struct is_threaded : std::false_type {};
+
+template <class Node>
+struct is_threaded<Node, std::void_t<decltype(Node::threaded)>>
+    : std::integral_constant<bool, Node::threaded> {};
+
+// Nodes carry no parent pointer; upward walks use a recorded search path.
+// Children and level live in the layout's links base, augmented data in
+// the augment's node_data base (empty by default), in-order neighbours in
+// the thread_links base.
+template <class Value, class Layout, class Augment, bool Threaded>
+struct node : Layout::template links<node<Value, Layout, Augment, Threaded>>,
+              Augment::template node_data<node<Value, Layout, Augment, Threaded>>,
+              thread_links<node<Value, Layout, Augment, Threaded>, Threaded> {
+    // Constructed separately through the allocator.
+    union {
+        Value value;
+    };
+
+    node() noexcept {}
+    ~node() {}
+};
+
+// Cache line size assumed by prefetch_node.
+inline constexpr std::size_t cache_line = 64;
+
+// Requests every cache line of *n (at most two) ahead of use. A hint only:
+// it never faults, even for null.
+template <class Node>
+inline void prefetch_node(const Node* n) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+    auto p = reinterpret_cast<std::uintptr_t>(n);
+    __builtin_prefetch(reinterpret_cast<const void*>(p));
+    if constexpr (sizeof(Node) > cache_line)
+        __builtin_prefetch(reinterpret_cast<const void*>(p + cache_line));
+#else
+    (void)n;
+#endif
+}
+
+template <class Node>
+inline Node* leftmost(Node* n) noexcept {
+    while (n->left())
+        n = n->left();
+    return n;
+}
+
+template <class Node>
+inline Node* rightmost(Node* n) noexcept {
+    while (n->right())
+        n = n->right();
+    return n;
+}
+
+// Root-to-node chain filled during descent and consumed bottom-up while
+// rebalancing. Lives on the stack; the array is deliberately uninitialised.
+template <class Node>
+struct search_path {
+    Node* nodes[max_height];
+    std::size_t size = 0;
+
+    void push(Node* n) noexcept { nodes[size++] = n; }
+};
+
+// Forward iterator over a subtree in key order that carries its own stack
+// of pending ancestors, so a whole walk costs O(N) however the nodes are
+// linked, where tree_iterator may descend from the root at each step. For
+// copying every element out of a tree; copies carry their own stack.
+template <class Node>
+class in_order_iterator {
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using reference = decltype((std::declval<Node&>().value));
+    using value_type = std::remove_reference_t<reference>;
+    using pointer = value_type*;
+    using difference_type = std::ptrdiff_t;
+
+    in_order_iterator() noexcept = default;
+    explicit in_order_iterator(Node* root) noexcept { descend(root); }
+    in_order_iterator(const in_order_iterator& other) noexcept
+        : node_(other.node_) {
+        std::copy(other.stack_.nodes, other.stack_.nodes + other.stack_.size, stack_.nodes);
+        stack_.size = other.stack_.size;
+    }
+    in_order_iterator& operator=(const in_order_iterator& other) noexcept {
+        std::copy(other.stack_.nodes, other.stack_.nodes + other.stack_.size, stack_.nodes);
+        stack_.size = other.stack_.size;
+        node_ = other.node_;
+        return *this;
+    }
+
+    reference operator*() const noexcept { return node_->value; }
+    pointer operator->() const noexcept { return std::addressof(node_->value); }
+
+    in_order_iterator& operator++() noexcept {
+        descend(node_->right());
+        return *this;
+    }
+    in_order_iterator operator++(int) noexcept {
+        in_order_iterator tmp = *this;
+        ++*this;
+        return tmp;
+    }
+
+    friend bool operator==(const in_order_iterator& a, const in_order_iterator& b) noexcept {
+        return a.node_ == b.node_;
+    }
+    friend bool operator!=(const in_order_iterator& a, const in_order_iterator& b) noexcept {
+        return a.node_ != b.node_;
+    }
+
+private:
+    // Moves to the leftmost node of n, or to the nearest pending ancestor
+    // if n is empty.
+    void descend(Node* n) noexcept {
+        for (; n; n = n->left())
+            stack_.push(n);
+        node_ = stack_.size ? stack_.nodes[--stack_.size] : nullptr;
+    }
+
+    search_path<Node> stack_;
+    Node* node_ = nullptr;
+};
+
+// Detects allocators such as arena_allocator that can free everything they
+// handed out in one call.
+template <class Alloc, class = void>
+struct has_bulk_release : std::false_type {};
+
+template <class Alloc>
+struct has_bulk_release<Alloc, std::void_t<decltype(std::declval<Alloc&>().release()),
+                                           decltype(std::declval<const Alloc&>().live())>>
+    : std::true_type {};
+
+// Holds the comparator, node allocator and stats so that empty ones take no
+// space.
+template <class Compare, class NodeAlloc, class Node, class Span, class Stats>
+struct tree_base : Compare, NodeAlloc, Span, Stats {
+    Node* root = nullptr;
+    mutable std::size_t count = 0;
+
+    tree_base(const Compare& comp, const NodeAlloc& alloc)
+        : Compare(comp), NodeAlloc(alloc) {}
+
+    Compare& comp() noexcept { return *this; }
+    const Compare& comp() const noexcept { return *this; }
+    NodeAlloc& alloc() noexcept { return *this; }
+    const NodeAlloc& alloc() const noexcept { return *this; }
+    Span& span() noexcept { return *this; }
+    const Stats& stats() const noexcept { return *this; }
+
+    // Without parent pointers or threads, a node lacking the relevant
+    // subtree finds its neighbour by descending again from the root: the
+    // last node where the search turned towards n is the answer.
+    Node* successor(const Node* n) const {
+        if constexpr (is_threaded<Node>::value)
+            return n->next;
+        if (n->right())
+            return leftmost(n->right());
+        Node* succ = nullptr;
+        for (Node* x = root; x != n;) {
+            if (comp()(n->value.first, x->value.first)) {
+                succ = x;
+                x = x->left();
+            } else {
+                x = x->right();
+            }
+        }
+        return succ;
+    }
+
+    Node* predecessor(const Node* n) const {
+        if constexpr (is_threaded<Node>::value)
+            return n->prev;
+        if (n->left())
+            return rightmost(n->left());
+        Node* pred = nullptr;
+        for (Node* x = root; x != n;) {
+            if (comp()(x->value.first, n->value.first)) {
+                pred = x;
+                x = x->right();
+            } else {
+                x = x->left();
+            }
+        }
+        return pred;
+    }
+};
+
+} // namespace detail
+
+// Bidirectional iterator over an aa_tree. Nodes have no parent pointers, so
+// a step from a node without a subtree in the direction of travel searches
+// again from the root: O(log N) in the worst case and Θ(log N) on average
+// over a whole traversal, not amortized O(1) as for std::map. Sequential
+// readers should use for_each, a scan cursor or threaded traits, which
+// cost O(1) per element. An iterator also points at the tree object, so
+// moving or swapping the tree invalidates it, unlike std::map iterators.
+template <class Tree, bool Const>
+class tree_iterator {
+    using node_type = typename Tree::node_type;
+    friend Tree;
+    friend class tree_iterator<Tree, !Const>;
+
+public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = typename Tree::value_type;
+    using difference_type = typename Tree::difference_type;
+    using reference = std::conditional_t<Const, const value_type&, value_type&>;
+    using pointer = std::conditional_t<Const, const value_type*, value_type*>;
+
+    tree_iterator() noexcept = default;
+
+    template <bool C = Const, class = std::enable_if_t<C>>
+    tree_iterator(const tree_iterator<Tree, false>& other) noexcept
+        : node_(other.node_), tree_(other.tree_) {}
+
+    reference operator*() const noexcept { return node_->value; }
+    pointer operator->() const noexcept { return std::addressof(node_->value); }
+
+    tree_iterator& operator++() {
+        node_ = tree_->successor(node_);
+        return *this;
+    }
+    tree_iterator operator++(int) {
+        tree_iterator tmp = *this;
+        ++*this;
+        return tmp;
+    }
+    tree_iterator& operator--() {
+        node_ = node_ ? tree_->predecessor(node_) : detail::rightmost(tree_->root);
+        return *this;
+    }
+    tree_iterator operator--(int) {
+        tree_iterator tmp = *this;
+        --*this;
+        return tmp;
+    }
+
+    friend bool operator==(const tree_iterator& a, const tree_iterator& b) noexcept {
+        return a.node_ == b.node_;
+    }
+    friend bool operator!=(const tree_iterator& a, const tree_iterator& b) noexcept {
+        return a.node_ != b.node_;
+    }
+
+private:
+    using base_type = typename Tree::base_type;
+
+    tree_iterator(node_type* n, const base_type* t) noexcept : node_(n), tree_(t) {}
+
+    node_type* node_ = nullptr;
+    const base_type* tree_ = nullptr;
+};
+
+// Walks the keys in [lo, hi) of a tree in order, a batch at a time. The
+// position between batches is the stack of pending ancestors (or, in a
+// threaded tree, just the next node), so each batch resumes where the last
+// one stopped without descending from the root again. Like iterators, a
+// cursor is invalidated by any change to the tree and by moving or
+// swapping it.
+template <class Tree, bool Const>
+class tree_scan_cursor {
+    using node_type = typename Tree::node_type;
+    using key_type = typename Tree::key_type;
+    friend Tree;
+
+public:
+    using value_type = typename Tree::value_type;
+    using size_type = typename Tree::size_type;
+    using pointer = std::conditional_t<Const, const value_type*, value_type*>;
+
+    // True once every element of the range has been returned.
+    bool done() const noexcept { return node_ == nullptr; }
+
+    // Points batch at the next elements, up to the batch size, and returns
+    // it; empty once the range is exhausted. The vector is reused by the
+    // next call.
+    const std::vector<pointer>& next() {
+        batch_.clear();
+        for (; node_ && batch_.size() < batch_size_; advance())
+            batch_.push_back(std::addressof(node_->value));
+        return batch_;
+    }
+
+    // Copies the next elements, up to the batch size, to out and returns
+    // the advanced out. value_type has a const key, so out usually writes
+    // std::pair<Key, T> or some other assignable record.
+    template <class OutputIt>
+    OutputIt next(OutputIt out) {
+        for (size_type i = 0; node_ && i < batch_size_; ++i, advance())
+            *out++ = node_->value;
+        return out;
+    }
+
+private:
+    using base_type = typename Tree::base_type;
+
+    tree_scan_cursor(const base_type* t, const key_type& lo, const key_type& hi,
+                     size_type batch_size)
+        : tree_(t), hi_(hi), batch_size_(batch_size ? batch_size : 1) {
+        // Lower-bound descent; every node passed on the left is still due.
+        for (node_type* n = t->root; n;) {
+            if (t->comp()(n->value.first, lo)) {
+                n = n->right();
+            } else {
+                if constexpr (detail::is_threaded<node_type>::value)
+                    node_ = n;
+                else
+                    stack_.push(n);
+                n = n->left();
+            }
+        }
+        if constexpr (!detail::is_threaded<node_type>::value)
+            node_ = stack_.size ? stack_.nodes[--stack_.size] : nullptr;
+        stop_at_hi();
+    }
+
+    void advance() noexcept {
+        if constexpr (detail::is_threaded<node_type>::value) {
+            node_ = node_->next;
+        } else {
+            for (node_type* n = node_->right(); n; n = n->left())
+                stack_.push(n);
+            node_ = stack_.size ? stack_.nodes[--stack_.size] : nullptr;
+        }
+        stop_at_hi();
+    }
+
+    void stop_at_hi() {
+        if (node_ && !tree_->comp()(node_->value.first, hi_))
+            node_ = nullptr;
+    }
+
+    const base_type* tree_;
+    key_type hi_;
+    size_type batch_size_;
+    node_type* node_ = nullptr;
+    detail::search_path<node_type> stack_;
+    std::vector<pointer> batch_;
+};
+
+template <class Key, class T, class Compare, class Traits>
+class mapped_aa_tree;
+
+template <class Key, class T, class Compare = std::less<Key>,
+          class Allocator = std::allocator<std::pair<const Key, T>>,
+          class Traits = default_tree_traits>
+class aa_tree {
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<const Key, T>;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using key_compare = Compare;
+    using allocator_type = Allocator;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+    using pointer = typename std::allocator_traits<Allocator>::pointer;
+    using const_pointer = typename std::allocator_traits<Allocator>::const_pointer;
+    using iterator = tree_iterator<aa_tree, false>;
+    using const_iterator = tree_iterator<aa_tree, true>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+    using scan_cursor = tree_scan_cursor<aa_tree, false>;
+    using const_scan_cursor = tree_scan_cursor<aa_tree, true>;
+    using stats_type = typename Traits::stats;
+
+    class value_compare {
+        friend aa_tree;
+
+    public:
+        bool operator()(const value_type& a, const value_type& b) const {
+            return comp(a.first, b.first);
+        }
+
+    protected:
+        explicit value_compare(Compare c) : comp(std::move(c)) {}
+        Compare comp;
+    };
+
+private:
+    using layout = typename Traits::layout;
+    using augment = typename Traits::augment;
+    using node_type = detail::node<value_type, layout, augment, Traits::threaded>;
+    using alloc_traits = std::allocator_traits<Allocator>;
+    using node_allocator = typename alloc_traits::template rebind_alloc<node_type>;
+    using node_alloc_traits = std::allocator_traits<node_allocator>;
+    using base_type = detail::tree_base<Compare, node_allocator, node_type,
+                                        detail::span_tracker<layout::max_span>, stats_type>;
+    friend iterator;
+    friend const_iterator;
+    friend scan_cursor;
+    friend const_scan_cursor;
+    // Attaches to and detaches from nodes that outlive the tree object.
+    template <class, class, class, class>
+    friend class mapped_aa_tree;
+    friend struct detail::serial_access;
+    friend struct detail::root_access;
+
+public:
+    aa_tree() : aa_tree(Compare()) {}
+
+    explicit aa_tree(const Compare& comp, const Allocator& alloc = Allocator())
+        : base_(comp, node_allocator(alloc)) {}
+
+    explicit aa_tree(const Allocator& alloc) : aa_tree(Compare(), alloc) {}
+
+    template <class InputIt>
+    aa_tree(InputIt first, InputIt last, const Compare& comp = Compare(),
+            const Allocator& alloc = Allocator())
+        : aa_tree(comp, alloc) {
+        insert(first, last);
+    }
+
+    aa_tree(std::initializer_list<value_type> init, const Compare& comp = Compare(),
+            const Allocator& alloc = Allocator())
+        : aa_tree(init.begin(), init.end(), comp, alloc) {}
+
+    aa_tree(const aa_tree& other)
+        : base_(other.base_.comp(),
+                node_alloc_traits::select_on_container_copy_construction(other.base_.alloc())) {
+        base_.root = clone(other.base_.root);
+        base_.count = other.base_.count;
+        rethread();
+    }
+
+    aa_tree(aa_tree&& other) noexcept
+        : base_(std::move(other.base_.comp()), std::move(other.base_.alloc())) {
+        steal(other);
+    }
+
+    ~aa_tree() { destroy_all(); }
+
+    aa_tree& operator=(const aa_tree& other) {
+        if (this != &other) {
+            clear();
+            base_.comp() = other.base_.comp();
+            if constexpr (node_alloc_traits::propagate_on_container_copy_assignment::value)
+                base_.alloc() = other.base_.alloc();
+            base_.root = clone(other.base_.root);
+            base_.count = other.base_.count;
+            rethread();
+        }
+        return *this;
+    }
+
+    aa_tree& operator=(aa_tree&& other) noexcept(
+        node_alloc_traits::propagate_on_container_move_assignment::value ||
+        node_alloc_traits::is_always_equal::value) {
+        if (this == &other)
+            return *this;
+        clear();
+        base_.comp() = std::move(other.base_.comp());
+        if constexpr (node_alloc_traits::propagate_on_container_move_assignment::value) {
+            base_.alloc() = std::move(other.base_.alloc());
+            steal(other);
+        } else if (node_alloc_traits::is_always_equal::value ||
+                   base_.alloc() == other.base_.alloc()) {
+            steal(other);
+        } else {
+            for (auto& v : other)
+                emplace(std::move(const_cast<Key&>(v.first)), std::move(v.second));
+            other.clear();
+        }
+        return *this;
+    }
+
+    aa_tree& operator=(std::initializer_list<value_type> init) {
+        clear();
+        insert(init);
+        return *this;
+    }
+
+    allocator_type get_allocator() const { return allocator_type(base_.alloc()); }
+    key_compare key_comp() const { return base_.comp(); }
+    value_compare value_comp() const { return value_compare(base_.comp()); }
+
+    // Iterators.
+
+    iterator begin() noexcept { return make_iter(first_node()); }
+    const_iterator begin() const noexcept { return make_citer(first_node()); }
+    const_iterator cbegin() const noexcept { return begin(); }
+    iterator end() noexcept { return make_iter(nullptr); }
+    const_iterator end() const noexcept { return make_citer(nullptr); }
+    const_iterator cend() const noexcept { return end(); }
+    reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+    const_reverse_iterator crbegin() const noexcept { return rbegin(); }
+    reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+    const_reverse_iterator crend() const noexcept { return rend(); }
+
+    // Calls f on every element in key order. O(N) in all: the walk keeps a
+    // stack of pending ancestors, where stepping an iterator of a tree
+    // without threads may descend from the root again.
+    template <class F>
+    void for_each(F f) {
+        using walk = detail::in_order_iterator<node_type>;
+        std::for_each(walk(base_.root), walk(), f);
+    }
+    template <class F>
+    void for_each(F f) const {
+        using walk = detail::in_order_iterator<const node_type>;
+        std::for_each(walk(base_.root), walk(), f);
+    }
+
+    // Calls f on every element, visiting disjoint key ranges on up to
+    // threads threads at once: near the top of the tree the right subtree
+    // of each node goes to another thread while this one continues left.
+    // Each range is visited in key order, but ranges interleave, so f must
+    // be safe to call concurrently. The first exception f throws is
+    // rethrown once every thread has finished.
+    template <class F>
+    void parallel_for_each(F f, unsigned threads = std::thread::hardware_concurrency()) {
+        visit_parallel<value_type>(base_.root, f, forks_for(threads));
+    }
+    template <class F>
+    void parallel_for_each(F f, unsigned threads = std::thread::hardware_concurrency()) const {
+        visit_parallel<const value_type>(base_.root, f, forks_for(threads));
+    }
+
+    // Capacity.
+
+    [[nodiscard]] bool empty() const noexcept { return base_.root == nullptr; }
+
+    // O(1), except for the first call after split_off, which counts.
+    size_type size() const noexcept {
+        if (base_.count == detail::unknown_size)
+            base_.count = count_nodes(base_.root);
+        return base_.count;
+    }
+    size_type max_size() const noexcept { return node_alloc_traits::max_size(base_.alloc()); }
+
+    // Element access.
+
+    T& operator[](const Key& key) { return try_emplace(key).first->second; }
+    T& operator[](Key&& key) { return try_emplace(std::move(key)).first->second; }
+
+    T& at(const Key& key) {
+        node_type* n = find_node(key);
+        if (!n)
+            throw std::out_of_range("aa_tree::at");
+        return n->value.second;
+    }
+    const T& at(const Key& key) const {
+        node_type* n = find_node(key);
+        if (!n)
+            throw std::out_of_range("aa_tree::at");
+        return n->value.second;
+    }
+
+    // Modifiers.
+
+    void clear() noexcept {
+        destroy_all();
+        base_.root = nullptr;
+        base_.count = 0;
+        base_.span().reset();
+    }
+
+    // Replaces the contents with [first, last), which must be sorted by
+    // strictly increasing key. Runs in linear time: the tree is built with
+    // median splits and levels are assigned directly from subtree sizes, so
+    // no skew or split is ever needed. Nodes are allocated in key order,
+    // which places them contiguously in a fresh arena.
+    template <class InputIt>
+    void build_from_sorted(InputIt first, InputIt last) {
+        using category = typename std::iterator_traits<InputIt>::iterator_category;
+        if constexpr (std::is_base_of<std::forward_iterator_tag, category>::value) {
+            auto n = static_cast<size_type>(std::distance(first, last));
+            clear();
+            base_.root = build_sorted(first, n);
+            base_.count = n;
+            rethread();
+        } else {
+            std::vector<value_type> buffer(first, last);
+            build_from_sorted(std::make_move_iterator(buffer.begin()),
+                              std::make_move_iterator(buffer.end()));
+        }
+    }
+
+    // Like build_from_sorted, but the subtrees near the top are built on up
+    // to threads threads at once, each into its own nodes, and linked
+    // afterwards. The allocator must allow allocation from several threads:
+    // std::allocator does, arena_allocator needs arena_options::thread_cache.
+    // Nodes are no longer allocated in key order.
+    template <class RandomIt>
+    void parallel_build_from_sorted(RandomIt first, RandomIt last,
+                                    unsigned threads = std::thread::hardware_concurrency()) {
+        static_assert(std::is_base_of<std::random_access_iterator_tag,
+                                      typename std::iterator_traits<RandomIt>::iterator_category>::value,
+                      "parallel_build_from_sorted needs random access iterators");
+        auto n = static_cast<size_type>(last - first);
+        clear();
+        base_.root = build_sorted_parallel(first, n, forks_for(threads));
+        base_.count = n;
+        rethread();
+    }
+
+    std::pair<iterator, bool> insert(const value_type& v) { return emplace(v); }
+    std::pair<iterator, bool> insert(value_type&& v) { return emplace(std::move(v)); }
+
+    template <class P, class = std::enable_if_t<std::is_constructible<value_type, P&&>::value>>
+    std::pair<iterator, bool> insert(P&& v) {
+        return emplace(std::forward<P>(v));
+    }
+
+    iterator insert(const_iterator, const value_type& v) { return insert(v).first; }
+    iterator insert(const_iterator, value_type&& v) { return insert(std::move(v)).first; }
+
+    template <class InputIt>
+    void insert(InputIt first, InputIt last) {
+        for (; first != last; ++first)
+            emplace(*first);
+    }
+
+    void insert(std::initializer_list<value_type> init) { insert(init.begin(), init.end()); }
+
+    // With a monoid_augment, the aggregates above an assigned element are
+    // refreshed; assigning through an iterator or operator[] leaves them
+    // stale.
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(const Key& key, M&& obj) {
+        auto r = try_emplace(key, std::forward<M>(obj));
+        if (!r.second)
+            assign(r.first, std::forward<M>(obj));
+        return r;
+    }
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(Key&& key, M&& obj) {
+        auto r = try_emplace(std::move(key), std::forward<M>(obj));
+        if (!r.second)
+            assign(r.first, std::forward<M>(obj));
+        return r;
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        node_type* z = create_node(std::forward<Args>(args)...);
+        path_type path;
+        bool left = false;
+        if (node_type* found = descend(z->value.first, path, left)) {
+            drop_node(z);
+            return {make_iter(found), false};
+        }
+        link_node(z, path, left);
+        return {make_iter(z), true};
+    }
+
+    template <class... Args>
+    iterator emplace_hint(const_iterator, Args&&... args) {
+        return emplace(std::forward<Args>(args)...).first;
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args) {
+        return try_emplace_impl(key, std::forward<Args>(args)...);
+    }
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args) {
+        return try_emplace_impl(std::move(key), std::forward<Args>(args)...);
+    }
+
+    iterator erase(iterator pos) { return erase(const_iterator(pos)); }
+
+    iterator erase(const_iterator pos) {
+        node_type* z = pos.node_;
+        node_type* next = base_.successor(z);
+        path_type path;
+        bool left;
+        descend(z->value.first, path, left);
+        erase_at(path);
+        return make_iter(next);
+    }
+
+    iterator erase(const_iterator first, const_iterator last) {
+        while (first != last)
+            first = erase(first);
+        return make_iter(last.node_);
+    }
+
+    size_type erase(const Key& key) {
+        path_type path;
+        bool left;
+        if (!descend(key, path, left))
+            return 0;
+        erase_at(path);
+        return 1;
+    }
+
+    // Inserts every element of [first, last) whose key is not yet present;
+    // among equal keys in the batch the first one wins. The batch is sorted
+    // and, when it is large relative to the tree, merged with the flattened
+    // tree in one linear pass and rebuilt without any skew or split.
+    // Returns the number of elements inserted.
+    template <class ForwardIt>
+    size_type insert_batch(ForwardIt first, ForwardIt last) {
+        std::vector<ForwardIt> batch = sorted_batch(first, last, [](const auto& v) -> const Key& {
+            return v.first;
+        });
+        if (!merge_pays(batch.size())) {
+            size_type inserted = 0;
+            for (ForwardIt it : batch)
+                inserted += emplace(*it).second;
+            return inserted;
+        }
+
+        size_type inserted = 0;
+        list_merge merge(*this);
+        try {
+            for (ForwardIt it : batch) {
+                const Key& key = (*it).first;
+                merge.skip_below(key);
+                if (merge.rest && !less(key, merge.rest->value.first))
+                    continue;
+                merge.append(create_node(*it));
+                ++inserted;
+            }
+        } catch (...) {
+            merge.finish(base_.count + inserted);
+            throw;
+        }
+        merge.finish(base_.count + inserted);
+        return inserted;
+    }
+
+    // Erases every key in [first, last) that is present, using the same
+    // sort-and-merge strategy as insert_batch. Returns the number erased.
+    template <class ForwardIt>
+    size_type erase_batch(ForwardIt first, ForwardIt last) {
+        std::vector<ForwardIt> batch = sorted_batch(first, last, [](const Key& k) -> const Key& {
+            return k;
+        });
+        if (!merge_pays(batch.size())) {
+            size_type erased = 0;
+            for (ForwardIt it : batch)
+                erased += erase(*it);
+            return erased;
+        }
+
+        size_type erased = 0;
+        list_merge merge(*this);
+        try {
+            for (ForwardIt it : batch) {
+                merge.skip_below(*it);
+                if (merge.rest && !less(*it, merge.rest->value.first)) {
+                    node_type* next = merge.rest->right();
+                    drop_node(merge.rest);
+                    merge.rest = next;
+                    ++erased;
+                }
+            }
+        } catch (...) {
+            merge.finish(base_.count - erased);
+            throw;
+        }
+        merge.finish(base_.count - erased);
+        return erased;
+    }
+
+    void swap(aa_tree& other) noexcept {
+        using std::swap;
+        swap(base_.comp(), other.base_.comp());
+        if constexpr (node_alloc_traits::propagate_on_container_swap::value)
+            swap(base_.alloc(), other.base_.alloc());
+        swap(base_.root, other.base_.root);
+        swap(base_.count, other.base_.count);
+        swap(base_.span(), other.base_.span());
+    }
+
+    friend void swap(aa_tree& a, aa_tree& b) noexcept { a.swap(b); }
+
+    // Split and join. Both relink existing nodes in O(log N) when the trees
+    // share an allocator (construct them from one allocator object);
+    // otherwise the right-hand tree is first copied into the left-hand
+    // tree's allocator.
+
+    // Concatenates left, mid and right, whose keys must satisfy
+    // left < mid < right. Costs O(|level(left) - level(right)| + 1).
+    template <class V>
+    static aa_tree join(aa_tree&& left, V&& mid, aa_tree&& right) {
+        aa_tree result = std::move(left);
+        aa_tree rhs = result.adopt(std::move(right));
+        node_type* k = result.create_node(std::forward<V>(mid));
+        thread_join(result.base_.root, k, rhs.base_.root);
+        result.base_.root = result.join_nodes(result.base_.root, k, rhs.base_.root);
+        result.base_.count = sum_counts(result.base_.count, rhs.base_.count, 1);
+        rhs.release_nodes();
+        return result;
+    }
+
+    // Concatenates two trees whose key ranges do not overlap, left first.
+    static aa_tree join(aa_tree&& left, aa_tree&& right) {
+        aa_tree result = std::move(left);
+        aa_tree rhs = result.adopt(std::move(right));
+        thread_join(result.base_.root, nullptr, rhs.base_.root);
+        result.base_.root = result.join2(result.base_.root, rhs.base_.root);
+        result.base_.count = sum_counts(result.base_.count, rhs.base_.count, 0);
+        rhs.release_nodes();
+        return result;
+    }
+
+    // Moves every element with key >= key into the returned tree in
+    // O(log N). Without order_statistics both sizes are recounted lazily by
+    // the next size() call.
+    aa_tree split_off(const Key& key) {
+        aa_tree right(base_.comp(), allocator_type(base_.alloc()));
+        split_result s = split_nodes(base_.root, key);
+        base_.root = s.left;
+        right.base_.root = s.mid ? join_nodes(nullptr, s.mid, s.right) : s.right;
+        if constexpr (node_type::threaded) {
+            if (base_.root)
+                detail::rightmost(base_.root)->next = nullptr;
+            if (right.base_.root)
+                detail::leftmost(right.base_.root)->prev = nullptr;
+        }
+        if constexpr (augment::tracks_size) {
+            base_.count = augment::size(base_.root);
+            right.base_.count = augment::size(right.base_.root);
+        } else {
+            base_.count = detail::unknown_size;
+            right.base_.count = detail::unknown_size;
+        }
+        right.base_.span() = base_.span();
+        return right;
+    }
+
+    // Set algebra on keys in O(m log(n/m + 1)) for operand sizes m <= n.
+    // Both operands are consumed and their nodes reused; for keys present
+    // in both, the element of a is kept. The two halves of every step are
+    // independent, so near the top of large trees they run on separate
+    // threads. Compare must not throw.
+    friend aa_tree set_union(aa_tree a, aa_tree b) {
+        return combine(std::move(a), std::move(b), set_op::unite);
+    }
+    friend aa_tree set_intersection(aa_tree a, aa_tree b) {
+        return combine(std::move(a), std::move(b), set_op::intersect);
+    }
+    friend aa_tree set_difference(aa_tree a, aa_tree b) {
+        return combine(std::move(a), std::move(b), set_op::subtract);
+    }
+
+    // Lookup.
+
+    size_type count(const Key& key) const { return find_node(key) ? 1 : 0; }
+    bool contains(const Key& key) const { return find_node(key) != nullptr; }
+
+    iterator find(const Key& key) { return make_iter(find_node(key)); }
+    const_iterator find(const Key& key) const { return make_citer(find_node(key)); }
+
+    iterator lower_bound(const Key& key) { return make_iter(lower_bound_node(key)); }
+    const_iterator lower_bound(const Key& key) const {
+        return make_citer(lower_bound_node(key));
+    }
+    iterator upper_bound(const Key& key) { return make_iter(upper_bound_node(key)); }
+    const_iterator upper_bound(const Key& key) const {
+        return make_citer(upper_bound_node(key));
+    }
+
+    // Looks up every key of [first, last) and writes the matching iterator,
+    // or end(), to out in input order. Up to batch_lanes searches advance
+    // in lockstep, one level per round, each prefetching its next node, so
+    // the cache misses of independent searches overlap instead of being
+    // paid one after another. Returns the advanced out.
+    template <class ForwardIt, class OutputIt>
+    OutputIt find_batch(ForwardIt first, ForwardIt last, OutputIt out) {
+        return find_batch_impl(first, last, out, [this](node_type* n) { return make_iter(n); });
+    }
+    template <class ForwardIt, class OutputIt>
+    OutputIt find_batch(ForwardIt first, ForwardIt last, OutputIt out) const {
+        return find_batch_impl(first, last, out, [this](node_type* n) { return make_citer(n); });
+    }
+
+    // A cursor over the keys in [lo, hi) that hands them out batch_size at
+    // a time, for consumers that process elements in blocks.
+    scan_cursor scan(const Key& lo, const Key& hi, size_type batch_size) {
+        return scan_cursor(&base_, lo, hi, batch_size);
+    }
+    const_scan_cursor scan(const Key& lo, const Key& hi, size_type batch_size) const {
+        return const_scan_cursor(&base_, lo, hi, batch_size);
+    }
+
+    std::pair<iterator, iterator> equal_range(const Key& key) {
+        return {lower_bound(key), upper_bound(key)};
+    }
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    // Order statistics; require an augment with tracks_size, such as
+    // order_statistics. All run in O(log N).
+
+    // Number of elements with a key less than key.
+    size_type rank(const Key& key) const {
+        static_assert(augment::tracks_size, "rank() needs an order_statistics augment");
+        size_type r = 0;
+        for (node_type* n = base_.root; n;) {
+            if (less(n->value.first, key)) {
+                r += augment::size(n->left()) + 1;
+                n = n->right();
+            } else {
+                n = n->left();
+            }
+        }
+        return r;
+    }
+
+    // The element at zero-based position k in key order, or end().
+    iterator select(size_type k) { return make_iter(select_node(k)); }
+    const_iterator select(size_type k) const { return make_citer(select_node(k)); }
+
+    // Number of elements with lo <= key < hi.
+    size_type count_range(const Key& lo, const Key& hi) const {
+        return less(lo, hi) ? rank(hi) - rank(lo) : 0;
+    }
+
+    // Range aggregates; require an augment with tracks_aggregate, such as
+    // monoid_augment. The fold runs in key order over lo <= key < hi and
+    // touches O(log N) nodes.
+    auto aggregate(const Key& lo, const Key& hi) const {
+        static_assert(augment::tracks_aggregate, "aggregate() needs a monoid_augment");
+        node_type* n = base_.root;
+        while (n) {
+            if (less(n->value.first, lo))
+                n = n->right();
+            else if (!less(n->value.first, hi))
+                n = n->left();
+            else
+                break;
+        }
+        if (!n)
+            return augment::identity();
+
+        // n is the topmost node in range. Keys >= lo below its left child
+        // are found in decreasing order and prepended; keys < hi below its
+        // right child in increasing order and appended.
+        auto acc = augment::lift(n);
+        for (node_type* t = n->left(); t;) {
+            if (less(t->value.first, lo)) {
+                t = t->right();
+            } else {
+                acc = augment::combine(
+                    augment::combine(augment::lift(t), augment::subtree(t->right())), acc);
+                t = t->left();
+            }
+        }
+        for (node_type* t = n->right(); t;) {
+            if (less(t->value.first, hi)) {
+                acc = augment::combine(
+                    acc, augment::combine(augment::subtree(t->left()), augment::lift(t)));
+                t = t->right();
+            } else {
+                t = t->left();
+            }
+        }
+        return acc;
+    }
+
+    // Fold over the whole tree, O(1).
+    auto aggregate() const {
+        static_assert(augment::tracks_aggregate, "aggregate() needs a monoid_augment");
+        return augment::subtree(base_.root);
+    }
+
+    // Copies the contents into an immutable frozen_map whose lookups cost
+    // one cache line per level. O(N): the copy walks the tree with a stack
+    // rather than stepping an iterator. The tree itself is unchanged.
+    frozen_map<Key, T, Compare> freeze() const {
+        using walk = detail::in_order_iterator<const node_type>;
+        return frozen_map<Key, T, Compare>(walk(base_.root), walk(), base_.comp());
+    }
+
+    // Instrumentation counters; empty unless the traits select a stats
+    // policy such as tree_stats.
+    const stats_type& stats() const noexcept { return base_.stats(); }
+    void reset_stats() noexcept { static_cast<stats_type&>(base_).reset(); }
+
+    friend bool operator==(const aa_tree& a, const aa_tree& b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+    }
+    friend bool operator!=(const aa_tree& a, const aa_tree& b) { return !(a == b); }
+    friend bool operator<(const aa_tree& a, const aa_tree& b) {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+    }
+
+private:
+    using path_type = detail::search_path<node_type>;
+
+    iterator make_iter(node_type* n) noexcept { return iterator(n, &base_); }
+    const_iterator make_citer(node_type* n) const noexcept { return const_iterator(n, &base_); }
+
+    node_type* root_node() const noexcept { return base_.root; }
+
+    node_type* first_node() const noexcept {
+        return base_.root ? detail::leftmost(base_.root) : nullptr;
+    }
+
+    bool less(const Key& a, const Key& b) const { return base_.comp()(a, b); }
+
+    static void prefetch_children(const node_type* n) noexcept {
+        if constexpr (Traits::prefetch) {
+            detail::prefetch_node(n->left());
+            detail::prefetch_node(n->right());
+        }
+    }
+
+    node_type* find_node(const Key& key) const {
+        node_type* n = base_.root;
+        std::size_t depth = 0;
+        while (n) {
+            ++depth;
+            prefetch_children(n);
+            if (less(key, n->value.first)) {
+                n = n->left();
+            } else if (less(n->value.first, key)) {
+                n = n->right();
+            } else {
+                base_.stats().on_path(depth);
+                return n;
+            }
+        }
+        base_.stats().on_path(depth);
+        return nullptr;
+    }
+
+    // Searches in flight at once in find_batch; enough to cover memory
+    // latency with a few lookups to spare.
+    static constexpr std::size_t batch_lanes = 16;
+
+    template <class ForwardIt, class OutputIt, class MakeIter>
+    OutputIt find_batch_impl(ForwardIt first, ForwardIt last, OutputIt out,
+                             MakeIter make) const {
+        const Key* keys[batch_lanes];
+        node_type* cur[batch_lanes];
+        node_type* hit[batch_lanes];
+        std::size_t depth[batch_lanes];
+        while (first != last) {
+            std::size_t lanes = 0;
+            for (; lanes < batch_lanes && first != last; ++lanes, ++first) {
+                keys[lanes] = &*first;
+                cur[lanes] = base_.root;
+                hit[lanes] = nullptr;
+                depth[lanes] = 0;
+            }
+            for (bool active = base_.root != nullptr; active;) {
+                active = false;
+                for (std::size_t i = 0; i < lanes; ++i) {
+                    node_type* n = cur[i];
+                    if (!n)
+                        continue;
+                    ++depth[i];
+                    if (less(*keys[i], n->value.first)) {
+                        n = n->left();
+                    } else if (less(n->value.first, *keys[i])) {
+                        n = n->right();
+                    } else {
+                        hit[i] = n;
+                        n = nullptr;
+                    }
+                    cur[i] = n;
+                    if (n) {
+                        detail::prefetch_node(n);
+                        active = true;
+                    }
+                }
+            }
+            for (std::size_t i = 0; i < lanes; ++i) {
+                base_.stats().on_path(depth[i]);
+                *out++ = make(hit[i]);
+            }
+        }
+        return out;
+    }
+
+    node_type* select_node(size_type k) const {
+        static_assert(augment::tracks_size, "select() needs an order_statistics augment");
+        node_type* n = base_.root;
+        while (n) {
+            size_type left = augment::size(n->left());
+            if (k < left) {
+                n = n->left();
+            } else if (k == left) {
+                return n;
+            } else {
+                k -= left + 1;
+                n = n->right();
+            }
+        }
+        return nullptr;
+    }
+
+    node_type* lower_bound_node(const Key& key) const {
+        node_type* n = base_.root;
+        node_type* result = nullptr;
+        std::size_t depth = 0;
+        while (n) {
+            ++depth;
+            prefetch_children(n);
+            if (!less(n->value.first, key)) {
+                result = n;
+                n = n->left();
+            } else {
+                n = n->right();
+            }
+        }
+        base_.stats().on_path(depth);
+        return result;
+    }
+
+    node_type* upper_bound_node(const Key& key) const {
+        node_type* n = base_.root;
+        node_type* result = nullptr;
+        std::size_t depth = 0;
+        while (n) {
+            ++depth;
+            prefetch_children(n);
+            if (less(key, n->value.first)) {
+                result = n;
+                n = n->left();
+            } else {
+                n = n->right();
+            }
+        }
+        base_.stats().on_path(depth);
+        return result;
+    }
+
+    // Records every node visited while searching for key. Returns the match,
+    // which is then the last entry of path; otherwise path ends at the parent
+    // of the empty slot and left tells which side of it that slot is on.
+    node_type* descend(const Key& key, path_type& path, bool& left) const {
+        node_type* n = base_.root;
+        while (n) {
+            path.push(n);
+            prefetch_children(n);
+            if (less(key, n->value.first)) {
+                left = true;
+                n = n->left();
+            } else if (less(n->value.first, key)) {
+                left = false;
+                n = n->right();
+            } else {
+                base_.stats().on_path(path.size);
+                return n;
+            }
+        }
+        base_.stats().on_path(path.size);
+        return nullptr;
+    }
+
+    template <class M>
+    void assign(iterator it, M&& obj) {
+        it->second = std::forward<M>(obj);
+        if constexpr (augment::tracks_aggregate) {
+            path_type path;
+            bool left;
+            descend(it->first, path, left);
+            while (path.size)
+                augment::update(path.nodes[--path.size]);
+        }
+    }
+
+    template <class K, class... Args>
+    std::pair<iterator, bool> try_emplace_impl(K&& key, Args&&... args) {
+        path_type path;
+        bool left = false;
+        if (node_type* found = descend(key, path, left))
+            return {make_iter(found), false};
+        node_type* z = create_node(std::piecewise_construct,
+                                   std::forward_as_tuple(std::forward<K>(key)),
+                                   std::forward_as_tuple(std::forward<Args>(args)...));
+        link_node(z, path, left);
+        return {make_iter(z), true};
+    }
+
+    // Node lifetime.
+
+    template <class... Args>
+    node_type* create_node(Args&&... args) {
+        node_type* n = node_alloc_traits::allocate(base_.alloc(), 1);
+        if (!base_.span().admit(n)) {
+            node_alloc_traits::deallocate(base_.alloc(), n, 1);
+            throw std::length_error("aa_tree: node outside the layout's addressable span");
+        }
+        ::new (static_cast<void*>(n)) node_type();
+        try {
+            node_alloc_traits::construct(base_.alloc(), std::addressof(n->value),
+                                         std::forward<Args>(args)...);
+        } catch (...) {
+            n->~node_type();
+            node_alloc_traits::deallocate(base_.alloc(), n, 1);
+            throw;
+        }
+        augment::update(n);
+        return n;
+    }
+
+    void drop_node(node_type* n) noexcept {
+        node_alloc_traits::destroy(base_.alloc(), std::addressof(n->value));
+        n->~node_type();
+        node_alloc_traits::deallocate(base_.alloc(), n, 1);
+    }
+
+    // Frees a subtree without recursion by rotating left children up.
+    size_type destroy(node_type* n) noexcept {
+        size_type dropped = 0;
+        while (n) {
+            if (node_type* l = n->left()) {
+                n->set_left(l->right());
+                l->set_right(n);
+                n = l;
+            } else {
+                node_type* r = n->right();
+                drop_node(n);
+                ++dropped;
+                n = r;
+            }
+        }
+        return dropped;
+    }
+
+    size_type count_nodes(node_type* n) const noexcept {
+        path_type stack;
+        size_type c = 0;
+        while (n || stack.size) {
+            for (; n; n = n->left())
+                stack.push(n);
+            n = stack.nodes[--stack.size]->right();
+            ++c;
+        }
+        return c;
+    }
+
+    // Tears down the whole tree. When the allocator can release in bulk and
+    // every block it has handed out is one of our nodes, only the values are
+    // visited (and not even those if trivially destructible); the memory
+    // goes back slab by slab.
+    void destroy_all() noexcept {
+        if constexpr (detail::has_bulk_release<node_allocator>::value) {
+            if (base_.alloc().live() == size()) {
+                if constexpr (!std::is_trivially_destructible<value_type>::value)
+                    destroy_values(base_.root);
+                base_.alloc().release();
+                return;
+            }
+        }
+        destroy(base_.root);
+    }
+
+    void destroy_values(node_type* n) noexcept {
+        while (n) {
+            if (node_type* l = n->left()) {
+                n->set_left(l->right());
+                l->set_right(n);
+                n = l;
+            } else {
+                node_alloc_traits::destroy(base_.alloc(), std::addressof(n->value));
+                n = n->right();
+            }
+        }
+    }
+
+    // Recursion depth is bounded by the tree height.
+    node_type* clone(const node_type* src) {
+        if (!src)
+            return nullptr;
+        node_type* n = create_node(src->value);
+        n->set_level(src->level());
+        try {
+            n->set_left(clone(src->left()));
+            n->set_right(clone(src->right()));
+        } catch (...) {
+            destroy(n);
+            throw;
+        }
+        augment::update(n);
+        return n;
+    }
+
+    static unsigned level_for_size(size_type n) noexcept {
+        unsigned level = 0;
+        for (size_type s = n + 1; s > 1; s >>= 1)
+            ++level;
+        return level;
+    }
+
+    // Builds a subtree from the next n elements of a sorted sequence. The
+    // left side gets the smaller half, so a subtree of size s has minimum
+    // depth floor(log2(s + 1)); using that depth as the level satisfies
+    // every AA invariant. Recursion depth is log2(n).
+    template <class It>
+    node_type* build_sorted(It& it, size_type n) {
+        if (n == 0)
+            return nullptr;
+        size_type nl = (n - 1) / 2;
+        node_type* left = build_sorted(it, nl);
+        node_type* root;
+        try {
+            root = create_node(*it);
+        } catch (...) {
+            destroy(left);
+            throw;
+        }
+        assert(!left || less(detail::rightmost(left)->value.first, root->value.first));
+        ++it;
+        root->set_left(left);
+        try {
+            root->set_right(build_sorted(it, n - 1 - nl));
+        } catch (...) {
+            destroy(root);
+            throw;
+        }
+        assert(!root->right() || less(root->value.first, detail::leftmost(root->right())->value.first));
+        root->set_level(level_for_size(n));
+        augment::update(root);
+        return root;
+    }
+
+    // Same shape as build_sorted. Above parallel_level the right subtree is
+    // built on another thread into a tree of its own, whose address span is
+    // then absorbed into this one before its nodes are linked in.
+    template <class RandomIt>
+    node_type* build_sorted_parallel(RandomIt first, size_type n, unsigned forks) {
+        if (forks == 0 || level_for_size(n) < parallel_level)
+            return build_sorted(first, n);
+        size_type nl = (n - 1) / 2;
+        aa_tree part(base_.comp(), allocator_type(base_.alloc()));
+        auto right = std::async(std::launch::async, [&] {
+            part.base_.root = part.build_sorted_parallel(first + (nl + 1), n - 1 - nl, forks - 1);
+            part.base_.count = n - 1 - nl;
+        });
+        node_type* left = nullptr;
+        node_type* root = nullptr;
+        try {
+            left = build_sorted_parallel(first, nl, forks - 1);
+            root = create_node(first[nl]);
+            right.get();
+            if (!base_.span().absorb(part.base_.span()))
+                throw std::length_error("aa_tree: node outside the layout's addressable span");
+        } catch (...) {
+            if (right.valid())
+                right.wait();
+            destroy(left);
+            destroy(root);
+            throw;
+        }
+        root->set_left(left);
+        root->set_right(part.base_.root);
+        root->set_level(level_for_size(n));
+        augment::update(root);
+        part.release_nodes();
+        return root;
+    }
+
+    // In-order visit of n, forking off right subtrees like
+    // build_sorted_parallel. Recursion depth is the height of n.
+    template <class V, class F>
+    static void visit_parallel(node_type* n, F& f, unsigned forks) {
+        for (; n; n = n->right()) {
+            if (forks > 0 && n->level() >= parallel_level) {
+                node_type* r = n->right();
+                auto right = std::async(std::launch::async,
+                                        [&f, r, forks] { visit_parallel<V>(r, f, forks - 1); });
+                try {
+                    visit_parallel<V>(n->left(), f, forks - 1);
+                    f(static_cast<V&>(n->value));
+                } catch (...) {
+                    right.wait();
+                    throw;
+                }
+                right.get();
+                return;
+            }
+            visit_parallel<V>(n->left(), f, 0);
+            f(static_cast<V&>(n->value));
+        }
+    }
+
+    // Same shape as build_sorted, but reuses the next n nodes of a list
+    // chained through right links.
+    static node_type* build_from_list(node_type*& head, size_type n) noexcept {
+        if (n == 0)
+            return nullptr;
+        size_type nl = (n - 1) / 2;
+        node_type* left = build_from_list(head, nl);
+        node_type* root = head;
+        head = head->right();
+        root->set_left(left);
+        root->set_right(build_from_list(head, n - 1 - nl));
+        root->set_level(level_for_size(n));
+        augment::update(root);
+        return root;
+    }
+
+    // Turns the tree into a sorted list chained through right links, with
+    // all left links cleared, by rotating left children up. O(n), no stack.
+    node_type* flatten() noexcept {
+        node_type* head = nullptr;
+        node_type* tail = nullptr;
+        for (node_type* n = base_.root; n;) {
+            if (node_type* l = n->left()) {
+                n->set_left(l->right());
+                l->set_right(n);
+                n = l;
+            } else {
+                if (tail)
+                    tail->set_right(n);
+                else
+                    head = n;
+                tail = n;
+                n = n->right();
+            }
+        }
+        base_.root = nullptr;
+        return head;
+    }
+
+    // Batch keys sorted by key, first occurrence of each key kept.
+    template <class ForwardIt, class KeyOf>
+    std::vector<ForwardIt> sorted_batch(ForwardIt first, ForwardIt last, KeyOf key_of) const {
+        std::vector<ForwardIt> batch;
+        for (; first != last; ++first)
+            batch.push_back(first);
+        auto by_key = [&](ForwardIt a, ForwardIt b) { return less(key_of(*a), key_of(*b)); };
+        std::stable_sort(batch.begin(), batch.end(), by_key);
+        batch.erase(std::unique(batch.begin(), batch.end(),
+                                [&](ForwardIt a, ForwardIt b) { return !by_key(a, b); }),
+                    batch.end());
+        return batch;
+    }
+
+    // A linear merge touches all n nodes once; m separate updates cost about
+    // m * log2(n) node visits, most of them cache misses on a large tree.
+    bool merge_pays(size_type m) const noexcept {
+        size_type n = size();
+        return m != 0 && m * (level_for_size(n) + 1) >= n;
+    }
+
+    // Merges a sorted batch into the flattened tree. Nodes are moved from
+    // rest to the output list in order; finish() splices what is left and
+    // rebuilds, so the tree stays valid even if the merge is abandoned.
+    struct list_merge {
+        explicit list_merge(aa_tree& t) : tree(t), rest(t.flatten()) {}
+
+        void append(node_type* n) noexcept {
+            if (tail)
+                tail->set_right(n);
+            else
+                head = n;
+            tail = n;
+        }
+
+        void skip_below(const Key& key) {
+            while (rest && tree.less(rest->value.first, key)) {
+                node_type* next = rest->right();
+                append(rest);
+                rest = next;
+            }
+        }
+
+        void finish(size_type new_count) noexcept {
+            if (tail)
+                tail->set_right(rest);
+            else
+                head = rest;
+            tree.base_.count = new_count;
+            if constexpr (node_type::threaded) {
+                node_type* prev = nullptr;
+                for (node_type* n = head; n; prev = n, n = n->right())
+                    thread_after(prev, n);
+                thread_after(prev, nullptr);
+            }
+            tree.base_.root = build_from_list(head, tree.base_.count);
+        }
+
+        aa_tree& tree;
+        node_type* rest;
+        node_type* head = nullptr;
+        node_type* tail = nullptr;
+    };
+
+    void steal(aa_tree& other) noexcept {
+        base_.root = other.base_.root;
+        base_.count = other.base_.count;
+        base_.span() = other.base_.span();
+        other.base_.root = nullptr;
+        other.base_.count = 0;
+        other.base_.span().reset();
+    }
+
+    // Threads. Rotations keep the in-order sequence, so only operations that
+    // add, remove or concatenate nodes touch the links.
+
+    // Makes b follow a; either may be null at the ends of the sequence.
+    static void thread_after(node_type* a, node_type* b) noexcept {
+        if constexpr (node_type::threaded) {
+            if (a)
+                a->next = b;
+            if (b)
+                b->prev = a;
+        }
+    }
+
+    // Chains the subtrees l and r, with k between them if not null, before
+    // they are joined.
+    static void thread_join(node_type* l, node_type* k, node_type* r) noexcept {
+        if constexpr (node_type::threaded) {
+            node_type* last = l ? detail::rightmost(l) : nullptr;
+            node_type* first = r ? detail::leftmost(r) : nullptr;
+            if (k) {
+                thread_after(last, k);
+                thread_after(k, first);
+            } else {
+                thread_after(last, first);
+            }
+        }
+    }
+
+    // Relinks every node to its neighbours by an in-order walk.
+    void rethread() noexcept {
+        if constexpr (node_type::threaded) {
+            path_type stack;
+            node_type* prev = nullptr;
+            for (node_type* n = base_.root; n || stack.size;) {
+                for (; n; n = n->left())
+                    stack.push(n);
+                n = stack.nodes[--stack.size];
+                thread_after(prev, n);
+                prev = n;
+                n = n->right();
+            }
+            thread_after(prev, nullptr);
+        }
+    }
+
+    // Rebalancing.
+
+    static unsigned level_of(const node_type* n) noexcept { return n ? n->level() : 0; }
+
+    // Points whatever referenced path.nodes[i] (its parent or root) at n.
+    static void relink(node_type*& root, const path_type& path, std::size_t i, node_type* old,
+                       node_type* n) noexcept {
+        if (i == 0)
+            root = n;
+        else if (path.nodes[i - 1]->left() == old)
+            path.nodes[i - 1]->set_left(n);
+        else
+            path.nodes[i - 1]->set_right(n);
+    }
+
+    // Removes a left horizontal link by rotating right. Returns the new
+    // subtree root; the caller relinks it.
+    node_type* skew(node_type* t) const noexcept {
+        node_type* l = t->left();
+        bool rotate = l && l->level() == t->level();
+        base_.stats().on_skew(rotate);
+        if (!rotate)
+            return t;
+        t->set_left(l->right());
+        l->set_right(t);
+        augment::update(t);
+        augment::update(l);
+        return l;
+    }
+
+    // Removes two consecutive right horizontal links by rotating left and
+    // promoting the middle node.
+    node_type* split(node_type* t) const noexcept {
+        node_type* r = t->right();
+        bool rotate = r && r->right() && r->right()->level() == t->level();
+        base_.stats().on_split(rotate);
+        if (!rotate)
+            return t;
+        t->set_right(r->left());
+        r->set_left(t);
+        r->set_level(r->level() + 1);
+        augment::update(t);
+        augment::update(r);
+        return r;
+    }
+
+    // Attaches z below the last node of path and rebalances bottom-up.
+    void link_node(node_type* z, path_type& path, bool left) noexcept {
+        if (path.size == 0) {
+            base_.root = z;
+        } else {
+            node_type* p = path.nodes[path.size - 1];
+            if (left)
+                p->set_left(z);
+            else
+                p->set_right(z);
+            // The parent is z's successor if z hangs to its left, else its
+            // predecessor.
+            if constexpr (node_type::threaded) {
+                node_type* prev = left ? p->prev : p;
+                node_type* next = left ? p : p->next;
+                thread_after(prev, z);
+                thread_after(z, next);
+            }
+        }
+        if (base_.count != detail::unknown_size)
+            ++base_.count;
+        rebalance_insert(base_.root, path);
+    }
+
+    // Restores the invariants after a horizontal link was added below the
+    // last node of path.
+    void rebalance_insert(node_type*& root, const path_type& path) const noexcept {
+        for (std::size_t i = path.size; i-- > 0;) {
+            node_type* t = path.nodes[i];
+            node_type* r = split(skew(t));
+            augment::update(r);
+            if (r != t)
+                relink(root, path, i, t, r);
+        }
+    }
+
+    // Removes the last node of path and rebalances bottom-up.
+    void erase_at(path_type& path) noexcept {
+        node_type* z = unlink_at(base_.root, path);
+        if constexpr (node_type::threaded)
+            thread_after(z->prev, z->next);
+        drop_node(z);
+        if (base_.count != detail::unknown_size)
+            --base_.count;
+    }
+
+    // Detaches the last node of path from the tree under root and returns it.
+    node_type* unlink_at(node_type*& root, path_type& path) const noexcept {
+        std::size_t k = path.size - 1;
+        node_type* z = path.nodes[k];
+        if (z->left()) {
+            // Internal node: its successor is a level-one node without a left
+            // child. Unlink the successor and let it take z's place.
+            node_type* s = z->right();
+            while (s->left()) {
+                path.push(s);
+                s = s->left();
+            }
+            node_type* sp = path.nodes[path.size - 1];
+            if (sp->left() == s)
+                sp->set_left(s->right());
+            else
+                sp->set_right(s->right());
+
+            s->set_left(z->left());
+            s->set_right(z->right());
+            s->set_level(z->level());
+            path.nodes[k] = s;
+            relink(root, path, k, z, s);
+        } else {
+            relink(root, path, k, z, z->right());
+            path.size = k;
+        }
+
+        for (std::size_t i = path.size; i-- > 0;) {
+            node_type* t = path.nodes[i];
+            unsigned want = std::min(level_of(t->left()), level_of(t->right())) + 1;
+            if (want < t->level()) {
+                t->set_level(want);
+                base_.stats().on_level_decrement();
+                if (t->right() && want < t->right()->level()) {
+                    t->right()->set_level(want);
+                    base_.stats().on_level_decrement();
+                }
+            }
+            node_type* r = skew(t);
+            if (r->right()) {
+                r->set_right(skew(r->right()));
+                if (r->right()->right())
+                    r->right()->set_right(skew(r->right()->right()));
+            }
+            r = split(r);
+            if (r->right())
+                r->set_right(split(r->right()));
+            // Rotations refreshed the nodes they moved; the spine above a
+            // nested rotation may still be stale.
+            if (r->right())
+                augment::update(r->right());
+            augment::update(r);
+            if (r != t)
+                relink(root, path, i, t, r);
+        }
+        return z;
+    }
+
+    // Split and join on raw subtrees. Any subtree of an AA-tree is itself a
+    // valid AA-tree, and the level of its root plays the role of the rank
+    // in rank-based join.
+
+    struct split_result {
+        node_type* left = nullptr;
+        node_type* mid = nullptr;
+        node_type* right = nullptr;
+    };
+
+    enum class set_op { unite, intersect, subtract };
+
+    // Links l and r below k, given l < k < r. The taller tree is descended
+    // along its inner spine to the first node whose level matches the other
+    // tree; k replaces that subtree as a horizontal link, which the usual
+    // insertion rebalancing then resolves.
+    node_type* join_nodes(node_type* l, node_type* k, node_type* r) const noexcept {
+        unsigned ll = level_of(l);
+        unsigned lr = level_of(r);
+        if (ll == lr) {
+            k->set_left(l);
+            k->set_right(r);
+            k->set_level(ll + 1);
+            augment::update(k);
+            return k;
+        }
+        path_type path;
+        node_type* root;
+        if (ll > lr) {
+            // Right-spine levels fall by at most one per step, so the first
+            // node not above lr is at exactly lr (or null when r is empty).
+            node_type* c = l;
+            for (; c && c->level() > lr; c = c->right())
+                path.push(c);
+            k->set_left(c);
+            k->set_right(r);
+            k->set_level(lr + 1);
+            augment::update(k);
+            path.nodes[path.size - 1]->set_right(k);
+            root = l;
+        } else {
+            node_type* c = r;
+            for (; c && c->level() > ll; c = c->left())
+                path.push(c);
+            k->set_left(l);
+            k->set_right(c);
+            k->set_level(ll + 1);
+            augment::update(k);
+            path.nodes[path.size - 1]->set_left(k);
+            root = r;
+        }
+        rebalance_insert(root, path);
+        return root;
+    }
+
+    // Joins two subtrees without a middle node by detaching the maximum of
+    // l, a level-one node, and using it as the middle.
+    node_type* join2(node_type* l, node_type* r) const noexcept {
+        if (!l)
+            return r;
+        if (!r)
+            return l;
+        path_type path;
+        for (node_type* n = l; n; n = n->right())
+            path.push(n);
+        node_type* m = unlink_at(l, path);
+        return join_nodes(l, m, r);
+    }
+
+    // Splits t into keys below and above key; a node with an equal key is
+    // returned separately with its links cleared. Recursion depth is the
+    // height of t, and the joins along the way telescope to O(log N).
+    split_result split_nodes(node_type* t, const Key& key) const noexcept {
+        if (!t)
+            return {};
+        node_type* l = t->left();
+        node_type* r = t->right();
+        if (less(key, t->value.first)) {
+            split_result s = split_nodes(l, key);
+            s.right = join_nodes(s.right, t, r);
+            return s;
+        }
+        if (less(t->value.first, key)) {
+            split_result s = split_nodes(r, key);
+            s.left = join_nodes(l, t, s.left);
+            return s;
+        }
+        t->set_left(nullptr);
+        t->set_right(nullptr);
+        t->set_level(1);
+        augment::update(t);
+        return {l, t, r};
+    }
+
+    // Recursive step of the set operations. Union and intersection pivot on
+    // the root of a, difference on the root of b; the other tree is split
+    // around the pivot key and both halves are combined independently.
+    // Nodes that leave the result go to garbage and are freed afterwards,
+    // so parallel branches never touch the allocator.
+    node_type* combine_nodes(node_type* a, node_type* b, set_op op,
+                             std::vector<node_type*>& garbage, unsigned forks) const {
+        if (!a || !b) {
+            if (op == set_op::unite)
+                return a ? a : b;
+            // Intersection keeps nothing; difference keeps what is left of a.
+            node_type* surplus = op == set_op::subtract ? b : a ? a : b;
+            if (surplus)
+                garbage.push_back(surplus);
+            return op == set_op::subtract ? a : nullptr;
+        }
+
+        bool pivot_a = op != set_op::subtract;
+        node_type* pivot = pivot_a ? a : b;
+        node_type* pl = pivot->left();
+        node_type* pr = pivot->right();
+        split_result s = split_nodes(pivot_a ? b : a, pivot->value.first);
+        node_type* al = pivot_a ? pl : s.left;
+        node_type* ar = pivot_a ? pr : s.right;
+        node_type* bl = pivot_a ? s.left : pl;
+        node_type* br = pivot_a ? s.right : pr;
+
+        node_type* l;
+        node_type* r;
+        if (forks > 0 && pivot->level() >= parallel_level) {
+            std::vector<node_type*> right_garbage;
+            auto right = std::async(std::launch::async, [&] {
+                return combine_nodes(ar, br, op, right_garbage, forks - 1);
+            });
+            l = combine_nodes(al, bl, op, garbage, forks - 1);
+            r = right.get();
+            garbage.insert(garbage.end(), right_garbage.begin(), right_garbage.end());
+        } else {
+            l = combine_nodes(al, bl, op, garbage, 0);
+            r = combine_nodes(ar, br, op, garbage, 0);
+        }
+
+        bool keep_pivot = op == set_op::unite || (op == set_op::intersect && s.mid);
+        if (s.mid)
+            garbage.push_back(s.mid);
+        if (!keep_pivot) {
+            pivot->set_left(nullptr);
+            pivot->set_right(nullptr);
+            garbage.push_back(pivot);
+        }
+        return keep_pivot ? join_nodes(l, pivot, r) : join2(l, r);
+    }
+
+    // Subtrees whose root is at least this level (about 4k nodes) are worth
+    // handing to another thread.
+    static constexpr unsigned parallel_level = 12;
+
+    // Fork depth that keeps about threads threads busy.
+    static unsigned forks_for(unsigned threads) noexcept {
+        unsigned forks = 0;
+        for (; threads > 1; threads >>= 1)
+            ++forks;
+        return forks;
+    }
+
+    static aa_tree combine(aa_tree a, aa_tree b, set_op op) {
+        aa_tree rhs = a.adopt(std::move(b));
+        size_type total = sum_counts(a.base_.count, rhs.base_.count, 0);
+        std::vector<node_type*> garbage;
+        a.base_.root = a.combine_nodes(a.base_.root, rhs.base_.root, op, garbage,
+                                       forks_for(std::thread::hardware_concurrency()));
+        rhs.release_nodes();
+        a.rethread();
+        size_type dropped = 0;
+        for (node_type* g : garbage)
+            dropped += a.destroy(g);
+        a.base_.count = total == detail::unknown_size ? total : total - dropped;
+        return a;
+    }
+
+    static size_type sum_counts(size_type a, size_type b, size_type extra) noexcept {
+        if (a == detail::unknown_size || b == detail::unknown_size)
+            return detail::unknown_size;
+        return a + b + extra;
+    }
+
+    // Returns other itself if its nodes can be linked into this tree,
+    // otherwise a copy allocated from this tree's allocator. The copy moves
+    // the elements out with a stack-based walk, so it stays linear.
+    aa_tree adopt(aa_tree&& other) {
+        if (base_.alloc() == other.base_.alloc() && base_.span().absorb(other.base_.span()))
+            return std::move(other);
+        using walk = detail::in_order_iterator<node_type>;
+        aa_tree copy(base_.comp(), allocator_type(base_.alloc()));
+        copy.build_from_sorted(std::make_move_iterator(walk(other.base_.root)),
+                               std::make_move_iterator(walk()));
+        if (!base_.span().absorb(copy.base_.span()))
+            throw std::length_error("aa_tree: node outside the layout's addressable span");
+        return copy;
+    }
+
+    // Forgets the nodes after they were linked into another tree.
+    void release_nodes() noexcept {
+        base_.root = nullptr;
+        base_.count = 0;
+        base_.span().reset();
+    }
+
+    base_type base_;
+};
+
+} // namespace aa
+
+#endif // AA_AA_TREE_HPP
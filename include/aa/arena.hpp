@@ -0,0 +1,367 @@
+// Slab arena and allocator for tree nodes.
+//
+// slab_arena hands out fixed-size blocks carved from large slabs and keeps
+// freed blocks on an intrusive freelist. Neighbouring allocations come from
+// the same slab, so nodes created together stay physically close, and the
+// whole arena is released in O(#slabs). arena_allocator wraps a shared
+// arena in the standard allocator interface; aa_tree recognises it and
+// frees an exclusively owned arena wholesale on clear() and destruction.
+
+#ifndef AA_ARENA_HPP
+#define AA_ARENA_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace aa {
+
+namespace detail {
+struct arena_state;
+} // namespace detail
+
+struct arena_options {
+    // Bytes requested from the system per slab.
+    std::size_t slab_bytes = std::size_t(1) << 20;
+    // Lets several threads share one arena: the central freelist is locked
+    // and each thread keeps a small private cache of free blocks so the
+    // lock is taken once per batch rather than once per node.
+    bool thread_cache = false;
+};
+
+class slab_arena {
+public:
+    slab_arena(std::size_t block_size, std::size_t block_align, arena_options opts = {})
+        : align_(std::max(block_align, alignof(void*))),
+          block_((std::max(block_size, sizeof(void*)) + align_ - 1) / align_ * align_),
+          slab_bytes_(std::max(opts.slab_bytes, block_)),
+          shared_(opts.thread_cache),
+          id_(next_id()) {}
+
+    slab_arena(const slab_arena&) = delete;
+    slab_arena& operator=(const slab_arena&) = delete;
+
+    ~slab_arena() { free_slabs(); }
+
+    std::size_t block_size() const noexcept { return block_; }
+    std::size_t block_align() const noexcept { return align_; }
+
+    // Blocks currently handed out.
+    std::size_t live() const noexcept { return live_.load(std::memory_order_relaxed); }
+    std::size_t slab_count() const noexcept { return slabs_.size(); }
+
+    void* allocate() {
+        if (shared_)
+            return allocate_cached();
+        void* p = pop_local();
+        bump_live(1);
+        return p;
+    }
+
+    void deallocate(void* p) noexcept {
+        if (shared_) {
+            deallocate_cached(p);
+            return;
+        }
+        push_free(p);
+        bump_live(-1);
+    }
+
+    // Returns every slab to the system at once. All blocks, including any
+    // sitting in thread caches, become invalid; the caller must ensure no
+    // other thread is using the arena.
+    void release() noexcept {
+        std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+        if (shared_)
+            lock.lock();
+        free_slabs();
+        free_ = nullptr;
+        cur_ = end_ = nullptr;
+        live_.store(0, std::memory_order_relaxed);
+        generation_.fetch_add(1, std::memory_order_release);
+    }
+
+private:
+    // Blocks moved between a thread cache and the central freelist at once.
+    static constexpr std::size_t batch = 64;
+    static constexpr std::size_t cache_slots = 4;
+
+    struct thread_cache {
+        std::uint64_t id = 0;
+        std::uint64_t generation = 0;
+        std::weak_ptr<slab_arena> owner;
+        void* list = nullptr;
+        std::size_t size = 0;
+    };
+
+    struct thread_caches {
+        thread_cache slot[cache_slots];
+        std::size_t victim = 0;
+
+        ~thread_caches() {
+            for (thread_cache& c : slot)
+                flush(c);
+        }
+    };
+
+    static std::uint64_t next_id() noexcept {
+        static std::atomic<std::uint64_t> counter{0};
+        return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    static void*& next_of(void* p) noexcept { return *static_cast<void**>(p); }
+
+    // Only the owning thread writes live_ when the arena is not shared, so
+    // a plain load/store pair avoids a locked instruction.
+    void bump_live(std::ptrdiff_t d) noexcept {
+        if (shared_)
+            live_.fetch_add(static_cast<std::size_t>(d), std::memory_order_relaxed);
+        else
+            live_.store(live_.load(std::memory_order_relaxed) + static_cast<std::size_t>(d),
+                        std::memory_order_relaxed);
+    }
+
+    void* pop_local() {
+        if (void* p = free_) {
+            free_ = next_of(p);
+            return p;
+        }
+        if (cur_ == end_)
+            grow();
+        void* p = cur_;
+        cur_ += block_;
+        return p;
+    }
+
+    void push_free(void* p) noexcept {
+        next_of(p) = free_;
+        free_ = p;
+    }
+
+    void grow() {
+        slabs_.reserve(slabs_.size() + 1);
+        auto* slab = static_cast<char*>(::operator new(slab_bytes_, std::align_val_t(align_)));
+        slabs_.push_back(slab);
+        cur_ = slab;
+        end_ = slab + slab_bytes_ / block_ * block_;
+    }
+
+    void free_slabs() noexcept {
+        for (char* s : slabs_)
+            ::operator delete(s, std::align_val_t(align_));
+        slabs_.clear();
+    }
+
+    // Thread-cached path.
+
+    thread_cache& local_cache() {
+        static thread_local thread_caches caches;
+        std::uint64_t gen = generation_.load(std::memory_order_acquire);
+        for (thread_cache& c : caches.slot) {
+            if (c.id != id_)
+                continue;
+            if (c.generation != gen) {
+                // The arena was released; cached blocks are gone with it.
+                c.list = nullptr;
+                c.size = 0;
+                c.generation = gen;
+            }
+            return c;
+        }
+        thread_cache& c = caches.slot[caches.victim++ % cache_slots];
+        flush(c);
+        c.id = id_;
+        c.generation = gen;
+        c.owner = self_.lock();
+        return c;
+    }
+
+    static void flush(thread_cache& c) noexcept {
+        if (std::shared_ptr<slab_arena> a = c.owner.lock()) {
+            std::lock_guard<std::mutex> lock(a->mutex_);
+            if (a->generation_.load(std::memory_order_relaxed) == c.generation) {
+                while (void* p = c.list) {
+                    c.list = next_of(p);
+                    a->push_free(p);
+                }
+            }
+        }
+        c = thread_cache();
+    }
+
+    void* allocate_cached() {
+        thread_cache& c = local_cache();
+        if (!c.list) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (std::size_t i = 0; i < batch; ++i) {
+                void* p = pop_local();
+                next_of(p) = c.list;
+                c.list = p;
+                ++c.size;
+            }
+        }
+        void* p = c.list;
+        c.list = next_of(p);
+        --c.size;
+        bump_live(1);
+        return p;
+    }
+
+    void deallocate_cached(void* p) noexcept {
+        bump_live(-1);
+        thread_cache& c = local_cache();
+        next_of(p) = c.list;
+        c.list = p;
+        if (++c.size < 2 * batch)
+            return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::size_t i = 0; i < batch; ++i) {
+            void* q = c.list;
+            c.list = next_of(q);
+            push_free(q);
+        }
+        c.size -= batch;
+    }
+
+    friend struct detail::arena_state;
+
+    std::size_t align_;
+    std::size_t block_;
+    std::size_t slab_bytes_;
+    bool shared_;
+    std::uint64_t id_;
+    std::weak_ptr<slab_arena> self_;
+
+    std::vector<char*> slabs_;
+    char* cur_ = nullptr;
+    char* end_ = nullptr;
+    void* free_ = nullptr;
+    std::atomic<std::size_t> live_{0};
+    std::atomic<std::uint64_t> generation_{0};
+    std::mutex mutex_;
+};
+
+namespace detail {
+
+// State shared by an allocator and all its copies and rebinds. The arena is
+// created on the first single-object allocation, sized for that type --
+// for a tree, the node.
+struct arena_state {
+    explicit arena_state(arena_options o) : opts(o) {}
+
+    slab_arena* get(std::size_t size, std::size_t align) {
+        if (slab_arena* a = arena.load(std::memory_order_acquire))
+            return a;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!owner) {
+            owner = std::make_shared<slab_arena>(size, align, opts);
+            owner->self_ = owner;
+            arena.store(owner.get(), std::memory_order_release);
+        }
+        return owner.get();
+    }
+
+    slab_arena* peek() const noexcept { return arena.load(std::memory_order_acquire); }
+
+    arena_options opts;
+    std::atomic<slab_arena*> arena{nullptr};
+    std::shared_ptr<slab_arena> owner;
+    std::mutex mutex;
+};
+
+} // namespace detail
+
+// Standard allocator over a slab_arena. Copies and rebinds share the arena;
+// a container copy gets a fresh one, so each tree normally owns its arena
+// exclusively. Anything other than single objects that fit the arena's
+// block goes to the global heap.
+template <class T>
+class arena_allocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    template <class U>
+    struct rebind {
+        using other = arena_allocator<U>;
+    };
+
+    explicit arena_allocator(arena_options opts = {})
+        : state_(std::make_shared<detail::arena_state>(opts)) {}
+
+    arena_allocator(const arena_allocator&) noexcept = default;
+    arena_allocator& operator=(const arena_allocator&) noexcept = default;
+
+    template <class U>
+    arena_allocator(const arena_allocator<U>& other) noexcept : state_(other.state_) {}
+
+    T* allocate(std::size_t n) {
+        if (n == 1) {
+            slab_arena* a = state_->get(sizeof(T), alignof(T));
+            if (fits(a))
+                return static_cast<T*>(a->allocate());
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        if (n == 1) {
+            slab_arena* a = state_->peek();
+            if (fits(a)) {
+                a->deallocate(p);
+                return;
+            }
+        }
+        ::operator delete(p, std::align_val_t(alignof(T)));
+    }
+
+    arena_allocator select_on_container_copy_construction() const {
+        return arena_allocator(state_->opts);
+    }
+
+    // Blocks handed out by the arena across all copies of this allocator.
+    std::size_t live() const noexcept {
+        slab_arena* a = state_->peek();
+        return a ? a->live() : 0;
+    }
+
+    // Frees the arena's slabs in one sweep; every block it handed out is
+    // invalidated. aa_tree calls this only when all live blocks are its own.
+    void release() noexcept {
+        if (slab_arena* a = state_->peek())
+            a->release();
+    }
+
+    // Null until the first node has been allocated.
+    slab_arena* arena() const noexcept { return state_->peek(); }
+
+    friend bool operator==(const arena_allocator& a, const arena_allocator& b) noexcept {
+        return a.state_ == b.state_;
+    }
+    friend bool operator!=(const arena_allocator& a, const arena_allocator& b) noexcept {
+        return a.state_ != b.state_;
+    }
+
+private:
+    template <class U>
+    friend class arena_allocator;
+
+    static bool fits(const slab_arena* a) noexcept {
+        return a && sizeof(T) <= a->block_size() && alignof(T) <= a->block_align();
+    }
+
+    std::shared_ptr<detail::arena_state> state_;
+};
+
+} // namespace aa
+
+#endif // AA_ARENA_HPP
@@ -0,0 +1,244 @@
+// Node augmentation policies for aa_tree.
+//
+// An augmentation stores extra data in every node that is a function of
+// the node and its two subtrees, and aa_tree recomputes it whenever a
+// subtree changes: after each rotation in skew and split, along the
+// search path of every insert and erase, and while bulk building. A
+// policy provides
+//
+//     static constexpr bool tracks_size;       // enables rank/select
+//     static constexpr bool tracks_aggregate;  // enables aggregate()
+//     template <class Node> struct node_data;  // base class of every node
+//     template <class Node> static void update(Node* n) noexcept;
+//
+// update() may assume both children are already up to date. Policies are
+// combined with augments<...>.
+
+#ifndef AA_AUGMENT_HPP
+#define AA_AUGMENT_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+namespace aa {
+
+// The default: nodes carry nothing and every hook compiles to nothing.
+struct no_augment {
+    static constexpr bool tracks_size = false;
+    static constexpr bool tracks_aggregate = false;
+
+    template <class Node>
+    struct node_data {};
+
+    template <class Node>
+    static void update(Node*) noexcept {}
+};
+
+// Subtree sizes, enabling rank(), select() and count_range() in O(log N).
+struct order_statistics {
+    static constexpr bool tracks_size = true;
+    static constexpr bool tracks_aggregate = false;
+
+    template <class Node>
+    struct node_data {
+        std::size_t subtree_size = 1;
+    };
+
+    template <class Node>
+    static std::size_t size(const Node* n) noexcept {
+        return n ? n->subtree_size : 0;
+    }
+
+    template <class Node>
+    static void update(Node* n) noexcept {
+        n->subtree_size = 1 + size(n->left()) + size(n->right());
+    }
+};
+
+// Keeps, in every node, a monoid fold of its subtree in key order, which
+// lets aa_tree::aggregate(lo, hi) answer range queries in O(log N). The
+// Monoid provides
+//
+//     using type = ...;
+//     static type identity() noexcept;
+//     static type combine(const type& a, const type& b) noexcept;  // associative
+//     template <class Value> static type lift(const Value& v) noexcept;
+//
+// where v is the tree's value_type (the key/mapped pair). combine need
+// not be commutative; folds always run in key order. Folds see mapped
+// values changed by insert_or_assign, but not values assigned in place
+// through an iterator or operator[].
+//
+// All three, and assigning a type, must not throw: folds are refreshed in
+// the middle of skew and split, which cannot be undone, so update() is
+// noexcept and a static_assert rejects monoids that do not promise as
+// much. A fold that needs to allocate must do so where failure is
+// acceptable, e.g. by preallocating.
+template <class Monoid>
+struct monoid_augment {
+    static constexpr bool tracks_size = false;
+    static constexpr bool tracks_aggregate = true;
+
+    using aggregate_type = typename Monoid::type;
+
+    static_assert(noexcept(Monoid::identity()) &&
+                      noexcept(Monoid::combine(std::declval<const aggregate_type&>(),
+                                               std::declval<const aggregate_type&>())) &&
+                      std::is_nothrow_move_assignable<aggregate_type>::value,
+                  "monoid_augment: identity, combine and assignment must be noexcept");
+
+    template <class Node>
+    struct node_data {
+        aggregate_type aggregate = Monoid::identity();
+    };
+
+    static aggregate_type identity() { return Monoid::identity(); }
+
+    static aggregate_type combine(const aggregate_type& a, const aggregate_type& b) {
+        return Monoid::combine(a, b);
+    }
+
+    template <class Node>
+    static aggregate_type lift(const Node* n) {
+        return Monoid::lift(n->value);
+    }
+
+    template <class Node>
+    static aggregate_type subtree(const Node* n) {
+        return n ? n->aggregate : Monoid::identity();
+    }
+
+    template <class Node>
+    static void update(Node* n) noexcept {
+        static_assert(noexcept(Monoid::lift(n->value)), "monoid_augment: lift must be noexcept");
+        n->aggregate = Monoid::combine(Monoid::combine(subtree(n->left()), lift(n)),
+                                       subtree(n->right()));
+    }
+};
+
+// Stock monoids over the mapped value. They are noexcept as far as T's
+// operations are, so a T whose arithmetic may throw fails the check in
+// monoid_augment.
+
+template <class T>
+struct sum_monoid {
+    using type = T;
+    static type identity() noexcept(noexcept(T())) { return T(); }
+    static type combine(const type& a, const type& b) noexcept(noexcept(T(a + b))) {
+        return a + b;
+    }
+    template <class Value>
+    static type lift(const Value& v) noexcept(noexcept(T(v.second))) { return v.second; }
+};
+
+template <class T>
+struct min_monoid {
+    using type = T;
+    static type identity() noexcept(noexcept(T(std::numeric_limits<T>::max()))) {
+        return std::numeric_limits<T>::max();
+    }
+    static type combine(const type& a, const type& b) noexcept(noexcept(T(a < b ? a : b))) {
+        return std::min(a, b);
+    }
+    template <class Value>
+    static type lift(const Value& v) noexcept(noexcept(T(v.second))) { return v.second; }
+};
+
+template <class T>
+struct max_monoid {
+    using type = T;
+    static type identity() noexcept(noexcept(T(std::numeric_limits<T>::lowest()))) {
+        return std::numeric_limits<T>::lowest();
+    }
+    static type combine(const type& a, const type& b) noexcept(noexcept(T(a < b ? b : a))) {
+        return std::max(a, b);
+    }
+    template <class Value>
+    static type lift(const Value& v) noexcept(noexcept(T(v.second))) { return v.second; }
+};
+
+template <class T>
+struct or_monoid {
+    using type = T;
+    static type identity() noexcept(noexcept(T())) { return T(); }
+    static type combine(const type& a, const type& b) noexcept(noexcept(T(a | b))) {
+        return a | b;
+    }
+    template <class Value>
+    static type lift(const Value& v) noexcept(noexcept(T(v.second))) { return v.second; }
+};
+
+namespace detail {
+
+template <bool Size, class... Ps>
+struct first_policy {
+    using type = void;
+};
+
+template <bool Size, class P, class... Ps>
+struct first_policy<Size, P, Ps...> {
+    using type = std::conditional_t<Size ? P::tracks_size : P::tracks_aggregate, P,
+                                    typename first_policy<Size, Ps...>::type>;
+};
+
+template <class P, class = void>
+struct aggregate_type_of {
+    using type = void;
+};
+
+template <class P>
+struct aggregate_type_of<P, std::void_t<typename P::aggregate_type>> {
+    using type = typename P::aggregate_type;
+};
+
+} // namespace detail
+
+// Several augmentations at once, e.g. augments<order_statistics,
+// monoid_augment<sum_monoid<long>>>. Sizes and aggregates are served by
+// the first policy that tracks them.
+template <class... Ps>
+struct augments {
+    static constexpr bool tracks_size = (Ps::tracks_size || ...);
+    static constexpr bool tracks_aggregate = (Ps::tracks_aggregate || ...);
+
+    using size_policy = typename detail::first_policy<true, Ps...>::type;
+    using aggregate_policy = typename detail::first_policy<false, Ps...>::type;
+    using aggregate_type = typename detail::aggregate_type_of<aggregate_policy>::type;
+
+    template <class Node>
+    struct node_data : Ps::template node_data<Node>... {};
+
+    template <class Node>
+    static void update(Node* n) noexcept {
+        (Ps::update(n), ...);
+    }
+
+    template <class Node>
+    static std::size_t size(const Node* n) noexcept {
+        return size_policy::size(n);
+    }
+
+    static aggregate_type identity() { return aggregate_policy::identity(); }
+
+    template <class A = aggregate_type>
+    static A combine(const A& a, const A& b) {
+        return aggregate_policy::combine(a, b);
+    }
+
+    template <class Node>
+    static aggregate_type lift(const Node* n) {
+        return aggregate_policy::lift(n);
+    }
+
+    template <class Node>
+    static aggregate_type subtree(const Node* n) {
+        return aggregate_policy::subtree(n);
+    }
+};
+
+} // namespace aa
+
+#endif // AA_AUGMENT_HPP
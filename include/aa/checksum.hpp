@@ -0,0 +1,34 @@
+// Checksum shared by the on-disk formats.
+
+#ifndef AA_CHECKSUM_HPP
+#define AA_CHECKSUM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace aa {
+namespace detail {
+
+// 64-bit checksum for detecting torn or corrupted files; not
+// cryptographic. Consumes eight bytes per step.
+inline std::uint64_t checksum(const void* data, std::size_t n, std::uint64_t h = 0) noexcept {
+    constexpr std::uint64_t mul = 0x9e3779b97f4a7c15;
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    h ^= n * mul;
+    for (; n >= 8; n -= 8, p += 8) {
+        std::uint64_t w;
+        std::memcpy(&w, p, 8);
+        h = (h ^ w) * mul;
+        h ^= h >> 29;
+    }
+    std::uint64_t tail = 0;
+    std::memcpy(&tail, p, n);
+    h = (h ^ tail) * mul;
+    return h ^ h >> 32;
+}
+
+} // namespace detail
+} // namespace aa
+
+#endif // AA_CHECKSUM_HPP
@@ -0,0 +1,719 @@
+// Concurrent AA-tree with optimistic lock coupling.
+//
+// concurrent_aa_tree serves inserts, erases and lookups from any number of
+// threads at once. Every node carries a version lock. Searches take no
+// lock: they note each node's version on the way down and validate it
+// after reading the next link, restarting if a writer got in between.
+// Writers take locks only around the nodes they change: the parent whose
+// link they swing, and for a rotation the node and the child it rotates
+// with.
+//
+// Balance is restored lazily. An insert links a level-1 leaf, and an erase
+// unlinks a node with at most one child, each under the parent's lock.
+// The writer then walks its own search path again and repairs the first
+// violation it finds with one skew, split or level decrement under at most
+// three locks, repeating until its path is clean. Searches in the meantime
+// see a valid search tree that is briefly out of balance. Under contention
+// a violation can also be carried off every writer's path by another
+// writer's rotation and stay until a later update passes by, so depth is
+// not held to the 2 log2(n) bound of aa_tree: it stays close in practice
+// but has no worst-case guarantee. rebuild() restores the bound once the
+// tree is quiescent.
+//
+// Keys and values never move between nodes. Erasing a node with two
+// children only marks it as a routing node, which is unlinked once it has
+// at most one child. Assigning to a key replaces its node. Unlinked nodes
+// are freed through epoch-based reclamation (see epoch.hpp), so a search
+// may still read a node that a writer has just unlinked.
+
+#ifndef AA_CONCURRENT_HPP
+#define AA_CONCURRENT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "aa_tree.hpp"
+#include "epoch.hpp"
+
+namespace aa {
+
+namespace detail {
+
+// Version lock for optimistic lock coupling. Bit 0 is the lock, bit 1
+// marks a node unlinked from the tree, and the remaining bits count
+// modifications. The fields it guards are atomics read without the lock,
+// so a reader racing a writer only wastes work and retries.
+class version_lock {
+public:
+    static constexpr std::uint64_t locked = 1;
+    static constexpr std::uint64_t obsolete = 2;
+
+    // The current version, once no writer holds the lock.
+    std::uint64_t read() const noexcept {
+        for (unsigned spins = 0;; ++spins) {
+            std::uint64_t v = v_.load(std::memory_order_acquire);
+            if (!(v & locked))
+                return v;
+            if (spins >= 64)
+                std::this_thread::yield();
+        }
+    }
+
+    // Whether the version is still v, i.e. everything read since read()
+    // returned v is consistent.
+    bool validate(std::uint64_t v) const noexcept {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return v_.load(std::memory_order_relaxed) == v;
+    }
+
+    // Locks if the version is still v and the node is linked.
+    bool try_lock(std::uint64_t v) noexcept {
+        if (v & obsolete)
+            return false;
+        if (!v_.compare_exchange_strong(v, v | locked, std::memory_order_acquire))
+            return false;
+        // Orders the lock before the writes it guards, for validate().
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+
+    // Adding 3 to a locked version clears the lock and counts one change.
+    void unlock() noexcept {
+        v_.store(v_.load(std::memory_order_relaxed) + 3, std::memory_order_release);
+    }
+
+    void unlock_obsolete() noexcept {
+        v_.store((v_.load(std::memory_order_relaxed) | obsolete) + 3, std::memory_order_release);
+    }
+
+private:
+    std::atomic<std::uint64_t> v_{0};
+};
+
+// Links, level and liveness are atomics guarded by lock; the key and value
+// never change once the node is published.
+template <class Value>
+struct olc_node {
+    version_lock lock;
+    std::atomic<olc_node*> child[2] = {};
+    std::atomic<unsigned> level{1};
+    // False for a routing node, whose key was erased while it had two
+    // children.
+    std::atomic<bool> present{true};
+    union {
+        Value value;
+    };
+
+    olc_node() noexcept {}
+    ~olc_node() {}
+
+    olc_node* left() const noexcept { return child[0].load(std::memory_order_acquire); }
+    olc_node* right() const noexcept { return child[1].load(std::memory_order_acquire); }
+};
+
+} // namespace detail
+
+template <class Key, class T, class Compare = std::less<Key>,
+          class Allocator = std::allocator<std::pair<const Key, T>>>
+class concurrent_aa_tree {
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<const Key, T>;
+    using size_type = std::size_t;
+    using key_compare = Compare;
+    using allocator_type = Allocator;
+
+    concurrent_aa_tree() : concurrent_aa_tree(Compare()) {}
+
+    explicit concurrent_aa_tree(const Compare& comp, const Allocator& alloc = Allocator())
+        : comp_(comp), alloc_(alloc), retired_(node_deleter{this}) {
+        head_.level.store(std::numeric_limits<unsigned>::max(), std::memory_order_relaxed);
+        head_.present.store(false, std::memory_order_relaxed);
+    }
+
+    concurrent_aa_tree(const concurrent_aa_tree&) = delete;
+    concurrent_aa_tree& operator=(const concurrent_aa_tree&) = delete;
+
+    // No other thread may be using the tree.
+    ~concurrent_aa_tree() {
+        retired_.drain();
+        destroy(head_.left());
+    }
+
+    allocator_type get_allocator() const { return allocator_type(alloc_); }
+    key_compare key_comp() const { return comp_; }
+
+    // Exact when no writer is running; a sum of per-thread counts
+    // otherwise.
+    size_type size() const noexcept {
+        std::ptrdiff_t n = 0;
+        for (const stripe& s : counts_)
+            n += s.count.load(std::memory_order_relaxed);
+        return n > 0 ? static_cast<size_type>(n) : 0;
+    }
+    bool empty() const noexcept { return size() == 0; }
+
+    // Lookup. Lock-free unless a search reaches a node that a writer holds,
+    // which it waits out.
+
+    bool contains(const Key& key) const {
+        auto pin = epochs_.enter();
+        path p;
+        for (;;) {
+            probe r = descend(key, p);
+            if (r == probe::absent)
+                return false;
+            if (r == probe::found) {
+                const step& at = p[p.size - 1];
+                bool present = at.node->present.load(std::memory_order_acquire);
+                if (at.node->lock.validate(at.version))
+                    return present;
+            }
+        }
+    }
+
+    // A copy of the value mapped to key, if any.
+    std::optional<T> get(const Key& key) const {
+        auto pin = epochs_.enter();
+        path p;
+        for (;;) {
+            probe r = descend(key, p);
+            if (r == probe::absent)
+                return std::nullopt;
+            if (r == probe::found) {
+                const step& at = p[p.size - 1];
+                std::optional<T> out;
+                if (at.node->present.load(std::memory_order_acquire))
+                    out.emplace(at.node->value.second);
+                if (at.node->lock.validate(at.version))
+                    return out;
+            }
+        }
+    }
+
+    // Updates. Each is linearizable.
+
+    bool insert(const value_type& v) {
+        return put(v.first, false, [&] { return create_node(v); });
+    }
+
+    // Returns true if key was inserted, false if assigned.
+    template <class M>
+    bool insert_or_assign(const Key& key, M&& obj) {
+        return put(key, true, [&] {
+            return create_node(std::piecewise_construct, std::forward_as_tuple(key),
+                               std::forward_as_tuple(std::forward<M>(obj)));
+        });
+    }
+
+    size_type erase(const Key& key) {
+        auto pin = epochs_.enter();
+        path p;
+        for (;;) {
+            probe r = descend(key, p);
+            if (r == probe::absent)
+                return 0;
+            if (r == probe::retry)
+                continue;
+            const step& at = p[p.size - 1];
+            node_type* n = at.node;
+            if (!n->present.load(std::memory_order_acquire)) {
+                if (n->lock.validate(at.version))
+                    return 0;
+                continue;
+            }
+            node_type* left = n->left();
+            node_type* right = n->right();
+            if (left && right) {
+                lock_set locks;
+                if (!locks.add(at))
+                    continue;
+                n->present.store(false, std::memory_order_release);
+                locks.release();
+                add_count(-1);
+                return 1;
+            }
+            {
+                lock_set locks;
+                if (!locks.add(p[p.size - 2]) || !locks.add(at))
+                    continue;
+                n->present.store(false, std::memory_order_release);
+                replace_child(p[p.size - 2].node, n, left ? left : right);
+                locks.unlink(n);
+            }
+            retire(n);
+            add_count(-1);
+            rebalance(key, p, above(p, 2), true);
+            return 1;
+        }
+    }
+
+    // Calls f on every element in key order. No writer may run meanwhile.
+    template <class F>
+    void for_each(F f) const {
+        visit(head_.left(), f);
+    }
+
+    // Relinks the elements into a perfectly balanced tree in O(n) and
+    // frees the routing nodes and retired nodes that erases left behind.
+    // Concurrent updates keep balance only approximately, so a tree that
+    // has seen heavy contention may be deeper than an aa_tree of the same
+    // size; afterwards it has the shape of one built from sorted input.
+    // No other thread may use the tree meanwhile.
+    void rebuild() {
+        retired_.drain();
+        node_type* first = nullptr;
+        node_type* last = nullptr;
+        size_type n = 0;
+        for (node_type* x = head_.left(); x;) {
+            if (node_type* l = x->left()) {
+                x->child[0].store(l->right(), std::memory_order_relaxed);
+                l->child[1].store(x, std::memory_order_relaxed);
+                x = l;
+                continue;
+            }
+            node_type* next = x->right();
+            if (x->present.load(std::memory_order_relaxed)) {
+                if (last)
+                    last->child[1].store(x, std::memory_order_relaxed);
+                else
+                    first = x;
+                last = x;
+                ++n;
+            } else {
+                destroy_node(x);
+            }
+            x = next;
+        }
+        if (last)
+            last->child[1].store(nullptr, std::memory_order_relaxed);
+        head_.child[0].store(build_from_list(first, n), std::memory_order_release);
+    }
+
+private:
+    using node_type = detail::olc_node<value_type>;
+    using alloc_traits = std::allocator_traits<Allocator>;
+    using node_allocator = typename alloc_traits::template rebind_alloc<node_type>;
+    using node_alloc_traits = std::allocator_traits<node_allocator>;
+    friend struct detail::root_access;
+
+    // A node and the version it was reached at.
+    struct step {
+        node_type* node;
+        std::uint64_t version;
+    };
+
+    // The nodes of one descent, head_ first. Keeps the last max_height
+    // steps, which is all of them unless the tree is wildly out of balance.
+    struct path {
+        step steps[detail::max_height];
+        std::size_t size = 0;
+
+        void push(const step& s) noexcept { steps[size++ % detail::max_height] = s; }
+        step& operator[](std::size_t i) noexcept { return steps[i % detail::max_height]; }
+        std::size_t first() const noexcept {
+            return size > detail::max_height ? size - detail::max_height : 0;
+        }
+    };
+
+    // Write locks, each taken only if the node is still at the version it
+    // was read at; all are released together.
+    class lock_set {
+    public:
+        lock_set() = default;
+        lock_set(const lock_set&) = delete;
+        lock_set& operator=(const lock_set&) = delete;
+        ~lock_set() { release(); }
+
+        bool add(const step& s) noexcept {
+            if (!s.node->lock.try_lock(s.version))
+                return false;
+            held_[size_++] = s.node;
+            return true;
+        }
+
+        // n, which must be held, is released as obsolete.
+        void unlink(node_type* n) noexcept { unlinked_ = n; }
+
+        void release() noexcept {
+            for (std::size_t i = 0; i < size_; ++i) {
+                if (held_[i] == unlinked_)
+                    held_[i]->lock.unlock_obsolete();
+                else
+                    held_[i]->lock.unlock();
+            }
+            size_ = 0;
+        }
+
+    private:
+        node_type* held_[3];
+        std::size_t size_ = 0;
+        node_type* unlinked_ = nullptr;
+    };
+
+    enum class probe { found, absent, retry };
+    enum class repair { none, done, retry };
+
+    struct node_deleter {
+        concurrent_aa_tree* tree;
+        void operator()(node_type* n) const noexcept { tree->destroy_node(n); }
+    };
+
+    // Per-thread element counts, summed by size().
+    struct alignas(64) stripe {
+        std::atomic<std::ptrdiff_t> count{0};
+    };
+
+    static constexpr std::size_t count_stripes = 64;
+    // Retirements between attempts to advance the epoch and free nodes.
+    static constexpr std::size_t collect_every = 64;
+
+    bool less(const Key& a, const Key& b) const { return comp_(a, b); }
+
+    static unsigned level_of(const node_type* n) noexcept {
+        return n ? n->level.load(std::memory_order_relaxed) : 0;
+    }
+
+    node_type* head() const noexcept { return &head_; }
+    node_type* root_node() const noexcept { return head_.left(); }
+
+    // Optimistic descent toward key, recording each node with the version
+    // it was reached at. A child's version is read before its parent's is
+    // validated, so each recorded node was linked under the one before it
+    // while its version was current. Starts from head_, or resumes from
+    // p[from] of an earlier descent if that node is still at its recorded
+    // version: it is then still linked and covers the same keys.
+    probe descend(const Key& key, path& p, std::size_t from = 0) const {
+        node_type* n;
+        std::uint64_t v;
+        if (from == 0) {
+            p.size = 0;
+            n = head();
+            v = n->lock.read();
+            p.push({n, v});
+        } else {
+            p.size = from + 1;
+            n = p[from].node;
+            v = p[from].version;
+        }
+        for (;;) {
+            node_type* c;
+            if (n == head() || less(key, n->value.first))
+                c = n->left();
+            else if (less(n->value.first, key))
+                c = n->right();
+            else
+                return probe::found;
+            if (!c)
+                return n->lock.validate(v) ? probe::absent : probe::retry;
+            std::uint64_t cv = c->lock.read();
+            if (!n->lock.validate(v))
+                return probe::retry;
+            p.push({c, cv});
+            n = c;
+            v = cv;
+        }
+    }
+
+    // The latest node of p that is back steps above the last, if it is
+    // still recorded; 0 (a fresh descent) otherwise.
+    static std::size_t above(const path& p, std::size_t back) noexcept {
+        return p.size >= p.first() + back + 1 ? p.size - 1 - back : 0;
+    }
+
+    // Points the link of parent that held from at to.
+    static void replace_child(node_type* parent, node_type* from, node_type* to) noexcept {
+        parent->child[parent->left() == from ? 0 : 1].store(to, std::memory_order_release);
+    }
+
+    template <class Make>
+    bool put(const Key& key, bool assign, Make make) {
+        auto pin = epochs_.enter();
+        node_type* fresh = nullptr;
+        path p;
+        for (;;) {
+            probe r = descend(key, p);
+            if (r == probe::retry)
+                continue;
+            const step& at = p[p.size - 1];
+            if (r == probe::found) {
+                node_type* n = at.node;
+                bool live = n->present.load(std::memory_order_acquire);
+                if (live && !assign) {
+                    if (!n->lock.validate(at.version))
+                        continue;
+                    if (fresh)
+                        destroy_node(fresh);
+                    return false;
+                }
+                // A new node takes the old one's place, links and level.
+                if (!fresh)
+                    fresh = make();
+                {
+                    lock_set locks;
+                    if (!locks.add(p[p.size - 2]) || !locks.add(at))
+                        continue;
+                    fresh->child[0].store(n->left(), std::memory_order_relaxed);
+                    fresh->child[1].store(n->right(), std::memory_order_relaxed);
+                    fresh->level.store(n->level.load(std::memory_order_relaxed),
+                                       std::memory_order_relaxed);
+                    replace_child(p[p.size - 2].node, n, fresh);
+                    locks.unlink(n);
+                }
+                retire(n);
+                if (!live)
+                    add_count(1);
+                return !live;
+            }
+            if (!fresh)
+                fresh = make();
+            {
+                lock_set locks;
+                if (!locks.add(at))
+                    continue;
+                bool right = at.node != head() && less(at.node->value.first, key);
+                at.node->child[right].store(fresh, std::memory_order_release);
+            }
+            add_count(1);
+            rebalance(key, p, above(p, 1), false);
+            return true;
+        }
+    }
+
+    // Repairs the path to key bottom-up, one violation at a time, until a
+    // pass finds none. After an erase each pass also checks the two nodes
+    // to the right of every path node, which erase rebalancing rotates too.
+    // After a repair the next pass descends again from the lowest node the
+    // repair left untouched and, as in the sequential algorithm, looks for
+    // new violations only from the repaired spot upward. Anything that
+    // goes wrong starts a full pass from the root. A violation that other
+    // writers' rotations carry off every path is left for a later writer
+    // passing by; it costs depth, never correctness.
+    void rebalance(const Key& key, path& p, std::size_t from, bool erased) {
+        constexpr std::size_t bottom = std::numeric_limits<std::size_t>::max();
+        std::size_t start = bottom;
+        for (;;) {
+            if (descend(key, p, from) == probe::retry) {
+                from = 0;
+                start = bottom;
+                continue;
+            }
+            repair r = repair::none;
+            std::size_t i = std::min(p.size - 1, start);
+            for (; i > p.first(); --i)
+                if ((r = repair_around(p[i - 1], p[i], erased)) != repair::none)
+                    break;
+            if (r == repair::none)
+                return;
+            start = r == repair::done ? i + 1 : bottom;
+            p.size = i + 1;
+            from = above(p, 2);
+        }
+    }
+
+    repair repair_around(const step& parent, const step& t, bool neighbours) {
+        repair r = repair_node(parent, t);
+        step s = t;
+        for (int k = 0; neighbours && k < 2 && r == repair::none; ++k) {
+            node_type* c = s.node->right();
+            if (!c)
+                break;
+            step cs{c, c->lock.read()};
+            if (!s.node->lock.validate(s.version))
+                return repair::retry;
+            r = repair_node(s, cs);
+            s = cs;
+        }
+        return r;
+    }
+
+    // Fixes the first of these at x, the child of px, in the order the
+    // sequential algorithm would: a routing node with a missing child is
+    // unlinked, a level above its children's is lowered, a horizontal left
+    // link is skewed and two horizontal right links are split. Updates
+    // that interleave can also leave a child above its parent, which never
+    // happens sequentially; rotating the child up moves the violation down
+    // until it disappears. A level only changes with both the node and its
+    // parent locked, so a node's version covers its children's levels.
+    repair repair_node(const step& px, const step& x) {
+        node_type* n = x.node;
+        node_type* l = n->left();
+        node_type* r = n->right();
+        unsigned level = n->level.load(std::memory_order_relaxed);
+        bool present = n->present.load(std::memory_order_relaxed);
+        step ls{l, l ? l->lock.read() : 0};
+        step rs{r, r ? r->lock.read() : 0};
+        unsigned ll = level_of(l);
+        unsigned rl = level_of(r);
+        unsigned rrl = r ? level_of(r->right()) : 0;
+        if (r && !r->lock.validate(rs.version))
+            return repair::retry;
+        if (!n->lock.validate(x.version))
+            return repair::retry;
+
+        lock_set locks;
+        if (!present && (!l || !r)) {
+            if (!locks.add(px) || !locks.add(x))
+                return repair::retry;
+            replace_child(px.node, n, l ? l : r);
+            locks.unlink(n);
+            locks.release();
+            retire(n);
+            return repair::done;
+        }
+        unsigned want = std::min(ll, rl) + 1;
+        if (want < level) {
+            bool lower_right = rl > want;
+            if (!locks.add(px) || !locks.add(x) || (lower_right && !locks.add(rs)))
+                return repair::retry;
+            n->level.store(want, std::memory_order_relaxed);
+            if (lower_right)
+                r->level.store(want, std::memory_order_relaxed);
+            return repair::done;
+        }
+        if (l && ll >= level) {
+            if (!locks.add(px) || !locks.add(x) || !locks.add(ls))
+                return repair::retry;
+            n->child[0].store(l->right(), std::memory_order_release);
+            l->child[1].store(n, std::memory_order_release);
+            replace_child(px.node, n, l);
+            return repair::done;
+        }
+        if (r && rl > level) {
+            if (!locks.add(px) || !locks.add(x) || !locks.add(rs))
+                return repair::retry;
+            n->child[1].store(r->left(), std::memory_order_release);
+            r->child[0].store(n, std::memory_order_release);
+            replace_child(px.node, n, r);
+            return repair::done;
+        }
+        if (r && rrl == level) {
+            if (!locks.add(px) || !locks.add(x) || !locks.add(rs))
+                return repair::retry;
+            n->child[1].store(r->left(), std::memory_order_release);
+            r->child[0].store(n, std::memory_order_release);
+            r->level.store(rl + 1, std::memory_order_relaxed);
+            replace_child(px.node, n, r);
+            return repair::done;
+        }
+        return repair::none;
+    }
+
+    void add_count(std::ptrdiff_t d) noexcept {
+        counts_[detail::thread_slot(count_stripes)].count.fetch_add(d, std::memory_order_relaxed);
+    }
+
+    // Queues n for freeing once no search can reach it, and every so often
+    // frees what has become safe.
+    void retire(node_type* n) {
+        std::lock_guard<std::mutex> lock(reclaim_);
+        retired_.retire(n, epochs_.epoch());
+        if (++since_collect_ >= collect_every) {
+            since_collect_ = 0;
+            epochs_.try_advance();
+            retired_.collect(epochs_.epoch());
+        }
+    }
+
+    template <class... Args>
+    node_type* create_node(Args&&... args) {
+        node_type* n = node_alloc_traits::allocate(alloc_, 1);
+        ::new (static_cast<void*>(n)) node_type();
+        try {
+            node_alloc_traits::construct(alloc_, std::addressof(n->value),
+                                         std::forward<Args>(args)...);
+        } catch (...) {
+            n->~node_type();
+            node_alloc_traits::deallocate(alloc_, n, 1);
+            throw;
+        }
+        return n;
+    }
+
+    void destroy_node(node_type* n) noexcept {
+        node_alloc_traits::destroy(alloc_, std::addressof(n->value));
+        n->~node_type();
+        node_alloc_traits::deallocate(alloc_, n, 1);
+    }
+
+    // Frees the subtree at n, rotating left children up as it goes so that
+    // no stack is needed however deep the tree has grown.
+    void destroy(node_type* n) noexcept {
+        while (n) {
+            if (node_type* l = n->left()) {
+                n->child[0].store(l->right(), std::memory_order_relaxed);
+                l->child[1].store(n, std::memory_order_relaxed);
+                n = l;
+            } else {
+                node_type* next = n->right();
+                destroy_node(n);
+                n = next;
+            }
+        }
+    }
+
+    template <class F>
+    static void visit(const node_type* n, F& f) {
+        std::vector<const node_type*> stack;
+        for (;;) {
+            for (; n; n = n->left())
+                stack.push_back(n);
+            if (stack.empty())
+                return;
+            n = stack.back();
+            stack.pop_back();
+            if (n->present.load(std::memory_order_relaxed))
+                f(n->value);
+            n = n->right();
+        }
+    }
+
+    static unsigned level_for_size(size_type n) noexcept {
+        unsigned level = 0;
+        for (size_type s = n + 1; s > 1; s >>= 1)
+            ++level;
+        return level;
+    }
+
+    // The next n nodes of a list chained through right links as a subtree
+    // of the shape aa_tree::build_sorted gives, with the same levels.
+    static node_type* build_from_list(node_type*& first, size_type n) noexcept {
+        if (n == 0)
+            return nullptr;
+        size_type nl = (n - 1) / 2;
+        node_type* left = build_from_list(first, nl);
+        node_type* root = first;
+        first = first->right();
+        root->child[0].store(left, std::memory_order_relaxed);
+        root->child[1].store(build_from_list(first, n - 1 - nl), std::memory_order_relaxed);
+        root->level.store(level_for_size(n), std::memory_order_relaxed);
+        return root;
+    }
+
+    // The root is head_'s left child; head_ is never unlinked and its
+    // infinite level keeps it out of every rotation.
+    mutable node_type head_;
+    Compare comp_;
+    node_allocator alloc_;
+    detail::epoch_domain epochs_;
+    std::mutex reclaim_;
+    detail::retire_list<node_type, node_deleter> retired_;
+    std::size_t since_collect_ = 0;
+    stripe counts_[count_stripes];
+};
+
+} // namespace aa
+
+#endif // AA_CONCURRENT_HPP
@@ -0,0 +1,161 @@
+// Epoch-based reclamation for lock-free readers.
+//
+// epoch_domain tracks which readers may still see memory that a writer
+// has unlinked. A reader pins the current epoch for the duration of a
+// read; the writer retires unlinked objects tagged with the epoch of their
+// unlinking and frees them once the epoch has advanced twice, at which
+// point no reader can hold a reference. The epoch advances only when no
+// reader is pinned to the one before the current, so readers never wait
+// and the writer never blocks unless it asks to.
+//
+// Readers announce themselves in one of reader_slots cache-line sized
+// slots picked per thread, each holding a count per epoch parity; there
+// is no registration, and a slot shared by two threads only costs them
+// some cache traffic.
+
+#ifndef AA_EPOCH_HPP
+#define AA_EPOCH_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace aa {
+namespace detail {
+
+// A per-thread index in [0, n) spreading threads over striped state.
+inline std::size_t thread_slot(std::size_t n) noexcept {
+    static thread_local const std::size_t hash =
+        std::hash<std::thread::id>()(std::this_thread::get_id());
+    return hash % n;
+}
+
+class epoch_domain {
+public:
+    static constexpr std::size_t reader_slots = 64;
+
+    // A pinned epoch; readers hold one while they dereference shared data.
+    class pin {
+    public:
+        pin() noexcept = default;
+        pin(pin&& other) noexcept : count_(std::exchange(other.count_, nullptr)) {}
+        pin& operator=(pin&& other) noexcept {
+            if (this != &other) {
+                unpin();
+                count_ = std::exchange(other.count_, nullptr);
+            }
+            return *this;
+        }
+        ~pin() { unpin(); }
+
+    private:
+        friend class epoch_domain;
+
+        explicit pin(std::atomic<std::size_t>* count) noexcept : count_(count) {}
+
+        void unpin() noexcept {
+            if (count_)
+                count_->fetch_sub(1, std::memory_order_release);
+        }
+
+        std::atomic<std::size_t>* count_ = nullptr;
+    };
+
+    epoch_domain() = default;
+    epoch_domain(const epoch_domain&) = delete;
+    epoch_domain& operator=(const epoch_domain&) = delete;
+
+    // Announces a reader in the current epoch. Retries only if the epoch
+    // moves between reading and announcing it.
+    pin enter() const noexcept {
+        slot& s = slots_[thread_slot(reader_slots)];
+        for (;;) {
+            std::uint64_t e = epoch_.load(std::memory_order_seq_cst);
+            std::atomic<std::size_t>& count = s.active[e & 1];
+            count.fetch_add(1, std::memory_order_seq_cst);
+            if (epoch_.load(std::memory_order_seq_cst) == e)
+                return pin(&count);
+            count.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    std::uint64_t epoch() const noexcept { return epoch_.load(std::memory_order_seq_cst); }
+
+    // Moves to the next epoch if no reader is pinned to the previous one,
+    // which is the only parity other than the current one that a reader
+    // can hold. Returns whether the epoch advanced. Calls must not overlap:
+    // only the writer, or writers holding a common lock, advance.
+    bool try_advance() noexcept {
+        std::uint64_t e = epoch_.load(std::memory_order_seq_cst);
+        for (const slot& s : slots_)
+            if (s.active[(e + 1) & 1].load(std::memory_order_seq_cst) != 0)
+                return false;
+        epoch_.store(e + 1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    // Advances twice, waiting for readers as needed, so everything retired
+    // before the call is safe to free afterwards.
+    void synchronize() noexcept {
+        for (int i = 0; i < 2; ++i)
+            while (!try_advance())
+                std::this_thread::yield();
+    }
+
+private:
+    struct alignas(64) slot {
+        std::atomic<std::size_t> active[2] = {};
+    };
+
+    std::atomic<std::uint64_t> epoch_{0};
+    mutable slot slots_[reader_slots];
+};
+
+// Objects unlinked by writers, waiting for the readers that may still see
+// them. Deleter is called on each once it is safe. Not synchronized: one
+// writer, or writers holding a common lock, use a list.
+template <class T, class Deleter>
+class retire_list {
+public:
+    explicit retire_list(Deleter del = Deleter()) : del_(std::move(del)) {}
+    retire_list(const retire_list&) = delete;
+    retire_list& operator=(const retire_list&) = delete;
+    ~retire_list() { drain(); }
+
+    void retire(T* p, std::uint64_t epoch) { pending_.push_back({p, epoch}); }
+
+    // Frees everything retired at least two epochs before epoch.
+    void collect(std::uint64_t epoch) noexcept {
+        std::size_t done = 0;
+        while (done < pending_.size() && pending_[done].epoch + 2 <= epoch)
+            del_(pending_[done++].ptr);
+        pending_.erase(pending_.begin(), pending_.begin() + static_cast<std::ptrdiff_t>(done));
+    }
+
+    // Frees everything; no reader may be pinned.
+    void drain() noexcept {
+        for (const entry& e : pending_)
+            del_(e.ptr);
+        pending_.clear();
+    }
+
+    std::size_t size() const noexcept { return pending_.size(); }
+
+private:
+    struct entry {
+        T* ptr;
+        std::uint64_t epoch;
+    };
+
+    std::vector<entry> pending_;
+    Deleter del_;
+};
+
+} // namespace detail
+} // namespace aa
+
+#endif // AA_EPOCH_HPP
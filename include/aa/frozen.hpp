@@ -0,0 +1,208 @@
+// Immutable, read-optimized snapshot of an ordered map.
+//
+// frozen_map keeps its elements in one sorted array and searches them
+// through an implicit B+-tree: a pointer-free array of separator keys laid
+// out level by level, block_keys keys per node, where the children of node
+// j are nodes j * (block_keys + 1) ... j * (block_keys + 1) + block_keys of
+// the level below. A node is sized to about a cache line, so a lookup
+// costs one line per level and ranks the key within a node with a
+// branch-free count: explicit SIMD for 32- and 64-bit integer, float and
+// double keys (see simd.hpp), a loop the compiler may vectorise otherwise.
+// aa_tree::freeze() produces one from the tree's in-order contents; the
+// tree remains the write path.
+
+#ifndef AA_FROZEN_HPP
+#define AA_FROZEN_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "simd.hpp"
+
+namespace aa {
+
+template <class Key, class T, class Compare = std::less<Key>>
+class frozen_map {
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<const Key, T>;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using key_compare = Compare;
+    using const_reference = const value_type&;
+    using const_iterator = typename std::vector<value_type>::const_iterator;
+    using iterator = const_iterator;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+    using reverse_iterator = const_reverse_iterator;
+
+    // Keys per search node: a 64-byte line of small keys, at least four.
+    static constexpr size_type block_keys = std::max<size_type>(64 / sizeof(Key), 4);
+
+    frozen_map() = default;
+
+    explicit frozen_map(const Compare& comp) : comp_(comp) {}
+
+    frozen_map(const frozen_map&) = default;
+    frozen_map(frozen_map&&) = default;
+
+    // Elements have a const key and cannot be assigned in place, so a copy
+    // is built aside and moved in.
+    frozen_map& operator=(const frozen_map& other) {
+        if (this != &other)
+            *this = frozen_map(other);
+        return *this;
+    }
+    frozen_map& operator=(frozen_map&&) = default;
+
+    // [first, last) must be strictly increasing under comp, as produced by
+    // iterating an aa_tree or std::map.
+    template <class InputIt>
+    frozen_map(InputIt first, InputIt last, const Compare& comp = Compare()) : comp_(comp) {
+        for (; first != last; ++first)
+            entries_.emplace_back(*first);
+        build_index();
+    }
+
+    const_iterator begin() const noexcept { return entries_.begin(); }
+    const_iterator end() const noexcept { return entries_.end(); }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+    const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+
+    bool empty() const noexcept { return entries_.empty(); }
+    size_type size() const noexcept { return entries_.size(); }
+    key_compare key_comp() const { return comp_; }
+
+    const T& at(const Key& key) const {
+        const_iterator it = find(key);
+        if (it == end())
+            throw std::out_of_range("frozen_map::at");
+        return it->second;
+    }
+
+    size_type count(const Key& key) const { return find(key) != end() ? 1 : 0; }
+    bool contains(const Key& key) const { return find(key) != end(); }
+
+    const_iterator find(const Key& key) const {
+        size_type i = lower_index(key);
+        return i < size() && !comp_(key, entries_[i].first) ? begin() + i : end();
+    }
+
+    const_iterator lower_bound(const Key& key) const { return begin() + lower_index(key); }
+
+    const_iterator upper_bound(const Key& key) const { return begin() + rank<true>(key); }
+
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    // Bytes of the search index, excluding the element array.
+    size_type index_bytes() const noexcept { return index_.capacity() * sizeof(Key); }
+
+    friend bool operator==(const frozen_map& a, const frozen_map& b) {
+        return a.entries_ == b.entries_;
+    }
+    friend bool operator!=(const frozen_map& a, const frozen_map& b) { return !(a == b); }
+
+private:
+    // One level of the index: blocks nodes of block_keys keys from offset.
+    struct level {
+        size_type offset;
+        size_type blocks;
+    };
+
+    size_type lower_index(const Key& key) const { return rank<false>(key); }
+
+    // Number of elements with a key below key, or not above it if OrEqual.
+    template <bool OrEqual>
+    size_type rank(const Key& key) const {
+#ifdef AA_SIMD_X86
+        if constexpr (detail::simd_block<Key, Compare, block_keys>::value) {
+            switch (detail::simd_support()) {
+            case detail::simd_level::avx2:
+                return search([&](const Key* node) { return detail::rank_avx2<OrEqual>(node, key); });
+            case detail::simd_level::sse42:
+                return search([&](const Key* node) { return detail::rank_sse42<OrEqual>(node, key); });
+            case detail::simd_level::scalar:
+                break;
+            }
+        }
+#endif
+        return search([&](const Key* node) {
+            size_type i = 0;
+            for (size_type j = 0; j < block_keys; ++j)
+                i += OrEqual ? !comp_(key, node[j]) : comp_(node[j], key);
+            return i;
+        });
+    }
+
+    // Descends with rank_in, which counts the keys of one node that precede
+    // the search key; the count picks the child, or at the bottom the
+    // position, to continue from. The last node of each level is padded
+    // with repeats of its last key; clamping undoes any overcount the
+    // padding adds.
+    template <class RankIn>
+    size_type search(RankIn rank_in) const {
+        if (levels_.empty())
+            return 0;
+        size_type node = 0;
+        for (size_type l = levels_.size() - 1; l > 0; --l) {
+            size_type i = rank_in(index_.data() + levels_[l].offset + node * block_keys);
+            node = std::min(node * (block_keys + 1) + i, levels_[l - 1].blocks - 1);
+        }
+        size_type i = rank_in(index_.data() + node * block_keys);
+        return std::min(node * block_keys + i, size());
+    }
+
+    // Level 0 holds every key in order; a node above holds, for its
+    // children 1 .. block_keys, the smallest key below each.
+    void build_index() {
+        index_.clear();
+        levels_.clear();
+        size_type n = size();
+        if (n == 0)
+            return;
+        size_type blocks = (n + block_keys - 1) / block_keys;
+        levels_.push_back({0, blocks});
+        while (blocks > 1) {
+            blocks = (blocks + block_keys) / (block_keys + 1);
+            levels_.push_back({levels_.back().offset + levels_.back().blocks * block_keys, blocks});
+        }
+        const level& top = levels_.back();
+        index_.reserve(top.offset + top.blocks * block_keys);
+
+        for (size_type i = 0; i < levels_[0].blocks * block_keys; ++i)
+            index_.push_back(entries_[std::min(i, n - 1)].first);
+        // Leaf nodes under each node of the level below the one being built.
+        size_type child_leaves = 1;
+        for (size_type l = 1; l < levels_.size(); ++l, child_leaves *= block_keys + 1) {
+            size_type children = levels_[l - 1].blocks;
+            for (size_type node = 0; node < levels_[l].blocks; ++node) {
+                size_type last = 0;
+                for (size_type s = 1; s <= block_keys; ++s) {
+                    size_type c = node * (block_keys + 1) + s;
+                    if (c < children)
+                        last = c * child_leaves * block_keys;
+                    index_.push_back(index_[last]);
+                }
+            }
+        }
+    }
+
+    std::vector<value_type> entries_;
+    std::vector<Key> index_;
+    std::vector<level> levels_;
+    Compare comp_;
+};
+
+} // namespace aa
+
+#endif // AA_FROZEN_HPP
@@ -0,0 +1,370 @@
+// AA-tree stored in a memory-mapped file.
+//
+// mapped_aa_tree keeps an aa_tree whose nodes live in a file mapped with
+// mmap. Nodes link to their children by self-relative 64-bit offsets
+// (relative_links), so the tree is valid wherever the file is mapped, and
+// reopening it maps the file and reads the root offset from its header:
+// nothing is deserialized. Updates run the ordinary aa_tree code, skew and
+// split included, on nodes allocated from the file.
+//
+// The header records the root, the size, the allocator's state and two
+// checksums, one over the header and one over the node region, together
+// with a clean flag. The first update after a sync clears the flag and
+// flushes the header page before any node changes, so the file on disk
+// never claims to be clean while holding unsynced nodes. sync() flushes
+// the nodes first and only then writes the sealed header. open checks
+// the header checksum and the clean flag, and by default also the node
+// region: a file that was modified and not synced is rejected, because
+// its tree may be half rebalanced, and so is one whose nodes were
+// corrupted after it was sealed. Checking the node region reads the whole
+// file; mapped_options::verify_data = false skips it for an O(1) open
+// that still catches crashes but not damage to the node pages.
+//
+// POSIX only. Key and T must be trivially copyable, since their bytes are
+// the file format; one process at a time may open a file.
+
+#ifndef AA_MAPPED_HPP
+#define AA_MAPPED_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "aa_tree.hpp"
+#include "checksum.hpp"
+
+namespace aa {
+
+struct mapped_options {
+    // Address space reserved for the file; it can grow up to this size.
+    std::size_t max_size = std::size_t(64) << 30;
+    // Checks the node region's checksum at open, reading the whole file.
+    bool verify_data = true;
+};
+
+// Traits for mapped trees: position independent 64-bit links. Layouts
+// holding raw pointers, and threaded trees, cannot be mapped.
+struct mapped_tree_traits : default_tree_traits {
+    using layout = relative_links<std::int64_t>;
+};
+
+namespace detail {
+
+// A file mapped at a fixed address for its whole lifetime, carved into
+// blocks of one size. The header sits in the first page; blocks follow,
+// handed out by bumping end or from a freelist threaded through freed
+// blocks by offset. The file grows with ftruncate inside the reserved
+// mapping, so block addresses never move.
+class mapped_file {
+public:
+    static constexpr std::uint64_t magic = 0x31454552544141; // "AATREE1"
+    static constexpr std::uint64_t data_begin = 4096;
+
+    struct header {
+        std::uint64_t magic;
+        std::uint64_t format;      // fingerprint of key, value and node layout
+        std::uint64_t block_size;
+        std::uint64_t root;        // offset of the root node, 0 if empty
+        std::uint64_t count;
+        std::uint64_t end;         // offset past the last block handed out
+        std::uint64_t free_head;   // offset of the first free block, 0 if none
+        std::uint64_t clean;       // 1 after sync(), 0 once modified
+        std::uint64_t data_sum;
+        std::uint64_t header_sum;  // over the fields above
+    };
+
+    mapped_file(const std::string& path, std::uint64_t format, std::size_t block_size,
+                const mapped_options& opts)
+        : reserved_(opts.max_size) {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            throw std::system_error(errno, std::generic_category(), "mapped_file: open " + path);
+        try {
+            struct stat st;
+            if (::fstat(fd_, &st) != 0)
+                throw std::system_error(errno, std::generic_category(), "mapped_file: fstat");
+            size_ = static_cast<std::uint64_t>(st.st_size);
+            bool fresh = size_ == 0;
+            if (fresh)
+                resize(data_begin);
+            else if (size_ < data_begin || size_ > reserved_)
+                throw std::runtime_error("mapped_file: " + path + " has an invalid size");
+            void* p = ::mmap(nullptr, reserved_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            if (p == MAP_FAILED)
+                throw std::system_error(errno, std::generic_category(), "mapped_file: mmap");
+            base_ = static_cast<char*>(p);
+            if (fresh)
+                init(format, block_size);
+            else
+                validate(path, format, block_size, opts.verify_data);
+        } catch (...) {
+            close();
+            throw;
+        }
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    ~mapped_file() { close(); }
+
+    header& head() noexcept { return *reinterpret_cast<header*>(base_); }
+
+    void* at(std::uint64_t offset) noexcept { return offset ? base_ + offset : nullptr; }
+    std::uint64_t offset_of(const void* p) const noexcept {
+        return p ? static_cast<std::uint64_t>(static_cast<const char*>(p) - base_) : 0;
+    }
+
+    void* allocate() {
+        header& h = head();
+        if (std::uint64_t b = h.free_head) {
+            std::memcpy(&h.free_head, base_ + b, sizeof h.free_head);
+            return base_ + b;
+        }
+        std::uint64_t b = h.end;
+        if (b + h.block_size > size_) {
+            // Grow geometrically, at most 1 GiB at a time.
+            std::uint64_t step = std::min<std::uint64_t>(std::max<std::uint64_t>(size_, 1 << 20),
+                                                         std::uint64_t(1) << 30);
+            std::uint64_t want = std::min<std::uint64_t>(size_ + step, reserved_);
+            if (b + h.block_size > want)
+                throw std::bad_alloc();
+            resize(want);
+        }
+        h.end = b + h.block_size;
+        return base_ + b;
+    }
+
+    void deallocate(void* p) noexcept {
+        header& h = head();
+        std::memcpy(p, &h.free_head, sizeof h.free_head);
+        h.free_head = offset_of(p);
+    }
+
+    std::size_t block_size() const noexcept {
+        return static_cast<std::size_t>(reinterpret_cast<const header*>(base_)->block_size);
+    }
+
+    // Clears the clean flag and writes the header page out before the
+    // caller changes any node; otherwise the kernel could write back a
+    // changed node while the file still claims to be clean. Only the first
+    // call after a sync flushes.
+    void mark_modified() {
+        if (marked_)
+            return;
+        head().clean = 0;
+        flush(data_begin);
+        marked_ = true;
+    }
+
+    // Flushes every node, then seals the header and flushes it, so the
+    // clean flag reaches the file only after the nodes it vouches for.
+    void sync(std::uint64_t root, std::uint64_t count) {
+        mark_modified();
+        header& h = head();
+        h.root = root;
+        h.count = count;
+        flush(h.end);
+        h.data_sum = checksum(base_ + data_begin, h.end - data_begin);
+        h.clean = 1;
+        h.header_sum = checksum(&h, offsetof(header, header_sum));
+        flush(data_begin);
+        marked_ = false;
+    }
+
+private:
+    void init(std::uint64_t format, std::size_t block_size) {
+        header& h = head();
+        h = header();
+        h.magic = magic;
+        h.format = format;
+        h.block_size = (block_size + 7) / 8 * 8;
+        h.end = data_begin;
+        h.clean = 1;
+        sync(0, 0);
+    }
+
+    void validate(const std::string& path, std::uint64_t format, std::size_t block_size,
+                  bool verify_data) const {
+        const header& h = *reinterpret_cast<const header*>(base_);
+        auto fail = [&](const char* why) {
+            throw std::runtime_error("mapped_file: " + path + ": " + why);
+        };
+        if (h.magic != magic)
+            fail("not a mapped AA-tree");
+        // Updates leave the header checksum stale, so test the flag first
+        // to report the likelier cause.
+        if (!h.clean)
+            fail("modified and not synced");
+        if (h.header_sum != checksum(&h, offsetof(header, header_sum)))
+            fail("header checksum mismatch");
+        if (h.format != format || h.block_size != (block_size + 7) / 8 * 8)
+            fail("written for a different key, value or node type");
+        if (h.end < data_begin || h.end > size_)
+            fail("truncated");
+        if (verify_data && h.data_sum != checksum(base_ + data_begin, h.end - data_begin))
+            fail("data checksum mismatch");
+    }
+
+    // Writes the first n bytes of the mapping to the file and waits.
+    void flush(std::uint64_t n) {
+        if (::msync(base_, n, MS_SYNC) != 0)
+            throw std::system_error(errno, std::generic_category(), "mapped_file: msync");
+    }
+
+    void resize(std::uint64_t size) {
+        if (::ftruncate(fd_, static_cast<off_t>(size)) != 0)
+            throw std::system_error(errno, std::generic_category(), "mapped_file: ftruncate");
+        size_ = size;
+    }
+
+    void close() noexcept {
+        if (base_)
+            ::munmap(base_, reserved_);
+        if (fd_ >= 0)
+            ::close(fd_);
+        base_ = nullptr;
+        fd_ = -1;
+    }
+
+    int fd_ = -1;
+    char* base_ = nullptr;
+    std::uint64_t size_ = 0;
+    std::uint64_t reserved_;
+    // Whether clean = 0 has reached the file since the last sync.
+    bool marked_ = false;
+};
+
+} // namespace detail
+
+// Standard allocator handing out the blocks of a mapped_file. Only single
+// objects that fit a block can be allocated; the tree allocates nothing
+// else.
+template <class T>
+class mapped_allocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    template <class U>
+    struct rebind {
+        using other = mapped_allocator<U>;
+    };
+
+    explicit mapped_allocator(detail::mapped_file* file) noexcept : file_(file) {}
+
+    template <class U>
+    mapped_allocator(const mapped_allocator<U>& other) noexcept : file_(other.file_) {}
+
+    T* allocate(std::size_t n) {
+        if (n != 1 || sizeof(T) > file_->block_size() || alignof(T) > 8)
+            throw std::bad_alloc();
+        return static_cast<T*>(file_->allocate());
+    }
+
+    void deallocate(T* p, std::size_t) noexcept { file_->deallocate(p); }
+
+    friend bool operator==(const mapped_allocator& a, const mapped_allocator& b) noexcept {
+        return a.file_ == b.file_;
+    }
+    friend bool operator!=(const mapped_allocator& a, const mapped_allocator& b) noexcept {
+        return a.file_ != b.file_;
+    }
+
+private:
+    template <class U>
+    friend class mapped_allocator;
+
+    detail::mapped_file* file_;
+};
+
+template <class Key, class T, class Compare = std::less<Key>, class Traits = mapped_tree_traits>
+class mapped_aa_tree {
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<T>::value,
+                  "mapped_aa_tree stores keys and values as raw bytes");
+    static_assert(Traits::layout::max_span == 0 && !Traits::threaded,
+                  "mapped_aa_tree needs 64-bit relative links and no threads");
+
+public:
+    using tree_type = aa_tree<Key, T, Compare, mapped_allocator<std::pair<const Key, T>>, Traits>;
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = typename tree_type::value_type;
+    using size_type = typename tree_type::size_type;
+
+    // Opens path, creating an empty tree if the file is missing or empty.
+    // Throws std::system_error if the file cannot be opened or mapped and
+    // std::runtime_error if it fails validation.
+    explicit mapped_aa_tree(const std::string& path, mapped_options opts = {},
+                            const Compare& comp = Compare())
+        : file_(new detail::mapped_file(path, format(), sizeof(node_type), opts)),
+          tree_(comp, allocator_type(file_.get())) {
+        detail::mapped_file::header& h = file_->head();
+        tree_.base_.root = static_cast<node_type*>(file_->at(h.root));
+        tree_.base_.count = static_cast<size_type>(h.count);
+    }
+
+    mapped_aa_tree(const mapped_aa_tree&) = delete;
+    mapped_aa_tree& operator=(const mapped_aa_tree&) = delete;
+
+    // Syncs if the tree was modified. The nodes stay in the file.
+    ~mapped_aa_tree() {
+        if (!file_->head().clean) {
+            try {
+                sync();
+            } catch (...) {
+                // The file stays marked as modified and will be rejected.
+            }
+        }
+        tree_.release_nodes();
+    }
+
+    // The tree, for updates. From this call until the next sync() the file
+    // counts as modified. Throws std::system_error if that cannot be
+    // recorded in the file.
+    tree_type& tree() {
+        file_->mark_modified();
+        return tree_;
+    }
+    const tree_type& tree() const noexcept { return tree_; }
+
+    // Writes the root, size and checksums to the header and flushes every
+    // change to the file. Reads the whole node region to checksum it.
+    void sync() {
+        file_->sync(file_->offset_of(tree_.base_.root), tree_.size());
+    }
+
+private:
+    using allocator_type = mapped_allocator<value_type>;
+    using node_type = typename tree_type::node_type;
+
+    static std::uint64_t format() noexcept {
+        std::uint64_t f[] = {sizeof(Key), alignof(Key), sizeof(T), alignof(T),
+                             sizeof(node_type), alignof(node_type)};
+        return detail::checksum(f, sizeof f);
+    }
+
+    std::unique_ptr<detail::mapped_file> file_;
+    tree_type tree_;
+};
+
+} // namespace aa
+
+#endif // AA_MAPPED_HPP
@@ -0,0 +1,176 @@
+// Node link layouts for aa_tree.
+//
+// A layout decides how a node stores its two children and its level. Every
+// layout exposes the same accessors (left, right, level and their setters)
+// through a links<Node> base class that the node derives from, so the tree
+// algorithms never touch the representation directly.
+
+#ifndef AA_NODE_LAYOUT_HPP
+#define AA_NODE_LAYOUT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+namespace aa {
+
+// Two raw child pointers and a separate level byte. Fastest to decode; the
+// level byte usually costs a full word of padding.
+struct plain_links {
+    // Largest distance in bytes between two nodes of one tree; 0 if unbounded.
+    static constexpr std::uintptr_t max_span = 0;
+
+    template <class Node>
+    class links {
+    public:
+        Node* left() const noexcept { return left_; }
+        Node* right() const noexcept { return right_; }
+        void set_left(Node* n) noexcept { left_ = n; }
+        void set_right(Node* n) noexcept { right_ = n; }
+        unsigned level() const noexcept { return level_; }
+        void set_level(unsigned l) noexcept { level_ = static_cast<unsigned char>(l); }
+
+    private:
+        Node* left_ = nullptr;
+        Node* right_ = nullptr;
+        unsigned char level_ = 1;
+    };
+};
+
+// Raw child pointers with the level spread over their low bits. Nodes are
+// 16-byte aligned, leaving four spare bits per pointer and eight for the
+// level, so the level costs no storage at all.
+struct packed_links {
+    static constexpr std::uintptr_t max_span = 0;
+
+    template <class Node>
+    class alignas(16) links {
+        static constexpr std::uintptr_t mask = 15;
+
+    public:
+        Node* left() const noexcept { return reinterpret_cast<Node*>(left_ & ~mask); }
+        Node* right() const noexcept { return reinterpret_cast<Node*>(right_ & ~mask); }
+        void set_left(Node* n) noexcept {
+            left_ = reinterpret_cast<std::uintptr_t>(n) | (left_ & mask);
+        }
+        void set_right(Node* n) noexcept {
+            right_ = reinterpret_cast<std::uintptr_t>(n) | (right_ & mask);
+        }
+        unsigned level() const noexcept {
+            return static_cast<unsigned>((left_ & mask) | (right_ & mask) << 4);
+        }
+        void set_level(unsigned l) noexcept {
+            left_ = (left_ & ~mask) | (l & mask);
+            right_ = (right_ & ~mask) | (l >> 4 & mask);
+        }
+
+    private:
+        std::uintptr_t left_ = 1;
+        std::uintptr_t right_ = 0;
+    };
+};
+
+// Children stored as signed byte offsets from the node itself, with the
+// level spread over the three low bits of the two offsets (nodes are 8-byte
+// aligned). Offsets are position independent, so a subtree stays valid
+// wherever its memory is mapped. With 32-bit offsets all nodes of a tree
+// must lie within 2 GiB of each other -- in practice one arena -- and
+// aa_tree throws std::length_error when an allocation falls outside.
+template <class Offset>
+struct relative_links {
+    static_assert(std::is_integral<Offset>::value && std::is_signed<Offset>::value,
+                  "relative_links needs a signed integer offset type");
+
+    static constexpr std::uintptr_t max_span =
+        sizeof(Offset) < sizeof(std::uintptr_t)
+            ? static_cast<std::uintptr_t>(std::numeric_limits<Offset>::max() & ~Offset(7))
+            : 0;
+
+    template <class Node>
+    class alignas(8) links {
+        static constexpr Offset mask = 7;
+
+    public:
+        Node* left() const noexcept { return decode(left_); }
+        Node* right() const noexcept { return decode(right_); }
+        void set_left(Node* n) noexcept { left_ = encode(n) | (left_ & mask); }
+        void set_right(Node* n) noexcept { right_ = encode(n) | (right_ & mask); }
+        unsigned level() const noexcept {
+            return static_cast<unsigned>((left_ & mask) | (right_ & mask) << 3);
+        }
+        void set_level(unsigned l) noexcept {
+            left_ = static_cast<Offset>((left_ & ~mask) | (l & mask));
+            right_ = static_cast<Offset>((right_ & ~mask) | (l >> 3 & mask));
+        }
+
+    private:
+        std::uintptr_t self() const noexcept {
+            return reinterpret_cast<std::uintptr_t>(static_cast<const Node*>(this));
+        }
+        Node* decode(Offset w) const noexcept {
+            Offset off = static_cast<Offset>(w & ~mask);
+            return off ? reinterpret_cast<Node*>(self() + static_cast<std::uintptr_t>(off))
+                       : nullptr;
+        }
+        Offset encode(Node* n) const noexcept {
+            return n ? static_cast<Offset>(reinterpret_cast<std::uintptr_t>(n) - self()) : 0;
+        }
+
+        Offset left_ = 1;
+        Offset right_ = 0;
+    };
+};
+
+// Self-relative 32-bit links: 8 bytes of links and level per node.
+using compact_links = relative_links<std::int32_t>;
+
+namespace detail {
+
+// Tracks the address range of a tree's nodes for layouts that can only
+// encode bounded distances. Empty, and always admitting, otherwise.
+template <std::uintptr_t MaxSpan>
+class span_tracker {
+public:
+    bool admit(const void* p) noexcept {
+        auto a = reinterpret_cast<std::uintptr_t>(p);
+        std::uintptr_t lo = a < lo_ ? a : lo_;
+        std::uintptr_t hi = a > hi_ ? a : hi_;
+        if (hi - lo > MaxSpan)
+            return false;
+        lo_ = lo;
+        hi_ = hi;
+        return true;
+    }
+    // Widens the range to cover another tree's nodes, if that still fits.
+    bool absorb(const span_tracker& other) noexcept {
+        if (other.lo_ > other.hi_)
+            return true;
+        std::uintptr_t lo = other.lo_ < lo_ ? other.lo_ : lo_;
+        std::uintptr_t hi = other.hi_ > hi_ ? other.hi_ : hi_;
+        if (hi - lo > MaxSpan)
+            return false;
+        lo_ = lo;
+        hi_ = hi;
+        return true;
+    }
+    void reset() noexcept { *this = span_tracker(); }
+
+private:
+    std::uintptr_t lo_ = std::numeric_limits<std::uintptr_t>::max();
+    std::uintptr_t hi_ = 0;
+};
+
+template <>
+class span_tracker<0> {
+public:
+    bool admit(const void*) noexcept { return true; }
+    bool absorb(const span_tracker&) noexcept { return true; }
+    void reset() noexcept {}
+};
+
+} // namespace detail
+
+} // namespace aa
+
+#endif // AA_NODE_LAYOUT_HPP
@@ -0,0 +1,472 @@
+// Persistent (immutable) AA-tree with structural sharing.
+//
+// Every version of a persistent_aa_tree is immutable. insert, erase and
+// insert_or_assign return a new version that copies only the nodes on the
+// search path and the few neighbours skew and split rotate; every other
+// subtree is shared with the original through an intrusive reference
+// count. Copying a version is O(1), so snapshots for MVCC-style readers
+// cost nothing until the next update, and each update allocates
+// O(log N) nodes.
+//
+// Versions may be read, copied and destroyed from any number of threads
+// at once; reference counts are atomic. Values are copied along the path,
+// so value_type must be copy constructible.
+
+#ifndef AA_PERSISTENT_HPP
+#define AA_PERSISTENT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+#include "aa_tree.hpp"
+
+namespace aa {
+
+namespace detail {
+
+// A node shared between versions. Nodes reachable from more than one
+// version are never modified; a node whose count is one belongs to the
+// version being built and is updated in place.
+template <class Value>
+struct shared_node : plain_links::links<shared_node<Value>> {
+    std::atomic<std::size_t> refs{1};
+    union {
+        Value value;
+    };
+
+    shared_node() noexcept {}
+    ~shared_node() {}
+};
+
+} // namespace detail
+
+template <class Key, class T, class Compare = std::less<Key>,
+          class Allocator = std::allocator<std::pair<const Key, T>>>
+class persistent_aa_tree {
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<const Key, T>;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using key_compare = Compare;
+    using allocator_type = Allocator;
+    using const_reference = const value_type&;
+    using const_iterator = tree_iterator<persistent_aa_tree, true>;
+    using iterator = const_iterator;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+    using reverse_iterator = const_reverse_iterator;
+
+private:
+    using node_type = detail::shared_node<value_type>;
+    using alloc_traits = std::allocator_traits<Allocator>;
+    using node_allocator = typename alloc_traits::template rebind_alloc<node_type>;
+    using node_alloc_traits = std::allocator_traits<node_allocator>;
+    using base_type =
+        detail::tree_base<Compare, node_allocator, node_type, detail::span_tracker<0>, no_stats>;
+    friend const_iterator;
+    // Never used, but instantiated by const_iterator's converting
+    // constructor, e.g. inside reverse_iterator::operator->.
+    friend class tree_iterator<persistent_aa_tree, false>;
+    friend struct detail::root_access;
+
+public:
+    persistent_aa_tree() : persistent_aa_tree(Compare()) {}
+
+    explicit persistent_aa_tree(const Compare& comp, const Allocator& alloc = Allocator())
+        : base_(comp, node_allocator(alloc)) {}
+
+    explicit persistent_aa_tree(const Allocator& alloc) : persistent_aa_tree(Compare(), alloc) {}
+
+    template <class InputIt>
+    persistent_aa_tree(InputIt first, InputIt last, const Compare& comp = Compare(),
+                       const Allocator& alloc = Allocator())
+        : persistent_aa_tree(comp, alloc) {
+        for (; first != last; ++first)
+            *this = insert(*first);
+    }
+
+    persistent_aa_tree(std::initializer_list<value_type> init, const Compare& comp = Compare(),
+                       const Allocator& alloc = Allocator())
+        : persistent_aa_tree(init.begin(), init.end(), comp, alloc) {}
+
+    // Shares every node with other: O(1).
+    persistent_aa_tree(const persistent_aa_tree& other)
+        : base_(other.base_.comp(), other.base_.alloc()) {
+        base_.root = retain(other.base_.root);
+        base_.count = other.base_.count;
+    }
+
+    persistent_aa_tree(persistent_aa_tree&& other) noexcept
+        : base_(other.base_.comp(), other.base_.alloc()) {
+        base_.root = std::exchange(other.base_.root, nullptr);
+        base_.count = std::exchange(other.base_.count, 0);
+    }
+
+    ~persistent_aa_tree() { release(base_.root); }
+
+    persistent_aa_tree& operator=(const persistent_aa_tree& other) {
+        persistent_aa_tree(other).swap(*this);
+        return *this;
+    }
+
+    persistent_aa_tree& operator=(persistent_aa_tree&& other) noexcept {
+        persistent_aa_tree(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    allocator_type get_allocator() const { return allocator_type(base_.alloc()); }
+    key_compare key_comp() const { return base_.comp(); }
+
+    const_iterator begin() const noexcept {
+        return make_iter(base_.root ? detail::leftmost(base_.root) : nullptr);
+    }
+    const_iterator end() const noexcept { return make_iter(nullptr); }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+    const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+
+    bool empty() const noexcept { return base_.root == nullptr; }
+    size_type size() const noexcept { return base_.count; }
+
+    // Updates. Each returns the new version and leaves *this unchanged.
+
+    // The version with v added; *this itself if its key is present.
+    [[nodiscard]] persistent_aa_tree insert(const value_type& v) const {
+        if (find_node(v.first))
+            return *this;
+        return derive(insert_node(base_.root, create_node(v)), base_.count + 1);
+    }
+
+    // The version where key maps to obj, whether or not key was present.
+    template <class M>
+    [[nodiscard]] persistent_aa_tree insert_or_assign(const Key& key, M&& obj) const {
+        node_type* z = create_node(std::piecewise_construct, std::forward_as_tuple(key),
+                                   std::forward_as_tuple(std::forward<M>(obj)));
+        if (find_node(key))
+            return derive(replace_node(base_.root, z), base_.count);
+        return derive(insert_node(base_.root, z), base_.count + 1);
+    }
+
+    // The version without key; *this itself if key is absent.
+    [[nodiscard]] persistent_aa_tree erase(const Key& key) const {
+        if (!find_node(key))
+            return *this;
+        return derive(erase_node(base_.root, key), base_.count - 1);
+    }
+
+    void swap(persistent_aa_tree& other) noexcept {
+        using std::swap;
+        swap(base_.comp(), other.base_.comp());
+        if constexpr (node_alloc_traits::propagate_on_container_swap::value)
+            swap(base_.alloc(), other.base_.alloc());
+        swap(base_.root, other.base_.root);
+        swap(base_.count, other.base_.count);
+    }
+
+    friend void swap(persistent_aa_tree& a, persistent_aa_tree& b) noexcept { a.swap(b); }
+
+    // Lookup.
+
+    const T& at(const Key& key) const {
+        node_type* n = find_node(key);
+        if (!n)
+            throw std::out_of_range("persistent_aa_tree::at");
+        return n->value.second;
+    }
+
+    size_type count(const Key& key) const { return find_node(key) ? 1 : 0; }
+    bool contains(const Key& key) const { return find_node(key) != nullptr; }
+    const_iterator find(const Key& key) const { return make_iter(find_node(key)); }
+
+    const_iterator lower_bound(const Key& key) const {
+        node_type* result = nullptr;
+        for (node_type* n = base_.root; n;) {
+            if (!less(n->value.first, key)) {
+                result = n;
+                n = n->left();
+            } else {
+                n = n->right();
+            }
+        }
+        return make_iter(result);
+    }
+
+    const_iterator upper_bound(const Key& key) const {
+        node_type* result = nullptr;
+        for (node_type* n = base_.root; n;) {
+            if (less(key, n->value.first)) {
+                result = n;
+                n = n->left();
+            } else {
+                n = n->right();
+            }
+        }
+        return make_iter(result);
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    // True when both versions are the same tree, e.g. an update that
+    // changed nothing; O(1).
+    bool shares_root(const persistent_aa_tree& other) const noexcept {
+        return base_.root == other.base_.root;
+    }
+
+    friend bool operator==(const persistent_aa_tree& a, const persistent_aa_tree& b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+    }
+    friend bool operator!=(const persistent_aa_tree& a, const persistent_aa_tree& b) {
+        return !(a == b);
+    }
+
+private:
+    // Releases its node on unwinding, so a throwing copy in the middle of
+    // an update frees the partially built path.
+    struct owned {
+        const persistent_aa_tree* tree;
+        node_type* node;
+
+        ~owned() {
+            if (node)
+                tree->release(node);
+        }
+        node_type* take() noexcept { return std::exchange(node, nullptr); }
+    };
+
+    const_iterator make_iter(node_type* n) const noexcept { return const_iterator(n, &base_); }
+    node_type* root_node() const noexcept { return base_.root; }
+
+    bool less(const Key& a, const Key& b) const { return base_.comp()(a, b); }
+
+    node_type* find_node(const Key& key) const {
+        node_type* n = base_.root;
+        while (n) {
+            if (less(key, n->value.first))
+                n = n->left();
+            else if (less(n->value.first, key))
+                n = n->right();
+            else
+                return n;
+        }
+        return nullptr;
+    }
+
+    static unsigned level_of(const node_type* n) noexcept { return n ? n->level() : 0; }
+
+    // Reference counting. Updates build a new version from unshared copies
+    // through const member functions; the allocator is the only state they
+    // touch, hence the casts.
+
+    node_allocator& alloc() const noexcept {
+        return const_cast<base_type&>(base_).alloc();
+    }
+
+    static node_type* retain(node_type* n) noexcept {
+        if (n)
+            n->refs.fetch_add(1, std::memory_order_relaxed);
+        return n;
+    }
+
+    void release(node_type* n) const noexcept {
+        while (n && n->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            release(n->left());
+            node_type* next = n->right();
+            node_alloc_traits::destroy(alloc(), std::addressof(n->value));
+            n->~node_type();
+            node_alloc_traits::deallocate(alloc(), n, 1);
+            n = next;
+        }
+    }
+
+    template <class... Args>
+    node_type* create_node(Args&&... args) const {
+        node_type* n = node_alloc_traits::allocate(alloc(), 1);
+        ::new (static_cast<void*>(n)) node_type();
+        try {
+            node_alloc_traits::construct(alloc(), std::addressof(n->value),
+                                         std::forward<Args>(args)...);
+        } catch (...) {
+            n->~node_type();
+            node_alloc_traits::deallocate(alloc(), n, 1);
+            throw;
+        }
+        return n;
+    }
+
+    // A fresh node with t's value, links and level. The children gain a
+    // reference each.
+    node_type* copy_node(const node_type* t) const {
+        node_type* n = create_node(t->value);
+        n->set_left(retain(t->left()));
+        n->set_right(retain(t->right()));
+        n->set_level(t->level());
+        return n;
+    }
+
+    // Makes the child reference c, held by an unshared parent, safe to
+    // modify: returns c itself if nothing else refers to it, otherwise a
+    // copy that replaces the parent's reference.
+    node_type* own(node_type* c) const {
+        if (c->refs.load(std::memory_order_acquire) == 1)
+            return c;
+        node_type* n = copy_node(c);
+        release(c);
+        return n;
+    }
+
+    // skew and split on an unshared t, owning a rotated child first.
+    node_type* skew(node_type* t) const {
+        if (!needs_skew(t))
+            return t;
+        node_type* l = own(t->left());
+        t->set_left(l->right());
+        l->set_right(t);
+        return l;
+    }
+
+    node_type* split(node_type* t) const {
+        if (!needs_split(t))
+            return t;
+        node_type* r = own(t->right());
+        t->set_right(r->left());
+        r->set_left(t);
+        r->set_level(r->level() + 1);
+        return r;
+    }
+
+    static bool needs_skew(const node_type* t) noexcept {
+        return t && t->left() && t->left()->level() == t->level();
+    }
+
+    static bool needs_split(const node_type* t) noexcept {
+        return t && t->right() && t->right()->right() &&
+               t->right()->right()->level() == t->level();
+    }
+
+    // The subtree t with z added, z's key being absent from t. Copies the
+    // search path; takes ownership of z and returns an owned reference.
+    node_type* insert_node(node_type* t, node_type* z) const {
+        owned guard{this, z};
+        if (!t)
+            return guard.take();
+        owned n{this, copy_node(t)};
+        if (less(z->value.first, t->value.first)) {
+            node_type* l = insert_node(t->left(), guard.take());
+            release(n.node->left());
+            n.node->set_left(l);
+        } else {
+            node_type* r = insert_node(t->right(), guard.take());
+            release(n.node->right());
+            n.node->set_right(r);
+        }
+        return split(skew(n.take()));
+    }
+
+    // The subtree t with z in place of the node with z's key.
+    node_type* replace_node(node_type* t, node_type* z) const {
+        owned guard{this, z};
+        if (!less(z->value.first, t->value.first) && !less(t->value.first, z->value.first)) {
+            z->set_left(retain(t->left()));
+            z->set_right(retain(t->right()));
+            z->set_level(t->level());
+            return guard.take();
+        }
+        owned n{this, copy_node(t)};
+        if (less(z->value.first, t->value.first)) {
+            node_type* l = replace_node(t->left(), guard.take());
+            release(n.node->left());
+            n.node->set_left(l);
+        } else {
+            node_type* r = replace_node(t->right(), guard.take());
+            release(n.node->right());
+            n.node->set_right(r);
+        }
+        return n.take();
+    }
+
+    // The subtree t without key, which must be present. An internal node
+    // is replaced by a copy of its neighbour in key order, which is then
+    // removed from the subtree below.
+    node_type* erase_node(node_type* t, const Key& key) const {
+        owned n{this, nullptr};
+        if (less(key, t->value.first)) {
+            n.node = copy_node(t);
+            node_type* l = erase_node(t->left(), key);
+            release(n.node->left());
+            n.node->set_left(l);
+        } else if (less(t->value.first, key)) {
+            n.node = copy_node(t);
+            node_type* r = erase_node(t->right(), key);
+            release(n.node->right());
+            n.node->set_right(r);
+        } else if (!t->left() && !t->right()) {
+            return nullptr;
+        } else if (!t->left()) {
+            const node_type* s = detail::leftmost(t->right());
+            n.node = create_node(s->value);
+            n.node->set_left(nullptr);
+            n.node->set_right(erase_node(t->right(), s->value.first));
+            n.node->set_level(t->level());
+        } else {
+            const node_type* p = detail::rightmost(t->left());
+            n.node = create_node(p->value);
+            n.node->set_left(erase_node(t->left(), p->value.first));
+            n.node->set_right(retain(t->right()));
+            n.node->set_level(t->level());
+        }
+
+        node_type* r = n.take();
+        unsigned want = std::min(level_of(r->left()), level_of(r->right())) + 1;
+        if (want < r->level()) {
+            r->set_level(want);
+            if (r->right() && want < r->right()->level()) {
+                node_type* c = own(r->right());
+                c->set_level(want);
+                r->set_right(c);
+            }
+        }
+        // The usual three skews and two splits; a shared node is copied
+        // only when a rotation actually reaches it.
+        r = skew(r);
+        if (needs_skew(r->right()))
+            r->set_right(skew(own(r->right())));
+        if (r->right() && needs_skew(r->right()->right())) {
+            node_type* c = own(r->right());
+            r->set_right(c);
+            c->set_right(skew(own(c->right())));
+        }
+        r = split(r);
+        if (needs_split(r->right()))
+            r->set_right(split(own(r->right())));
+        return r;
+    }
+
+    // A version sharing comparator and allocator with *this.
+    persistent_aa_tree derive(node_type* root, size_type count) const {
+        persistent_aa_tree t(base_.comp(), allocator_type(base_.alloc()));
+        t.adopt(root, count);
+        return t;
+    }
+
+    void adopt(node_type* root, size_type count) noexcept {
+        base_.root = root;
+        base_.count = count;
+    }
+
+    base_type base_;
+};
+
+} // namespace aa
+
+#endif // AA_PERSISTENT_HPP
@@ -0,0 +1,169 @@
+// Ordered map with lock-free readers and a single writer.
+//
+// rcu_aa_tree publishes a persistent_aa_tree version through an atomic
+// pointer. Readers pin an epoch, load the current version and search or
+// iterate it without taking a lock or touching a shared counter. The
+// writer derives the next version by path copying, publishes it, and
+// retires the old one; once every reader that might still see it has
+// left, deleting it drops the references that free the nodes the update
+// replaced. Writers are serialized by a mutex that readers never take.
+
+#ifndef AA_RCU_HPP
+#define AA_RCU_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "epoch.hpp"
+#include "persistent.hpp"
+
+namespace aa {
+
+template <class Key, class T, class Compare = std::less<Key>,
+          class Allocator = std::allocator<std::pair<const Key, T>>>
+class rcu_aa_tree {
+public:
+    using version_type = persistent_aa_tree<Key, T, Compare, Allocator>;
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = typename version_type::value_type;
+    using size_type = typename version_type::size_type;
+    using key_compare = Compare;
+    using allocator_type = Allocator;
+
+    // A reader's view: the version current when read() was called, usable
+    // with the whole const interface of persistent_aa_tree. Nothing it
+    // reaches is freed while the guard lives, so guards should be short.
+    class read_guard {
+    public:
+        const version_type& operator*() const noexcept { return *version_; }
+        const version_type* operator->() const noexcept { return version_; }
+
+    private:
+        friend class rcu_aa_tree;
+
+        read_guard(detail::epoch_domain::pin pin, const version_type* version) noexcept
+            : pin_(std::move(pin)), version_(version) {}
+
+        detail::epoch_domain::pin pin_;
+        const version_type* version_;
+    };
+
+    rcu_aa_tree() : rcu_aa_tree(Compare()) {}
+
+    explicit rcu_aa_tree(const Compare& comp, const Allocator& alloc = Allocator())
+        : rcu_aa_tree(version_type(comp, alloc)) {}
+
+    explicit rcu_aa_tree(version_type initial)
+        : current_(new version_type(std::move(initial))) {}
+
+    rcu_aa_tree(const rcu_aa_tree&) = delete;
+    rcu_aa_tree& operator=(const rcu_aa_tree&) = delete;
+
+    // No reader may hold a guard.
+    ~rcu_aa_tree() {
+        retired_.drain();
+        delete current_.load(std::memory_order_relaxed);
+    }
+
+    // Readers. Lock-free; any number of threads.
+
+    read_guard read() const noexcept {
+        detail::epoch_domain::pin pin = epochs_.enter();
+        return read_guard(std::move(pin), current_.load(std::memory_order_seq_cst));
+    }
+
+    // The current version as a value that stays valid without a guard.
+    version_type snapshot() const { return *read(); }
+
+    size_type size() const noexcept { return read()->size(); }
+    bool empty() const noexcept { return read()->empty(); }
+    bool contains(const Key& key) const { return read()->contains(key); }
+
+    // Writers. Each update publishes one new version; readers that already
+    // hold a guard keep seeing the old one.
+
+    bool insert(const value_type& v) {
+        std::lock_guard<std::mutex> lock(writer_);
+        const version_type& cur = latest();
+        if (cur.contains(v.first))
+            return false;
+        publish(cur.insert(v));
+        return true;
+    }
+
+    // Returns true if key was inserted, false if assigned.
+    template <class M>
+    bool insert_or_assign(const Key& key, M&& obj) {
+        std::lock_guard<std::mutex> lock(writer_);
+        const version_type& cur = latest();
+        bool inserted = !cur.contains(key);
+        publish(cur.insert_or_assign(key, std::forward<M>(obj)));
+        return inserted;
+    }
+
+    size_type erase(const Key& key) {
+        std::lock_guard<std::mutex> lock(writer_);
+        const version_type& cur = latest();
+        if (!cur.contains(key))
+            return 0;
+        publish(cur.erase(key));
+        return 1;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(writer_);
+        publish(version_type(latest().key_comp(), latest().get_allocator()));
+    }
+
+    // Publishes f(current), f taking a const version_type& and returning
+    // the next version. Several changes made inside f become visible to
+    // readers together, and only the nodes of the last copy survive.
+    template <class F>
+    void update(F&& f) {
+        std::lock_guard<std::mutex> lock(writer_);
+        publish(std::forward<F>(f)(latest()));
+    }
+
+    // Waits until no reader can see a replaced version and frees them all.
+    void synchronize() {
+        std::lock_guard<std::mutex> lock(writer_);
+        epochs_.synchronize();
+        retired_.collect(epochs_.epoch());
+    }
+
+private:
+    struct version_deleter {
+        void operator()(version_type* v) const noexcept { delete v; }
+    };
+
+    const version_type& latest() const noexcept {
+        return *current_.load(std::memory_order_relaxed);
+    }
+
+    // Swaps in next and retires the version it replaces, tagged with the
+    // epoch of the swap; only the writer advances the epoch, so it cannot
+    // move in between. Then frees whatever no reader can still see.
+    void publish(version_type next) {
+        if (next.shares_root(latest()))
+            return;
+        std::unique_ptr<version_type> v(new version_type(std::move(next)));
+        retired_.retire(current_.load(std::memory_order_relaxed), epochs_.epoch());
+        current_.store(v.release(), std::memory_order_seq_cst);
+        epochs_.try_advance();
+        retired_.collect(epochs_.epoch());
+    }
+
+    std::atomic<version_type*> current_;
+    detail::epoch_domain epochs_;
+    detail::retire_list<version_type, version_deleter> retired_;
+    std::mutex writer_;
+};
+
+} // namespace aa
+
+#endif // AA_RCU_HPP
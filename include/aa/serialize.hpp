@@ -0,0 +1,373 @@
+// Compact binary snapshots of an aa_tree.
+//
+// serialize writes the elements in key order after a small header; with
+// serialize_options::levels each element is preceded by its node level.
+// deserialize replaces a tree's contents in linear time: without levels
+// through the sorted builder, with them by relinking the exact shape that
+// was saved. Either way no comparison-driven insert or rebalancing runs.
+// Input is checked as it is read: keys must increase, saved levels must
+// form a valid AA-tree, and every element the header counts must be there.
+//
+// Keys and values are encoded by serial_traits: trivially copyable types as
+// their bytes, std::basic_string as a 64-bit length and its characters.
+// Specialize serial_traits for other types. Integers are written in the
+// machine's byte order, so snapshots move only between machines that
+// share it.
+//
+// Format: "AAS1", a 32-bit flags word (bit 0: levels present), a 64-bit
+// element count, then per element [level byte] key value.
+
+#ifndef AA_SERIALIZE_HPP
+#define AA_SERIALIZE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "aa_tree.hpp"
+
+namespace aa {
+
+struct serialize_options {
+    // Stores each node's level so that loading restores the same shape.
+    bool levels = false;
+};
+
+// Encodes T for serialize. write(w, v) emits bytes with w.write(p, n);
+// read(r) decodes a T with r.read(p, n), which throws on short input.
+template <class T, class = void>
+struct serial_traits;
+
+template <class T>
+struct serial_traits<T, std::enable_if_t<std::is_trivially_copyable<T>::value>> {
+    template <class Writer>
+    static void write(Writer& w, const T& v) {
+        w.write(&v, sizeof v);
+    }
+    template <class Reader>
+    static T read(Reader& r) {
+        T v;
+        r.read(&v, sizeof v);
+        return v;
+    }
+};
+
+template <class C, class Tr, class A>
+struct serial_traits<std::basic_string<C, Tr, A>> {
+    template <class Writer>
+    static void write(Writer& w, const std::basic_string<C, Tr, A>& s) {
+        std::uint64_t n = s.size();
+        w.write(&n, sizeof n);
+        w.write(s.data(), n * sizeof(C));
+    }
+    template <class Reader>
+    static std::basic_string<C, Tr, A> read(Reader& r) {
+        std::uint64_t n;
+        r.read(&n, sizeof n);
+        if (n > r.remaining() / sizeof(C))
+            throw std::runtime_error("aa::deserialize: string longer than the input");
+        std::basic_string<C, Tr, A> s(static_cast<std::size_t>(n), C());
+        r.read(&s[0], s.size() * sizeof(C));
+        return s;
+    }
+};
+
+namespace detail {
+
+inline constexpr char serial_magic[4] = {'A', 'A', 'S', '1'};
+inline constexpr std::uint32_t serial_levels = 1;
+
+// Byte sinks and sources. The stream writer goes through a 64 KiB buffer
+// so that small fields cost a memcpy, not a stream call. The stream reader
+// takes each field straight from the stream's own buffer instead: reading
+// ahead would consume bytes past the snapshot, and handing them back needs
+// a seek, which pipes and sockets do not support.
+class vector_writer {
+public:
+    explicit vector_writer(std::vector<char>& out) : out_(out) {}
+    void write(const void* p, std::size_t n) {
+        std::size_t at = out_.size();
+        out_.resize(at + n);
+        std::memcpy(out_.data() + at, p, n);
+    }
+    void flush() {}
+
+private:
+    std::vector<char>& out_;
+};
+
+class stream_writer {
+public:
+    explicit stream_writer(std::ostream& os) : os_(os), buf_(new char[chunk]) {}
+    void write(const void* p, std::size_t n) {
+        if (n > chunk - used_) {
+            flush();
+            if (n > chunk) {
+                put(p, n);
+                return;
+            }
+        }
+        std::memcpy(buf_.get() + used_, p, n);
+        used_ += n;
+    }
+    void flush() {
+        put(buf_.get(), used_);
+        used_ = 0;
+    }
+
+private:
+    static constexpr std::size_t chunk = std::size_t(1) << 16;
+
+    void put(const void* p, std::size_t n) {
+        os_.write(static_cast<const char*>(p), static_cast<std::streamsize>(n));
+        if (!os_)
+            throw std::runtime_error("aa::serialize: write failed");
+    }
+
+    std::ostream& os_;
+    std::unique_ptr<char[]> buf_;
+    std::size_t used_ = 0;
+};
+
+class memory_reader {
+public:
+    memory_reader(const char* first, const char* last) : p_(first), end_(last) {}
+    void read(void* dst, std::size_t n) {
+        if (n > remaining())
+            throw std::runtime_error("aa::deserialize: input truncated");
+        std::memcpy(dst, p_, n);
+        p_ += n;
+    }
+    std::size_t remaining() const noexcept { return static_cast<std::size_t>(end_ - p_); }
+    const char* position() const noexcept { return p_; }
+
+private:
+    const char* p_;
+    const char* end_;
+};
+
+class stream_reader {
+public:
+    explicit stream_reader(std::istream& is) : is_(is), buf_(*is.rdbuf()) {}
+    void read(void* dst, std::size_t n) {
+        auto want = static_cast<std::streamsize>(n);
+        if (buf_.sgetn(static_cast<char*>(dst), want) != want) {
+            is_.setstate(std::ios_base::eofbit | std::ios_base::failbit);
+            throw std::runtime_error("aa::deserialize: input truncated");
+        }
+    }
+    // Unknown for a stream; string lengths are then checked only by reading.
+    std::size_t remaining() const noexcept { return static_cast<std::size_t>(-1); }
+
+private:
+    std::istream& is_;
+    std::streambuf& buf_;
+};
+
+// The tree internals serialize needs: node levels and direct building.
+struct serial_access {
+    template <class Tree, class Writer>
+    static void save(const Tree& t, Writer& w, serialize_options opts) {
+        using node_type = typename Tree::node_type;
+        using key_traits = serial_traits<typename Tree::key_type>;
+        using mapped_traits = serial_traits<typename Tree::mapped_type>;
+        std::uint32_t flags = opts.levels ? serial_levels : 0;
+        std::uint64_t count = t.size();
+        w.write(serial_magic, sizeof serial_magic);
+        w.write(&flags, sizeof flags);
+        w.write(&count, sizeof count);
+        typename Tree::path_type stack;
+        for (node_type* n = t.base_.root; n || stack.size;) {
+            for (; n; n = n->left())
+                stack.push(n);
+            n = stack.nodes[--stack.size];
+            if (opts.levels) {
+                auto level = static_cast<std::uint8_t>(n->level());
+                w.write(&level, 1);
+            }
+            key_traits::write(w, n->value.first);
+            mapped_traits::write(w, n->value.second);
+            n = n->right();
+        }
+        w.flush();
+    }
+
+    template <class Tree, class Reader>
+    static void load(Tree& t, Reader& r) {
+        char magic[sizeof serial_magic];
+        std::uint32_t flags;
+        std::uint64_t count;
+        t.clear();
+        r.read(magic, sizeof magic);
+        if (std::memcmp(magic, serial_magic, sizeof magic) != 0)
+            throw std::runtime_error("aa::deserialize: not an aa_tree snapshot");
+        r.read(&flags, sizeof flags);
+        r.read(&count, sizeof count);
+        if (flags & ~serial_levels)
+            throw std::runtime_error("aa::deserialize: unknown flags");
+        auto n = static_cast<typename Tree::size_type>(count);
+        if (flags & serial_levels) {
+            t.base_.root = load_shaped(t, r, n);
+        } else {
+            decoder<Tree, Reader> it(t, r);
+            t.base_.root = t.build_sorted(it, n);
+        }
+        t.base_.count = n;
+        t.rethread();
+    }
+
+private:
+    // Just enough of an input iterator for build_sorted, which reads each
+    // element once and then increments: dereferencing decodes the next
+    // element and checks that its key follows the previous one.
+    template <class Tree, class Reader>
+    class decoder {
+        using key_type = typename Tree::key_type;
+        using mapped_type = typename Tree::mapped_type;
+
+    public:
+        decoder(const Tree& t, Reader& r) : tree_(t), r_(r) {}
+
+        typename Tree::value_type operator*() {
+            key_type k = serial_traits<key_type>::read(r_);
+            if (prev_ && !tree_.less(*prev_, k))
+                throw std::runtime_error("aa::deserialize: keys out of order");
+            prev_ = k;
+            return {std::move(k), serial_traits<mapped_type>::read(r_)};
+        }
+        decoder& operator++() noexcept { return *this; }
+
+    private:
+        const Tree& tree_;
+        Reader& r_;
+        std::optional<key_type> prev_;
+    };
+
+    // Relinks nodes with saved levels into the one AA-tree they describe:
+    // the root of any range is its first node of the highest level, so a
+    // stack holding the right spine builds the tree in one pass, as for a
+    // Cartesian tree. A post-order pass then checks the invariants and
+    // refreshes augmented data.
+    template <class Tree, class Reader>
+    static typename Tree::node_type* load_shaped(Tree& t, Reader& r,
+                                                 typename Tree::size_type n) {
+        using node_type = typename Tree::node_type;
+        using key_type = typename Tree::key_type;
+        using mapped_type = typename Tree::mapped_type;
+        std::vector<node_type*> spine;
+        node_type* root = nullptr;
+        node_type* prev = nullptr;
+        try {
+            for (typename Tree::size_type i = 0; i < n; ++i) {
+                std::uint8_t level;
+                r.read(&level, 1);
+                key_type k = serial_traits<key_type>::read(r);
+                mapped_type v = serial_traits<mapped_type>::read(r);
+                if (prev && !t.less(prev->value.first, k))
+                    throw std::runtime_error("aa::deserialize: keys out of order");
+                if (level == 0)
+                    throw std::runtime_error("aa::deserialize: invalid level");
+                node_type* x = t.create_node(std::move(k), std::move(v));
+                x->set_level(level);
+                node_type* below = nullptr;
+                while (!spine.empty() && spine.back()->level() < x->level()) {
+                    below = spine.back();
+                    spine.pop_back();
+                }
+                x->set_left(below);
+                if (spine.empty())
+                    root = x;
+                else
+                    spine.back()->set_right(x);
+                prev = x;
+                spine.push_back(x);
+            }
+            if (!check_shape<Tree>(root, spine))
+                throw std::runtime_error("aa::deserialize: levels do not form an AA-tree");
+            return root;
+        } catch (...) {
+            // Every node created so far is linked below root.
+            t.destroy(root);
+            throw;
+        }
+    }
+
+    template <class Tree, class Node>
+    static bool check_shape(Node* root, std::vector<Node*>& stack) {
+        auto level = [](const Node* n) { return n ? n->level() : 0u; };
+        Node* last = nullptr;
+        stack.clear();
+        for (Node* n = root; n || !stack.empty();) {
+            if (n) {
+                stack.push_back(n);
+                n = n->left();
+                continue;
+            }
+            Node* top = stack.back();
+            if (top->right() && top->right() != last) {
+                n = top->right();
+                continue;
+            }
+            stack.pop_back();
+            unsigned l = top->level();
+            unsigned rl = level(top->right());
+            if (level(top->left()) + 1 != l || rl + 1 < l || rl > l ||
+                (top->right() && level(top->right()->right()) >= l))
+                return false;
+            Tree::augment::update(top);
+            last = top;
+        }
+        return true;
+    }
+};
+
+} // namespace detail
+
+// Writes t to os. Throws std::runtime_error if the stream fails.
+template <class Key, class T, class Compare, class Allocator, class Traits>
+void serialize(const aa_tree<Key, T, Compare, Allocator, Traits>& t, std::ostream& os,
+               serialize_options opts = {}) {
+    detail::stream_writer w(os);
+    detail::serial_access::save(t, w, opts);
+}
+
+// Appends the snapshot of t to out.
+template <class Key, class T, class Compare, class Allocator, class Traits>
+void serialize(const aa_tree<Key, T, Compare, Allocator, Traits>& t, std::vector<char>& out,
+               serialize_options opts = {}) {
+    detail::vector_writer w(out);
+    detail::serial_access::save(t, w, opts);
+}
+
+// Replaces the contents of t with the snapshot read from is, leaving is
+// just past it. Throws std::runtime_error on malformed input, after which
+// t is empty.
+template <class Key, class T, class Compare, class Allocator, class Traits>
+void deserialize(std::istream& is, aa_tree<Key, T, Compare, Allocator, Traits>& t) {
+    detail::stream_reader r(is);
+    detail::serial_access::load(t, r);
+}
+
+// Replaces the contents of t with the snapshot in [first, last). Returns
+// the end of the bytes consumed.
+template <class Key, class T, class Compare, class Allocator, class Traits>
+const char* deserialize(const char* first, const char* last,
+                        aa_tree<Key, T, Compare, Allocator, Traits>& t) {
+    detail::memory_reader r(first, last);
+    detail::serial_access::load(t, r);
+    return r.position();
+}
+
+} // namespace aa
+
+#endif // AA_SERIALIZE_HPP
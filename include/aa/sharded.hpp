@@ -0,0 +1,474 @@
+// Range-partitioned map of AA-trees.
+//
+// sharded_aa_map splits the key space at Shards - 1 splitter keys and
+// keeps one aa_tree per range, so a batch can be routed to its shards and
+// the shards updated in parallel, one task each. Splitters are sampled
+// from the data: from the first batch loaded into an empty map, or on
+// request from a sample or the current contents, in which case existing
+// elements are moved with join and split_off in O(Shards log N).
+// Iteration and range queries walk the shards in order, so the map still
+// reads as one ordered container.
+
+#ifndef AA_SHARDED_HPP
+#define AA_SHARDED_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "aa_tree.hpp"
+
+namespace aa {
+
+template <class Key, class T, std::size_t Shards, class Compare = std::less<Key>,
+          class Allocator = std::allocator<std::pair<const Key, T>>,
+          class Traits = default_tree_traits>
+class sharded_aa_map {
+    static_assert(Shards > 0, "sharded_aa_map needs at least one shard");
+
+public:
+    using shard_type = aa_tree<Key, T, Compare, Allocator, Traits>;
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<const Key, T>;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using key_compare = Compare;
+    using allocator_type = Allocator;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+
+    // Iterates the shards in order, skipping empty ones; end() is the end
+    // of the last shard.
+    template <bool Const>
+    class basic_iterator {
+        using map_type = std::conditional_t<Const, const sharded_aa_map, sharded_aa_map>;
+        using shard_iterator = std::conditional_t<Const, typename shard_type::const_iterator,
+                                                  typename shard_type::iterator>;
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = sharded_aa_map::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Const, const value_type*, value_type*>;
+        using reference = std::conditional_t<Const, const value_type&, value_type&>;
+
+        basic_iterator() = default;
+
+        template <bool C = Const, class = std::enable_if_t<C>>
+        basic_iterator(const basic_iterator<false>& other) noexcept
+            : map_(other.map_), shard_(other.shard_), it_(other.it_) {}
+
+        reference operator*() const { return *it_; }
+        pointer operator->() const { return std::addressof(*it_); }
+
+        basic_iterator& operator++() {
+            ++it_;
+            skip_empty();
+            return *this;
+        }
+        basic_iterator operator++(int) {
+            basic_iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        basic_iterator& operator--() {
+            while (it_ == map_->shards_[shard_].begin())
+                it_ = map_->shards_[--shard_].end();
+            --it_;
+            return *this;
+        }
+        basic_iterator operator--(int) {
+            basic_iterator old = *this;
+            --*this;
+            return old;
+        }
+
+        friend bool operator==(const basic_iterator& a, const basic_iterator& b) {
+            return a.shard_ == b.shard_ && a.it_ == b.it_;
+        }
+        friend bool operator!=(const basic_iterator& a, const basic_iterator& b) {
+            return !(a == b);
+        }
+
+    private:
+        friend sharded_aa_map;
+        friend class basic_iterator<!Const>;
+
+        basic_iterator(map_type* map, std::size_t shard, shard_iterator it)
+            : map_(map), shard_(shard), it_(it) {
+            skip_empty();
+        }
+
+        void skip_empty() {
+            while (shard_ + 1 < Shards && it_ == map_->shards_[shard_].end())
+                it_ = map_->shards_[++shard_].begin();
+        }
+
+        map_type* map_ = nullptr;
+        std::size_t shard_ = 0;
+        shard_iterator it_;
+    };
+
+    using iterator = basic_iterator<false>;
+    using const_iterator = basic_iterator<true>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    // Elements sampled per shard when choosing splitters.
+    static constexpr size_type sample_per_shard = 64;
+
+    sharded_aa_map() : sharded_aa_map(Compare()) {}
+
+    // Every shard is built from one allocator object, so split_off and
+    // join relink nodes between them. Batches allocate from several
+    // threads at once; arena_allocator needs arena_options::thread_cache.
+    explicit sharded_aa_map(const Compare& comp, const Allocator& alloc = Allocator())
+        : shards_(make_shards(comp, alloc, std::make_index_sequence<Shards>())), comp_(comp) {}
+
+    template <class ForwardIt>
+    sharded_aa_map(ForwardIt first, ForwardIt last, const Compare& comp = Compare(),
+                   const Allocator& alloc = Allocator())
+        : sharded_aa_map(comp, alloc) {
+        insert_batch(first, last);
+    }
+
+    allocator_type get_allocator() const { return shards_[0].get_allocator(); }
+    key_compare key_comp() const { return comp_; }
+
+    // Iterators.
+
+    iterator begin() noexcept { return iterator(this, 0, shards_[0].begin()); }
+    const_iterator begin() const noexcept { return const_iterator(this, 0, shards_[0].begin()); }
+    iterator end() noexcept { return iterator(this, Shards - 1, shards_[Shards - 1].end()); }
+    const_iterator end() const noexcept {
+        return const_iterator(this, Shards - 1, shards_[Shards - 1].end());
+    }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+    reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+    reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+
+    // Capacity.
+
+    bool empty() const noexcept {
+        return std::all_of(shards_.begin(), shards_.end(),
+                           [](const shard_type& s) { return s.empty(); });
+    }
+
+    size_type size() const noexcept {
+        size_type n = 0;
+        for (const shard_type& s : shards_)
+            n += s.size();
+        return n;
+    }
+
+    // Shards.
+
+    // The splitters in increasing order: shard i holds the keys k with
+    // splitters()[i - 1] <= k < splitters()[i]. Fewer than Shards - 1 when
+    // the data had fewer distinct keys; the shards past the last then stay
+    // empty. Empty until splitters are first chosen, so everything goes to
+    // shard 0.
+    const std::vector<Key>& splitters() const noexcept { return splitters_; }
+
+    size_type shard_of(const Key& key) const {
+        return static_cast<size_type>(
+            std::upper_bound(splitters_.begin(), splitters_.end(), key, comp_) -
+            splitters_.begin());
+    }
+
+    const shard_type& shard(size_type i) const { return shards_[i]; }
+
+    // Chooses splitters at evenly spaced quantiles of the keys in
+    // [first, last), a sample of the expected data, and moves the existing
+    // elements to their new shards.
+    template <class ForwardIt>
+    void resplit(ForwardIt first, ForwardIt last) {
+        std::vector<Key> keys;
+        for (; first != last; ++first)
+            keys.push_back(key_of(*first));
+        std::sort(keys.begin(), keys.end(), comp_);
+        keys.erase(std::unique(keys.begin(), keys.end(),
+                               [this](const Key& a, const Key& b) { return !comp_(a, b); }),
+                   keys.end());
+        std::vector<Key> splitters;
+        for (size_type i = 1; i < Shards && !keys.empty(); ++i) {
+            const Key& k = keys[i * keys.size() / Shards];
+            if (splitters.empty() || comp_(splitters.back(), k))
+                splitters.push_back(k);
+        }
+        redistribute(std::move(splitters));
+    }
+
+    // Rebalances the shards to equal sizes, splitting at the current
+    // contents' quantiles. With an order_statistics augment each sampled
+    // element is found with select(), O(Shards * sample_per_shard * log N);
+    // otherwise the shards are walked in O(N). Moving the elements then
+    // costs O(Shards log N).
+    void resplit() {
+        size_type stride = std::max<size_type>(size() / (Shards * sample_per_shard), 1);
+        std::vector<Key> sample;
+        // Position of the next element overall, counted across shards.
+        size_type i = 0;
+        for (const shard_type& s : shards_) {
+            if constexpr (Traits::augment::tracks_size) {
+                for (size_type j = (stride - i % stride) % stride; j < s.size(); j += stride)
+                    sample.push_back(s.select(j)->first);
+                i += s.size();
+            } else {
+                s.for_each([&](const value_type& v) {
+                    if (i++ % stride == 0)
+                        sample.push_back(v.first);
+                });
+            }
+        }
+        resplit(sample.begin(), sample.end());
+    }
+
+    // Modifiers. Single-element updates touch one shard; batches are routed
+    // and applied to all affected shards in parallel.
+
+    std::pair<iterator, bool> insert(const value_type& v) {
+        size_type s = shard_of(v.first);
+        auto r = shards_[s].insert(v);
+        return {make_iter(s, r.first), r.second};
+    }
+
+    std::pair<iterator, bool> insert(value_type&& v) {
+        size_type s = shard_of(v.first);
+        auto r = shards_[s].insert(std::move(v));
+        return {make_iter(s, r.first), r.second};
+    }
+
+    template <class P, class = std::enable_if_t<std::is_constructible<value_type, P&&>::value>>
+    std::pair<iterator, bool> insert(P&& v) {
+        value_type value(std::forward<P>(v));
+        size_type s = shard_of(value.first);
+        auto r = shards_[s].insert(std::move(value));
+        return {make_iter(s, r.first), r.second};
+    }
+
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(const Key& key, M&& obj) {
+        size_type s = shard_of(key);
+        auto r = shards_[s].insert_or_assign(key, std::forward<M>(obj));
+        return {make_iter(s, r.first), r.second};
+    }
+
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args) {
+        size_type s = shard_of(key);
+        auto r = shards_[s].try_emplace(key, std::forward<Args>(args)...);
+        return {make_iter(s, r.first), r.second};
+    }
+
+    T& operator[](const Key& key) { return try_emplace(key).first->second; }
+
+    size_type erase(const Key& key) { return shards_[shard_of(key)].erase(key); }
+
+    iterator erase(const_iterator pos) {
+        auto next = shards_[pos.shard_].erase(pos.it_);
+        return make_iter(pos.shard_, next);
+    }
+
+    void clear() noexcept {
+        for (shard_type& s : shards_)
+            s.clear();
+    }
+
+    // Inserts every element of [first, last) whose key is not yet present,
+    // through each shard's insert_batch. Loading an empty map without
+    // splitters first samples the batch to choose them. Returns the number
+    // of elements inserted.
+    template <class ForwardIt>
+    size_type insert_batch(ForwardIt first, ForwardIt last) {
+        if (splitters_.empty() && Shards > 1 && empty())
+            resplit_from_batch(first, last);
+        std::array<std::vector<value_type>, Shards> routed;
+        for (ForwardIt it = first; it != last; ++it)
+            routed[shard_of((*it).first)].push_back(*it);
+        std::array<size_type, Shards> inserted{};
+        for_each_busy(routed, [&](size_type s) {
+            inserted[s] = shards_[s].insert_batch(std::make_move_iterator(routed[s].begin()),
+                                                  std::make_move_iterator(routed[s].end()));
+        });
+        size_type total = 0;
+        for (size_type n : inserted)
+            total += n;
+        return total;
+    }
+
+    // Erases every key of [first, last) that is present, through each
+    // shard's erase_batch. Returns the number erased.
+    template <class ForwardIt>
+    size_type erase_batch(ForwardIt first, ForwardIt last) {
+        std::array<std::vector<Key>, Shards> routed;
+        for (ForwardIt it = first; it != last; ++it)
+            routed[shard_of(*it)].push_back(*it);
+        std::array<size_type, Shards> erased{};
+        for_each_busy(routed, [&](size_type s) {
+            erased[s] = shards_[s].erase_batch(routed[s].begin(), routed[s].end());
+        });
+        size_type total = 0;
+        for (size_type n : erased)
+            total += n;
+        return total;
+    }
+
+    void swap(sharded_aa_map& other) noexcept {
+        using std::swap;
+        swap(shards_, other.shards_);
+        swap(splitters_, other.splitters_);
+        swap(comp_, other.comp_);
+    }
+
+    friend void swap(sharded_aa_map& a, sharded_aa_map& b) noexcept { a.swap(b); }
+
+    // Lookup.
+
+    T& at(const Key& key) { return shards_[shard_of(key)].at(key); }
+    const T& at(const Key& key) const { return shards_[shard_of(key)].at(key); }
+
+    size_type count(const Key& key) const { return shards_[shard_of(key)].count(key); }
+    bool contains(const Key& key) const { return shards_[shard_of(key)].contains(key); }
+
+    iterator find(const Key& key) {
+        size_type s = shard_of(key);
+        auto it = shards_[s].find(key);
+        return it == shards_[s].end() ? end() : make_iter(s, it);
+    }
+    const_iterator find(const Key& key) const {
+        size_type s = shard_of(key);
+        auto it = shards_[s].find(key);
+        return it == shards_[s].end() ? end() : make_iter(s, it);
+    }
+
+    // Bounds land in the key's shard and roll over into the next non-empty
+    // one when they fall off its end.
+    iterator lower_bound(const Key& key) {
+        size_type s = shard_of(key);
+        return make_iter(s, shards_[s].lower_bound(key));
+    }
+    const_iterator lower_bound(const Key& key) const {
+        size_type s = shard_of(key);
+        return make_iter(s, shards_[s].lower_bound(key));
+    }
+    iterator upper_bound(const Key& key) {
+        size_type s = shard_of(key);
+        return make_iter(s, shards_[s].upper_bound(key));
+    }
+    const_iterator upper_bound(const Key& key) const {
+        size_type s = shard_of(key);
+        return make_iter(s, shards_[s].upper_bound(key));
+    }
+
+    std::pair<iterator, iterator> equal_range(const Key& key) {
+        return {lower_bound(key), upper_bound(key)};
+    }
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const {
+        return {lower_bound(key), upper_bound(key)};
+    }
+
+    friend bool operator==(const sharded_aa_map& a, const sharded_aa_map& b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+    }
+    friend bool operator!=(const sharded_aa_map& a, const sharded_aa_map& b) { return !(a == b); }
+
+private:
+    template <std::size_t... I>
+    static std::array<shard_type, Shards> make_shards(const Compare& comp, const Allocator& alloc,
+                                                      std::index_sequence<I...>) {
+        return {{(static_cast<void>(I), shard_type(comp, alloc))...}};
+    }
+
+    static const Key& key_of(const Key& k) noexcept { return k; }
+    template <class V>
+    static const Key& key_of(const V& v) noexcept {
+        return v.first;
+    }
+
+    iterator make_iter(size_type s, typename shard_type::iterator it) {
+        return iterator(this, s, it);
+    }
+    const_iterator make_iter(size_type s, typename shard_type::const_iterator it) const {
+        return const_iterator(this, s, it);
+    }
+
+    template <class ForwardIt>
+    void resplit_from_batch(ForwardIt first, ForwardIt last) {
+        size_type n = static_cast<size_type>(std::distance(first, last));
+        size_type stride = std::max<size_type>(n / (Shards * sample_per_shard), 1);
+        std::vector<Key> sample;
+        for (size_type i = 0; first != last; ++first, ++i)
+            if (i % stride == 0)
+                sample.push_back((*first).first);
+        resplit(sample.begin(), sample.end());
+    }
+
+    // Joins every shard into one tree and splits it again at splitters,
+    // relinking nodes rather than copying them.
+    void redistribute(std::vector<Key> splitters) {
+        shard_type all = std::move(shards_[0]);
+        for (size_type s = 1; s < Shards; ++s)
+            all = shard_type::join(std::move(all), std::move(shards_[s]));
+        for (size_type s = splitters.size(); s > 0; --s)
+            shards_[s] = all.split_off(splitters[s - 1]);
+        shards_[0] = std::move(all);
+        splitters_ = std::move(splitters);
+    }
+
+    // Runs work(s) for every shard with a non-empty batch, each on its own
+    // thread except the last, which runs on the caller's. Waits for all of
+    // them before rethrowing the first exception.
+    template <class Batch, class Work>
+    static void for_each_busy(const std::array<Batch, Shards>& routed, Work work) {
+        std::vector<std::future<void>> tasks;
+        size_type last = Shards;
+        for (size_type s = 0; s < Shards; ++s) {
+            if (routed[s].empty())
+                continue;
+            if (last != Shards)
+                tasks.push_back(std::async(std::launch::async, work, last));
+            last = s;
+        }
+        std::exception_ptr error;
+        if (last != Shards) {
+            try {
+                work(last);
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+        for (std::future<void>& t : tasks) {
+            try {
+                t.get();
+            } catch (...) {
+                if (!error)
+                    error = std::current_exception();
+            }
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    std::array<shard_type, Shards> shards_;
+    std::vector<Key> splitters_;
+    Compare comp_;
+};
+
+} // namespace aa
+
+#endif // AA_SHARDED_HPP
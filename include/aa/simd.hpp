@@ -0,0 +1,203 @@
+// Vectorised rank-in-block kernels for frozen_map.
+//
+// A frozen_map node holds 64 bytes of keys. For 32- and 64-bit integer,
+// float and double keys ordered by std::less, the number of keys below the
+// search key in one node is computed with two vector compares and a
+// popcount instead of a compare per key. The instruction set is chosen once at run time:
+// AVX2, then SSE4.2, then plain scalar code. Defining AA_NO_SIMD disables
+// the kernels entirely.
+
+#ifndef AA_SIMD_HPP
+#define AA_SIMD_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+#if !defined(AA_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define AA_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace aa {
+namespace detail {
+
+enum class simd_level { scalar, sse42, avx2 };
+
+// The best kernel set this CPU runs, detected on first use.
+inline simd_level simd_support() noexcept {
+#ifdef AA_SIMD_X86
+    static const simd_level level = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return simd_level::avx2;
+        if (__builtin_cpu_supports("sse4.2"))
+            return simd_level::sse42;
+        return simd_level::scalar;
+    }();
+    return level;
+#else
+    return simd_level::scalar;
+#endif
+}
+
+template <class Key>
+struct simd_key
+    : std::integral_constant<bool, std::is_same<Key, std::int32_t>::value ||
+                                       std::is_same<Key, std::uint32_t>::value ||
+                                       std::is_same<Key, std::int64_t>::value ||
+                                       std::is_same<Key, std::uint64_t>::value ||
+                                       std::is_same<Key, float>::value ||
+                                       std::is_same<Key, double>::value> {};
+
+// The 32- and 64-bit integer keys, which share kernels.
+template <class Key, std::size_t Bytes>
+using simd_int = std::enable_if_t<std::is_integral<Key>::value && sizeof(Key) == Bytes,
+                                  std::size_t>;
+
+// Whether a node of Width keys ordered by Compare can use the kernels,
+// which always cover exactly one 64-byte node.
+template <class Key, class Compare, std::size_t Width>
+struct simd_block
+    : std::integral_constant<bool,
+#ifdef AA_SIMD_X86
+                             simd_key<Key>::value && Width * sizeof(Key) == 64 &&
+                                 (std::is_same<Compare, std::less<Key>>::value ||
+                                  std::is_same<Compare, std::less<>>::value)
+#else
+                             false
+#endif
+                             > {
+};
+
+#ifdef AA_SIMD_X86
+
+// Each kernel returns the number of the node's keys that are below x
+// (strictly, or also equal when OrEqual). Unsigned compares flip the sign
+// bit first, since SSE and AVX2 only compare signed integers.
+
+template <bool OrEqual, class Key>
+__attribute__((target("avx2,popcnt"))) inline simd_int<Key, 4> rank_avx2(const Key* keys,
+                                                                         Key x) noexcept {
+    const __m256i sign = _mm256_set1_epi32(std::is_signed<Key>::value ? 0 : INT32_MIN);
+    const __m256i v = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(x)), sign);
+    __m256i a = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys)), sign);
+    __m256i b =
+        _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + 8)), sign);
+    // OrEqual counts keys not above x; otherwise keys below x.
+    __m256i ma = OrEqual ? _mm256_cmpgt_epi32(a, v) : _mm256_cmpgt_epi32(v, a);
+    __m256i mb = OrEqual ? _mm256_cmpgt_epi32(b, v) : _mm256_cmpgt_epi32(v, b);
+    auto bits = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(ma))) |
+                static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(mb))) << 8;
+    auto n = static_cast<std::size_t>(__builtin_popcount(bits));
+    return OrEqual ? 16 - n : n;
+}
+
+template <bool OrEqual, class Key>
+__attribute__((target("avx2,popcnt"))) inline simd_int<Key, 8> rank_avx2(const Key* keys,
+                                                                         Key x) noexcept {
+    const __m256i sign = _mm256_set1_epi64x(std::is_signed<Key>::value ? 0 : INT64_MIN);
+    const __m256i v = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<long long>(x)), sign);
+    __m256i a = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys)), sign);
+    __m256i b =
+        _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + 4)), sign);
+    __m256i ma = OrEqual ? _mm256_cmpgt_epi64(a, v) : _mm256_cmpgt_epi64(v, a);
+    __m256i mb = OrEqual ? _mm256_cmpgt_epi64(b, v) : _mm256_cmpgt_epi64(v, b);
+    auto bits = static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(ma))) |
+                static_cast<unsigned>(_mm256_movemask_pd(_mm256_castsi256_pd(mb))) << 4;
+    auto n = static_cast<std::size_t>(__builtin_popcount(bits));
+    return OrEqual ? 8 - n : n;
+}
+
+template <bool OrEqual>
+__attribute__((target("avx2,popcnt"))) inline std::size_t rank_avx2(const float* keys,
+                                                                   float x) noexcept {
+    const __m256 v = _mm256_set1_ps(x);
+    __m256 a = _mm256_loadu_ps(keys);
+    __m256 b = _mm256_loadu_ps(keys + 8);
+    __m256 ma = OrEqual ? _mm256_cmp_ps(a, v, _CMP_LE_OQ) : _mm256_cmp_ps(a, v, _CMP_LT_OQ);
+    __m256 mb = OrEqual ? _mm256_cmp_ps(b, v, _CMP_LE_OQ) : _mm256_cmp_ps(b, v, _CMP_LT_OQ);
+    auto bits = static_cast<unsigned>(_mm256_movemask_ps(ma)) |
+                static_cast<unsigned>(_mm256_movemask_ps(mb)) << 8;
+    return static_cast<std::size_t>(__builtin_popcount(bits));
+}
+
+template <bool OrEqual>
+__attribute__((target("avx2,popcnt"))) inline std::size_t rank_avx2(const double* keys,
+                                                                   double x) noexcept {
+    const __m256d v = _mm256_set1_pd(x);
+    __m256d a = _mm256_loadu_pd(keys);
+    __m256d b = _mm256_loadu_pd(keys + 4);
+    __m256d ma = OrEqual ? _mm256_cmp_pd(a, v, _CMP_LE_OQ) : _mm256_cmp_pd(a, v, _CMP_LT_OQ);
+    __m256d mb = OrEqual ? _mm256_cmp_pd(b, v, _CMP_LE_OQ) : _mm256_cmp_pd(b, v, _CMP_LT_OQ);
+    auto bits = static_cast<unsigned>(_mm256_movemask_pd(ma)) |
+                static_cast<unsigned>(_mm256_movemask_pd(mb)) << 4;
+    return static_cast<std::size_t>(__builtin_popcount(bits));
+}
+
+template <bool OrEqual, class Key>
+__attribute__((target("sse4.2,popcnt"))) inline simd_int<Key, 4> rank_sse42(const Key* keys,
+                                                                            Key x) noexcept {
+    const __m128i sign = _mm_set1_epi32(std::is_signed<Key>::value ? 0 : INT32_MIN);
+    const __m128i v = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(x)), sign);
+    unsigned bits = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i k = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + 4 * i)),
+                                  sign);
+        __m128i m = OrEqual ? _mm_cmpgt_epi32(k, v) : _mm_cmpgt_epi32(v, k);
+        bits |= static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(m))) << (4 * i);
+    }
+    auto n = static_cast<std::size_t>(__builtin_popcount(bits));
+    return OrEqual ? 16 - n : n;
+}
+
+template <bool OrEqual, class Key>
+__attribute__((target("sse4.2,popcnt"))) inline simd_int<Key, 8> rank_sse42(const Key* keys,
+                                                                            Key x) noexcept {
+    const __m128i sign = _mm_set1_epi64x(std::is_signed<Key>::value ? 0 : INT64_MIN);
+    const __m128i v = _mm_xor_si128(_mm_set1_epi64x(static_cast<long long>(x)), sign);
+    unsigned bits = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i k = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + 2 * i)),
+                                  sign);
+        __m128i m = OrEqual ? _mm_cmpgt_epi64(k, v) : _mm_cmpgt_epi64(v, k);
+        bits |= static_cast<unsigned>(_mm_movemask_pd(_mm_castsi128_pd(m))) << (2 * i);
+    }
+    auto n = static_cast<std::size_t>(__builtin_popcount(bits));
+    return OrEqual ? 8 - n : n;
+}
+
+template <bool OrEqual>
+__attribute__((target("sse4.2,popcnt"))) inline std::size_t rank_sse42(const float* keys,
+                                                                      float x) noexcept {
+    const __m128 v = _mm_set1_ps(x);
+    unsigned bits = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128 k = _mm_loadu_ps(keys + 4 * i);
+        __m128 m = OrEqual ? _mm_cmple_ps(k, v) : _mm_cmplt_ps(k, v);
+        bits |= static_cast<unsigned>(_mm_movemask_ps(m)) << (4 * i);
+    }
+    return static_cast<std::size_t>(__builtin_popcount(bits));
+}
+
+template <bool OrEqual>
+__attribute__((target("sse4.2,popcnt"))) inline std::size_t rank_sse42(const double* keys,
+                                                                      double x) noexcept {
+    const __m128d v = _mm_set1_pd(x);
+    unsigned bits = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128d k = _mm_loadu_pd(keys + 2 * i);
+        __m128d m = OrEqual ? _mm_cmple_pd(k, v) : _mm_cmplt_pd(k, v);
+        bits |= static_cast<unsigned>(_mm_movemask_pd(m)) << (2 * i);
+    }
+    return static_cast<std::size_t>(__builtin_popcount(bits));
+}
+
+#endif // AA_SIMD_X86
+
+} // namespace detail
+} // namespace aa
+
+#endif // AA_SIMD_HPP
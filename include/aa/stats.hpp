@@ -0,0 +1,138 @@
+// Instrumentation policies for aa_tree.
+//
+// The traits' stats member receives a callback for every skew and split
+// (and whether it rotated), every level decrement during erase, and the
+// number of nodes visited by each search. With the default no_stats every
+// hook is an empty inline function and the tree compiles to the same code
+// as without instrumentation. A policy provides
+//
+//     static constexpr bool enabled;
+//     void on_skew(bool rotated) const noexcept;
+//     void on_split(bool rotated) const noexcept;
+//     void on_level_decrement() const noexcept;
+//     void on_path(std::size_t nodes) const noexcept;
+//     void reset() noexcept;
+//
+// The tree derives from the policy, so an empty one takes no space. Hooks
+// are const because lookups report their paths too.
+
+#ifndef AA_STATS_HPP
+#define AA_STATS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace aa {
+
+struct no_stats {
+    static constexpr bool enabled = false;
+
+    void on_skew(bool) const noexcept {}
+    void on_split(bool) const noexcept {}
+    void on_level_decrement() const noexcept {}
+    void on_path(std::size_t) const noexcept {}
+    void reset() noexcept {}
+};
+
+// Counts rebalancing work and search path lengths per tree. Counters are
+// relaxed atomics, so lookups from several threads and the parallel set
+// operations record safely; each hook costs one uncontended atomic add.
+// Copying a tree_stats takes a snapshot. Counters belong to the tree
+// object: they are not copied, moved or swapped along with its elements.
+class tree_stats {
+public:
+    static constexpr bool enabled = true;
+    // Path lengths 0 .. max, where no AA-tree is taller than max.
+    static constexpr std::size_t histogram_size = 2 * std::numeric_limits<std::size_t>::digits + 1;
+
+    tree_stats() noexcept = default;
+    tree_stats(const tree_stats& other) noexcept { *this = other; }
+
+    tree_stats& operator=(const tree_stats& other) noexcept {
+        copy(skews_, other.skews_);
+        copy(splits_, other.splits_);
+        copy(skew_rotations_, other.skew_rotations_);
+        copy(split_rotations_, other.split_rotations_);
+        copy(level_decrements_, other.level_decrements_);
+        copy(searches_, other.searches_);
+        copy(path_nodes_, other.path_nodes_);
+        for (std::size_t i = 0; i < histogram_size; ++i)
+            copy(histogram_[i], other.histogram_[i]);
+        return *this;
+    }
+
+    // skew and split calls, whether or not they changed anything.
+    std::uint64_t skews() const noexcept { return load(skews_); }
+    std::uint64_t splits() const noexcept { return load(splits_); }
+
+    // Calls that actually rotated.
+    std::uint64_t skew_rotations() const noexcept { return load(skew_rotations_); }
+    std::uint64_t split_rotations() const noexcept { return load(split_rotations_); }
+    std::uint64_t rotations() const noexcept { return skew_rotations() + split_rotations(); }
+
+    // Nodes lowered by one or more levels while erasing.
+    std::uint64_t level_decrements() const noexcept { return load(level_decrements_); }
+
+    // Root-to-leaf searches made by lookups, inserts and erases, and the
+    // nodes they visited in total.
+    std::uint64_t searches() const noexcept { return load(searches_); }
+    std::uint64_t path_nodes() const noexcept { return load(path_nodes_); }
+
+    double mean_path_length() const noexcept {
+        std::uint64_t s = searches();
+        return s ? static_cast<double>(path_nodes()) / static_cast<double>(s) : 0.0;
+    }
+
+    // Searches that visited exactly nodes nodes.
+    std::uint64_t path_histogram(std::size_t nodes) const noexcept {
+        return nodes < histogram_size ? load(histogram_[nodes]) : 0;
+    }
+
+    void reset() noexcept { *this = tree_stats(); }
+
+    void on_skew(bool rotated) const noexcept {
+        bump(skews_);
+        if (rotated)
+            bump(skew_rotations_);
+    }
+
+    void on_split(bool rotated) const noexcept {
+        bump(splits_);
+        if (rotated)
+            bump(split_rotations_);
+    }
+
+    void on_level_decrement() const noexcept { bump(level_decrements_); }
+
+    void on_path(std::size_t nodes) const noexcept {
+        bump(searches_);
+        path_nodes_.fetch_add(nodes, std::memory_order_relaxed);
+        bump(histogram_[nodes < histogram_size ? nodes : histogram_size - 1]);
+    }
+
+private:
+    using counter = std::atomic<std::uint64_t>;
+
+    static std::uint64_t load(const counter& c) noexcept {
+        return c.load(std::memory_order_relaxed);
+    }
+    static void bump(counter& c) noexcept { c.fetch_add(1, std::memory_order_relaxed); }
+    static void copy(counter& to, const counter& from) noexcept {
+        to.store(load(from), std::memory_order_relaxed);
+    }
+
+    mutable counter skews_{0};
+    mutable counter splits_{0};
+    mutable counter skew_rotations_{0};
+    mutable counter split_rotations_{0};
+    mutable counter level_decrements_{0};
+    mutable counter searches_{0};
+    mutable counter path_nodes_{0};
+    mutable counter histogram_[histogram_size] = {};
+};
+
+} // namespace aa
+
+#endif // AA_STATS_HPP
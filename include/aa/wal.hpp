@@ -0,0 +1,445 @@
+// AA-tree made durable by a write-ahead log and periodic snapshots.
+//
+// durable_aa_tree keeps an aa_tree in memory and a directory on disk
+// holding a snapshot of the tree and the log of updates made since. Each
+// update is applied to the tree and appended to an in-memory log buffer
+// under a sequence number (LSN). commit(lsn) makes everything up to lsn
+// durable: the first committer writes the whole buffer with one write and
+// one fdatasync while later committers wait, so concurrent updates share
+// a single flush (group commit).
+//
+// checkpoint() writes a fresh snapshot, tagged with the last LSN it
+// contains and checksummed like the log records, renames it over the old
+// one and empties the log, so restart time stays bounded by the snapshot
+// load plus a short replay. commit() takes a checkpoint itself once the
+// log grows past durable_options::checkpoint_bytes; since the records are
+// already durable by then, a failure there does not fail the commit but
+// is kept for checkpoint_error(). Recovery loads the snapshot, rejecting
+// one that fails its checksum, replays the log records with a higher LSN,
+// and cuts the log after the last intact record; a torn tail from a crash
+// during a write is dropped along with the uncommitted updates in it.
+//
+// Snapshots use the format of serialize.hpp, so keys and values need
+// serial_traits. POSIX only; one process at a time may open a directory.
+
+#ifndef AA_WAL_HPP
+#define AA_WAL_HPP
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "aa_tree.hpp"
+#include "checksum.hpp"
+#include "serialize.hpp"
+
+namespace aa {
+
+struct durable_options {
+    // Log size that makes commit() take a checkpoint; 0 leaves checkpoints
+    // to the caller. After a failed one, commit() tries again once the log
+    // has grown by as much again.
+    std::size_t checkpoint_bytes = std::size_t(64) << 20;
+};
+
+namespace detail {
+
+[[noreturn]] inline void throw_errno(const char* what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+// A file descriptor closed on destruction.
+class unique_fd {
+public:
+    explicit unique_fd(int fd = -1) noexcept : fd_(fd) {}
+    unique_fd(const unique_fd&) = delete;
+    unique_fd& operator=(const unique_fd&) = delete;
+    ~unique_fd() { reset(); }
+    int get() const noexcept { return fd_; }
+    void reset(int fd = -1) noexcept {
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = fd;
+    }
+
+private:
+    int fd_;
+};
+
+inline void write_all(int fd, const char* p, std::size_t n) {
+    while (n) {
+        ssize_t k = ::write(fd, p, n);
+        if (k < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("durable_aa_tree: write");
+        }
+        p += k;
+        n -= static_cast<std::size_t>(k);
+    }
+}
+
+inline void sync_path(const std::string& path, int flags) {
+    unique_fd fd(::open(path.c_str(), flags | O_CLOEXEC));
+    if (fd.get() < 0 || ::fsync(fd.get()) != 0)
+        throw_errno("durable_aa_tree: fsync");
+}
+
+} // namespace detail
+
+template <class Key, class T, class Compare = std::less<Key>,
+          class Allocator = std::allocator<std::pair<const Key, T>>,
+          class Traits = default_tree_traits>
+class durable_aa_tree {
+public:
+    using tree_type = aa_tree<Key, T, Compare, Allocator, Traits>;
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = typename tree_type::value_type;
+    using size_type = typename tree_type::size_type;
+    using lsn_type = std::uint64_t;
+
+    // Opens dir, creating it if needed, and recovers the tree from the
+    // snapshot and log found there.
+    explicit durable_aa_tree(std::string dir, durable_options opts = {},
+                             const Compare& comp = Compare(), const Allocator& alloc = Allocator())
+        : dir_(std::move(dir)), opts_(opts), tree_(comp, alloc) {
+        if (::mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST)
+            detail::throw_errno("durable_aa_tree: mkdir");
+        recover();
+    }
+
+    durable_aa_tree(const durable_aa_tree&) = delete;
+    durable_aa_tree& operator=(const durable_aa_tree&) = delete;
+
+    // Commits whatever is still buffered; errors are swallowed, so call
+    // commit() first to see them.
+    ~durable_aa_tree() {
+        try {
+            commit();
+        } catch (...) {
+        }
+    }
+
+    // Updates. Each returns the LSN to pass to commit(); one that changes
+    // nothing is not logged and returns the last LSN issued. The record is
+    // encoded before the tree changes, so an update that throws leaves
+    // neither the tree nor the log changed.
+
+    lsn_type insert_or_assign(const Key& key, const T& obj) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::size_t at = append(op_assign, key, &obj);
+        try {
+            tree_.insert_or_assign(key, obj);
+        } catch (...) {
+            pending_.resize(at);
+            throw;
+        }
+        return ++last_;
+    }
+
+    lsn_type erase(const Key& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!tree_.contains(key))
+            return last_;
+        std::size_t at = append(op_erase, key, nullptr);
+        try {
+            tree_.erase(key);
+        } catch (...) {
+            pending_.resize(at);
+            throw;
+        }
+        return ++last_;
+    }
+
+    // Blocks until every update up to lsn is on disk. Whichever waiting
+    // thread finds no flush in progress writes the buffer for all of them.
+    // Throws std::invalid_argument for an LSN that was never issued, and
+    // otherwise only if the updates could not be made durable; a failed
+    // automatic checkpoint is left to checkpoint_error().
+    void commit(lsn_type lsn) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (lsn > last_)
+            throw std::invalid_argument("durable_aa_tree: commit of an LSN not yet issued");
+        while (durable_ < lsn) {
+            if (flushing_) {
+                flushed_.wait(lock);
+                continue;
+            }
+            flush(lock);
+        }
+        if (opts_.checkpoint_bytes && log_bytes_ >= checkpoint_at_) {
+            try {
+                checkpoint(lock);
+            } catch (...) {
+                checkpoint_error_ = std::current_exception();
+                checkpoint_at_ = log_bytes_ + opts_.checkpoint_bytes;
+            }
+        }
+    }
+    void commit() { commit(last_lsn()); }
+
+    // Writes a snapshot of the current tree and empties the log. Updates
+    // wait while the snapshot is written. Throws if it fails, leaving the
+    // previous snapshot and the log in place.
+    void checkpoint() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        checkpoint(lock);
+    }
+
+    // The error of the last checkpoint commit() took, if it failed; null
+    // once a later checkpoint succeeds.
+    std::exception_ptr checkpoint_error() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return checkpoint_error_;
+    }
+
+    // Reads. f receives the tree as const tree_type& while updates wait.
+    template <class F>
+    decltype(auto) read(F&& f) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::forward<F>(f)(static_cast<const tree_type&>(tree_));
+    }
+
+    std::optional<T> get(const Key& key) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = tree_.find(key);
+        return it == tree_.end() ? std::nullopt : std::optional<T>(it->second);
+    }
+    bool contains(const Key& key) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return tree_.contains(key);
+    }
+    size_type size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return tree_.size();
+    }
+
+    lsn_type last_lsn() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return last_;
+    }
+    lsn_type durable_lsn() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return durable_;
+    }
+
+private:
+    // Log record: u32 body size, u64 checksum of the body, then the body:
+    // u64 LSN, u8 operation, key, and for assignments the value.
+    enum op : std::uint8_t { op_assign = 1, op_erase = 2 };
+    static constexpr std::size_t record_head = 12;
+    // Snapshot: magic, u64 LSN, u64 size of the tree's snapshot, u64
+    // checksum of it seeded with the LSN, then the tree's snapshot.
+    static constexpr char snapshot_magic[8] = {'A', 'A', 'W', 'A', 'L', 'S', 'N', '2'};
+    static constexpr std::size_t snapshot_head = 32;
+
+    std::string path(const char* name) const { return dir_ + "/" + name; }
+
+    // Buffers the record for the next LSN and returns where it starts, so
+    // that the caller can drop it again. Leaves the buffer as it was if
+    // encoding throws.
+    std::size_t append(op o, const Key& key, const T* obj) {
+        std::size_t at = pending_.size();
+        try {
+            pending_.resize(at + record_head);
+            detail::vector_writer w(pending_);
+            lsn_type lsn = last_ + 1;
+            auto code = static_cast<std::uint8_t>(o);
+            w.write(&lsn, sizeof lsn);
+            w.write(&code, 1);
+            serial_traits<Key>::write(w, key);
+            if (obj)
+                serial_traits<T>::write(w, *obj);
+        } catch (...) {
+            pending_.resize(at);
+            throw;
+        }
+        auto body = static_cast<std::uint32_t>(pending_.size() - at - record_head);
+        std::uint64_t sum = detail::checksum(pending_.data() + at + record_head, body);
+        std::memcpy(pending_.data() + at, &body, 4);
+        std::memcpy(pending_.data() + at + 4, &sum, 8);
+        return at;
+    }
+
+    // Writes the buffered records with the lock released, so updates can
+    // keep appending to the next group meanwhile.
+    void flush(std::unique_lock<std::mutex>& lock) {
+        std::vector<char> batch;
+        batch.swap(pending_);
+        lsn_type upto = last_;
+        flushing_ = true;
+        lock.unlock();
+        try {
+            detail::write_all(log_.get(), batch.data(), batch.size());
+            if (::fdatasync(log_.get()) != 0)
+                detail::throw_errno("durable_aa_tree: fdatasync");
+        } catch (...) {
+            lock.lock();
+            // Cut off whatever part of the batch was written, so a retry
+            // does not leave it torn in the middle of the log.
+            if (::ftruncate(log_.get(), static_cast<off_t>(log_bytes_)) != 0) {
+                // Recovery still stops at the torn record.
+            }
+            batch.insert(batch.end(), pending_.begin(), pending_.end());
+            pending_.swap(batch);
+            flushing_ = false;
+            flushed_.notify_all();
+            throw;
+        }
+        lock.lock();
+        log_bytes_ += batch.size();
+        durable_ = upto;
+        flushing_ = false;
+        flushed_.notify_all();
+    }
+
+    // Snapshot first, made visible by an atomic rename; the log is emptied
+    // only afterwards, so a crash in between replays nothing twice: every
+    // record left has an LSN the snapshot already covers.
+    void checkpoint(std::unique_lock<std::mutex>& lock) {
+        while (flushing_)
+            flushed_.wait(lock);
+        std::string tmp = path("snapshot.tmp");
+        {
+            std::vector<char> snap(snapshot_head);
+            serialize(tree_, snap);
+            std::uint64_t size = snap.size() - snapshot_head;
+            std::uint64_t sum = detail::checksum(snap.data() + snapshot_head, size, last_);
+            std::memcpy(snap.data(), snapshot_magic, 8);
+            std::memcpy(snap.data() + 8, &last_, 8);
+            std::memcpy(snap.data() + 16, &size, 8);
+            std::memcpy(snap.data() + 24, &sum, 8);
+            detail::unique_fd fd(
+                ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+            if (fd.get() < 0)
+                detail::throw_errno("durable_aa_tree: open snapshot.tmp");
+            detail::write_all(fd.get(), snap.data(), snap.size());
+            if (::fsync(fd.get()) != 0)
+                detail::throw_errno("durable_aa_tree: fsync");
+        }
+        if (::rename(tmp.c_str(), path("snapshot").c_str()) != 0)
+            detail::throw_errno("durable_aa_tree: rename");
+        detail::sync_path(dir_, O_RDONLY | O_DIRECTORY);
+        if (::ftruncate(log_.get(), 0) != 0 || ::fdatasync(log_.get()) != 0)
+            detail::throw_errno("durable_aa_tree: truncate log");
+        pending_.clear();
+        log_bytes_ = 0;
+        durable_ = last_;
+        checkpoint_at_ = opts_.checkpoint_bytes;
+        checkpoint_error_ = nullptr;
+        flushed_.notify_all();
+    }
+
+    void recover() {
+        lsn_type base = 0;
+        std::string snap_path = path("snapshot");
+        std::vector<char> snap = read_file(snap_path);
+        if (!snap.empty()) {
+            std::uint64_t size = 0, sum = 0;
+            if (snap.size() >= snapshot_head) {
+                std::memcpy(&base, snap.data() + 8, 8);
+                std::memcpy(&size, snap.data() + 16, 8);
+                std::memcpy(&sum, snap.data() + 24, 8);
+            }
+            if (snap.size() < snapshot_head ||
+                std::memcmp(snap.data(), snapshot_magic, sizeof snapshot_magic) != 0)
+                throw std::runtime_error("durable_aa_tree: " + snap_path + " is not a snapshot");
+            const char* first = snap.data() + snapshot_head;
+            if (size != snap.size() - snapshot_head || detail::checksum(first, size, base) != sum)
+                throw std::runtime_error("durable_aa_tree: " + snap_path + " is corrupted");
+            if (deserialize(first, first + size, tree_) != first + size)
+                throw std::runtime_error("durable_aa_tree: " + snap_path + " is corrupted");
+        }
+        last_ = base;
+
+        std::string log_path = path("log");
+        std::vector<char> log = read_file(log_path);
+        std::size_t good = replay(log, base);
+        log_.reset(::open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644));
+        if (log_.get() < 0)
+            detail::throw_errno("durable_aa_tree: open log");
+        if (good != log.size() && ::ftruncate(log_.get(), static_cast<off_t>(good)) != 0)
+            detail::throw_errno("durable_aa_tree: truncate log");
+        detail::sync_path(dir_, O_RDONLY | O_DIRECTORY);
+        log_bytes_ = good;
+        durable_ = last_;
+    }
+
+    // The contents of a file, empty if it does not exist.
+    static std::vector<char> read_file(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::vector<char>(std::istreambuf_iterator<char>(in),
+                                 std::istreambuf_iterator<char>());
+    }
+
+    // Applies the intact records after base and returns the length of the
+    // intact prefix.
+    std::size_t replay(const std::vector<char>& log, lsn_type base) {
+        std::size_t at = 0;
+        while (log.size() - at >= record_head) {
+            std::uint32_t body;
+            std::uint64_t sum;
+            std::memcpy(&body, log.data() + at, 4);
+            std::memcpy(&sum, log.data() + at + 4, 8);
+            const char* p = log.data() + at + record_head;
+            if (body > log.size() - at - record_head || detail::checksum(p, body) != sum)
+                break;
+            detail::memory_reader r(p, p + body);
+            lsn_type lsn;
+            std::uint8_t code;
+            r.read(&lsn, sizeof lsn);
+            r.read(&code, 1);
+            if (code != op_assign && code != op_erase)
+                break;
+            if (lsn > base) {
+                Key key = serial_traits<Key>::read(r);
+                if (code == op_assign)
+                    tree_.insert_or_assign(std::move(key), serial_traits<T>::read(r));
+                else
+                    tree_.erase(key);
+                last_ = lsn;
+            }
+            at += record_head + body;
+        }
+        return at;
+    }
+
+    std::string dir_;
+    durable_options opts_;
+    mutable std::mutex mutex_;
+    std::condition_variable flushed_;
+    tree_type tree_;
+    detail::unique_fd log_;
+    std::vector<char> pending_;
+    std::size_t log_bytes_ = 0;
+    // Log size at which commit() next takes a checkpoint.
+    std::size_t checkpoint_at_ = opts_.checkpoint_bytes;
+    std::exception_ptr checkpoint_error_;
+    lsn_type last_ = 0;
+    lsn_type durable_ = 0;
+    bool flushing_ = false;
+};
+
+} // namespace aa
+
+#endif // AA_WAL_HPP
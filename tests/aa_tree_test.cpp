@@ -0,0 +1,287 @@
+// aa_tree against std::map: random operation sequences are applied to both
+// and every result, and the contents after each step, must agree. Runs
+// over each node layout, threaded nodes, prefetching searches, the default
+// and the arena allocator, and a key type that owns memory.
+
+#include <aa/aa_tree.hpp>
+#include <aa/arena.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+
+namespace {
+
+using aa_test::aa_invariants;
+using aa_test::rng;
+using aa_test::same_contents;
+using aa_test::same_position;
+
+struct packed_traits : aa::default_tree_traits {
+    using layout = aa::packed_links;
+};
+
+struct compact_traits : aa::default_tree_traits {
+    using layout = aa::compact_links;
+};
+
+struct threaded_traits : aa::default_tree_traits {
+    static constexpr bool threaded = true;
+};
+
+struct prefetch_traits : aa::default_tree_traits {
+    static constexpr bool prefetch = true;
+};
+
+struct compact_prefetch_traits : compact_traits {
+    static constexpr bool prefetch = true;
+};
+
+template <class K>
+K key_of(int x);
+
+template <>
+int key_of<int>(int x) {
+    return x;
+}
+
+template <>
+std::string key_of<std::string>(int x) {
+    // Past the small-string buffer, so that leaks show up under ASan.
+    return "key-" + std::string(20, 'x') + std::to_string(1000000 + x);
+}
+
+template <class Tree>
+void random_ops(std::uint64_t seed, int ops, int keys) {
+    using K = typename Tree::key_type;
+    Tree t;
+    std::map<K, int> m;
+    rng r(seed);
+    for (int i = 0; i < ops; ++i) {
+        K k = key_of<K>(r.below(keys));
+        int v = r.below(1000);
+        switch (r.below(17)) {
+        case 0: {
+            auto a = t.insert({k, v});
+            auto b = m.insert({k, v});
+            CHECK(a.second == b.second && same_position(a.first, t, b.first, m));
+            break;
+        }
+        case 1: {
+            auto a = t.emplace(k, v);
+            auto b = m.emplace(k, v);
+            CHECK(a.second == b.second && same_position(a.first, t, b.first, m));
+            break;
+        }
+        case 2: {
+            auto a = t.try_emplace(k, v);
+            auto b = m.try_emplace(k, v);
+            CHECK(a.second == b.second && same_position(a.first, t, b.first, m));
+            break;
+        }
+        case 3: {
+            auto a = t.insert_or_assign(k, v);
+            auto b = m.insert_or_assign(k, v);
+            CHECK(a.second == b.second && same_position(a.first, t, b.first, m));
+            break;
+        }
+        case 4:
+            t[k] += v;
+            m[k] += v;
+            break;
+        case 5:
+        case 6:
+            CHECK(t.erase(k) == m.erase(k));
+            break;
+        case 7: {
+            auto a = t.find(k);
+            auto b = m.find(k);
+            CHECK(same_position(a, t, b, m));
+            if (b != m.end())
+                CHECK(same_position(t.erase(a), t, m.erase(b), m));
+            break;
+        }
+        case 8: {
+            K hi = key_of<K>(r.below(keys));
+            auto a = t.erase(t.lower_bound(k), t.lower_bound(std::max(k, hi)));
+            auto b = m.erase(m.lower_bound(k), m.lower_bound(std::max(k, hi)));
+            CHECK(same_position(a, t, b, m));
+            break;
+        }
+        case 9:
+            CHECK(same_position(t.lower_bound(k), t, m.lower_bound(k), m));
+            CHECK(same_position(t.upper_bound(k), t, m.upper_bound(k), m));
+            break;
+        case 10: {
+            auto a = t.equal_range(k);
+            auto b = m.equal_range(k);
+            CHECK(same_position(a.first, t, b.first, m));
+            CHECK(same_position(a.second, t, b.second, m));
+            CHECK(t.count(k) == m.count(k) && t.contains(k) == (m.count(k) != 0));
+            break;
+        }
+        case 11: {
+            bool threw = false;
+            try {
+                CHECK(t.at(k) == m.at(k));
+            } catch (const std::out_of_range&) {
+                threw = true;
+            }
+            CHECK(threw == (m.count(k) == 0));
+            break;
+        }
+        case 12: {
+            // Walk a few steps both ways from a random position.
+            auto a = t.lower_bound(k);
+            auto b = m.lower_bound(k);
+            for (int s = 0; s < 4 && b != m.end(); ++s, ++a, ++b)
+                CHECK(same_position(a, t, b, m));
+            for (int s = 0; s < 4 && b != m.begin(); ++s) {
+                --a;
+                --b;
+                CHECK(same_position(a, t, b, m));
+            }
+            break;
+        }
+        case 13: {
+            std::vector<std::pair<K, int>> batch;
+            for (int n = r.below(i % 100 ? 8 : keys); n > 0; --n)
+                batch.emplace_back(key_of<K>(r.below(keys)), v);
+            std::size_t before = m.size();
+            m.insert(batch.begin(), batch.end());
+            CHECK(t.insert_batch(batch.begin(), batch.end()) == m.size() - before);
+            break;
+        }
+        case 14: {
+            std::vector<K> batch;
+            for (int n = r.below(i % 100 ? 8 : keys); n > 0; --n)
+                batch.push_back(key_of<K>(r.below(keys)));
+            std::size_t before = m.size();
+            for (const K& b : batch)
+                m.erase(b);
+            CHECK(t.erase_batch(batch.begin(), batch.end()) == before - m.size());
+            break;
+        }
+        case 15: {
+            // One full set of lanes, or a few rounds with a partial one.
+            std::vector<K> batch;
+            for (int n = i % 2 ? 16 : 37; n > 0; --n)
+                batch.push_back(key_of<K>(r.below(keys + keys / 4)));
+            std::vector<typename Tree::iterator> found;
+            t.find_batch(batch.begin(), batch.end(), std::back_inserter(found));
+            CHECK(found.size() == batch.size());
+            for (std::size_t j = 0; j < batch.size() && j < found.size(); ++j)
+                CHECK(found[j] == t.find(batch[j]) &&
+                      same_position(found[j], t, m.find(batch[j]), m));
+            break;
+        }
+        case 16: {
+            // Both kinds of batch, for batch sizes that divide the range
+            // evenly, leave a remainder or exceed it.
+            K hi = key_of<K>(r.below(keys + 2));
+            const std::size_t sizes[] = {1, 7, 64};
+            std::size_t size = sizes[r.below(3)];
+            std::vector<std::pair<K, int>> expect(m.lower_bound(k),
+                                                  k < hi ? m.lower_bound(hi) : m.lower_bound(k));
+            std::vector<std::pair<K, int>> got;
+            auto cursor = t.scan(k, hi, size);
+            for (;;) {
+                std::size_t before = got.size();
+                if (got.size() % 2) {
+                    const auto& batch = cursor.next();
+                    for (const auto* e : batch)
+                        got.emplace_back(*e);
+                } else {
+                    cursor.next(std::back_inserter(got));
+                }
+                std::size_t n = got.size() - before;
+                CHECK(n <= size && (n == size || cursor.done()));
+                if (n == 0)
+                    break;
+            }
+            CHECK(cursor.done() && got == expect);
+            break;
+        }
+        }
+        if (i % 64 == 0)
+            CHECK(same_contents(t, m) && aa_invariants(t));
+    }
+    CHECK(same_contents(t, m) && aa_invariants(t));
+
+    // A sorted build of the same contents.
+    std::vector<std::pair<K, int>> sorted(m.begin(), m.end());
+    Tree built;
+    built.build_from_sorted(sorted.begin(), sorted.end());
+    CHECK(same_contents(built, m) && aa_invariants(built));
+
+    // Whole-container operations on the final state.
+    const Tree& ct = t;
+    CHECK(same_contents(ct, m) && aa_invariants(ct));
+    std::vector<std::pair<K, int>> visited;
+    ct.for_each([&](const auto& e) { visited.emplace_back(e.first, e.second); });
+    CHECK(visited == sorted);
+    t.for_each([](auto& e) { e.second += 1; });
+    for (auto& e : m)
+        e.second += 1;
+    CHECK(same_contents(ct, m));
+    Tree copy(t);
+    CHECK(same_contents(copy, m) && aa_invariants(copy) && copy == t && !(copy != t) && !(copy < t));
+    Tree moved(std::move(copy));
+    CHECK(same_contents(moved, m) && aa_invariants(moved) && copy.empty());
+    Tree assigned;
+    assigned = t;
+    CHECK(same_contents(assigned, m) && aa_invariants(assigned));
+    assigned = std::move(moved);
+    CHECK(same_contents(assigned, m));
+    Tree other;
+    other.emplace(key_of<K>(keys), 1);
+    swap(other, assigned);
+    CHECK(same_contents(other, m) && aa_invariants(other) && assigned.size() == 1);
+    t.clear();
+    CHECK(t.empty() && t.size() == 0 && t.begin() == t.end());
+}
+
+template <class Tree>
+void initializer_lists() {
+    Tree t{{3, 30}, {1, 10}, {2, 20}, {1, 99}};
+    std::map<int, int> m{{3, 30}, {1, 10}, {2, 20}, {1, 99}};
+    CHECK(same_contents(t, m) && aa_invariants(t));
+    t = {{5, 50}};
+    t.insert({{4, 40}, {5, 0}});
+    CHECK(same_contents(t, std::map<int, int>{{4, 40}, {5, 50}}) && aa_invariants(t));
+    std::vector<std::pair<int, int>> v{{7, 1}, {6, 2}, {7, 3}};
+    Tree r(v.begin(), v.end());
+    CHECK(same_contents(r, std::map<int, int>(v.begin(), v.end())) && aa_invariants(r));
+}
+
+template <class Tree>
+void run_all(std::uint64_t seed) {
+    random_ops<Tree>(seed, 20000, 50);
+    random_ops<Tree>(seed + 1, 50000, 5000);
+}
+
+} // namespace
+
+int main() {
+    using pair_alloc = std::allocator<std::pair<const int, int>>;
+    using arena_alloc = aa::arena_allocator<std::pair<const int, int>>;
+    run_all<aa::aa_tree<int, int>>(1);
+    run_all<aa::aa_tree<int, int, std::less<int>, pair_alloc, packed_traits>>(2);
+    run_all<aa::aa_tree<int, int, std::less<int>, arena_alloc>>(3);
+    run_all<aa::aa_tree<int, int, std::less<int>, arena_alloc, compact_traits>>(4);
+    run_all<aa::aa_tree<int, int, std::less<int>, arena_alloc, threaded_traits>>(5);
+    run_all<aa::aa_tree<std::string, int>>(6);
+    run_all<aa::aa_tree<int, int, std::less<int>, pair_alloc, prefetch_traits>>(7);
+    run_all<aa::aa_tree<int, int, std::less<int>, arena_alloc, compact_prefetch_traits>>(8);
+    run_all<aa::aa_tree<std::string, int, std::less<std::string>,
+                        std::allocator<std::pair<const std::string, int>>, prefetch_traits>>(9);
+    initializer_lists<aa::aa_tree<int, int>>();
+    return aa_test::status();
+}
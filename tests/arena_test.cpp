@@ -0,0 +1,202 @@
+// slab_arena and arena_allocator on their own and under aa_tree: live()
+// must count the blocks handed out after every step. Freed blocks are
+// reused before the arena grows. clear() releases the slabs only when the
+// tree owns every live block, so after split_off the first tree cleared
+// leaves them in place and the second gives them back. With thread caches
+// the count stays right when nodes are freed on other threads, and blocks
+// cached before a release are dropped, not handed out again.
+
+#include <aa/aa_tree.hpp>
+#include <aa/arena.hpp>
+
+#include <cstddef>
+#include <future>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+
+namespace {
+
+using aa_test::aa_invariants;
+using aa_test::rng;
+using aa_test::same_contents;
+
+using arena = aa::arena_allocator<std::pair<const int, int>>;
+using tree = aa::aa_tree<int, int, std::less<int>, arena>;
+using string_arena = aa::arena_allocator<std::pair<const int, std::string>>;
+using string_tree = aa::aa_tree<int, std::string, std::less<int>, string_arena>;
+
+aa::arena_options cached() {
+    aa::arena_options opts;
+    opts.thread_cache = true;
+    return opts;
+}
+
+std::size_t slabs(const tree& t) {
+    aa::slab_arena* a = t.get_allocator().arena();
+    return a ? a->slab_count() : 0;
+}
+
+void fill(tree& t, std::map<int, int>& m, int first, int last) {
+    for (int i = first; i < last; ++i) {
+        t.emplace(i, i);
+        m.emplace(i, i);
+    }
+}
+
+// The arena by itself: a freed block is the next one handed out, and
+// release() returns every slab.
+void freelist() {
+    aa::arena_options opts;
+    opts.slab_bytes = 4096;
+    aa::slab_arena a(24, 8, opts);
+    std::vector<void*> blocks;
+    for (int i = 0; i < 1000; ++i)
+        blocks.push_back(a.allocate());
+    std::size_t grown = a.slab_count();
+    CHECK(a.live() == 1000 && grown > 1);
+    for (int i = 0; i < 1000; i += 2)
+        a.deallocate(blocks[static_cast<std::size_t>(i)]);
+    CHECK(a.live() == 500);
+    std::set<void*> freed;
+    for (int i = 0; i < 1000; i += 2)
+        freed.insert(blocks[static_cast<std::size_t>(i)]);
+    bool reused = true;
+    for (int i = 0; i < 500; ++i)
+        reused &= freed.count(a.allocate()) == 1;
+    CHECK(reused && a.live() == 1000 && a.slab_count() == grown);
+    a.release();
+    CHECK(a.live() == 0 && a.slab_count() == 0);
+    a.allocate();
+    CHECK(a.live() == 1 && a.slab_count() == 1);
+}
+
+// A tree that owns its arena: erased nodes are reused, and clear() gives
+// the slabs back whether or not the values need destroying.
+void owned(aa::arena_options opts) {
+    tree t(arena{opts});
+    std::map<int, int> m;
+    CHECK(t.get_allocator().live() == 0 && slabs(t) == 0);
+    fill(t, m, 0, 20000);
+    std::size_t grown = slabs(t);
+    CHECK(t.get_allocator().live() == t.size() && grown > 0);
+    rng r(31);
+    for (int i = 0; i < 20000; ++i) {
+        int k = r.below(20000);
+        CHECK(t.erase(k) == m.erase(k));
+    }
+    CHECK(t.get_allocator().live() == t.size());
+    fill(t, m, 0, 20000);
+    CHECK(same_contents(t, m) && t.get_allocator().live() == t.size() && slabs(t) == grown);
+
+    t.clear();
+    CHECK(t.empty() && t.get_allocator().live() == 0 && slabs(t) == 0);
+    m.clear();
+    fill(t, m, 100, 600);
+    CHECK(same_contents(t, m) && aa_invariants(t) && t.get_allocator().live() == 500);
+
+    string_tree s(string_arena{opts});
+    for (int i = 0; i < 5000; ++i)
+        s.emplace(i, std::string(40, static_cast<char>('a' + i % 26)));
+    s.clear();
+    CHECK(s.get_allocator().live() == 0 && s.get_allocator().arena()->slab_count() == 0);
+}
+
+// After split_off both halves draw on one arena. Neither owns every live
+// block, so clearing one frees its nodes one by one; the other, now the
+// only user, releases the slabs when it is cleared.
+void shared_split(aa::arena_options opts) {
+    tree t(arena{opts});
+    std::map<int, int> m;
+    fill(t, m, 0, 10000);
+    tree right = t.split_off(4000);
+    CHECK(t.get_allocator() == right.get_allocator());
+    CHECK(t.size() == 4000 && right.size() == 6000);
+    CHECK(t.get_allocator().live() == t.size() + right.size());
+    std::size_t grown = slabs(t);
+
+    right.clear();
+    CHECK(right.empty() && t.get_allocator().live() == 4000 && slabs(t) == grown);
+    std::map<int, int> left(m.begin(), m.find(4000));
+    CHECK(same_contents(t, left) && aa_invariants(t));
+
+    // Nodes inserted through either tree count towards the shared arena.
+    right.emplace(20000, 1);
+    CHECK(t.get_allocator().live() == 4001 && slabs(t) == grown);
+    t.clear();
+    CHECK(t.get_allocator().live() == 1 && slabs(t) == grown);
+    right.clear();
+    CHECK(right.get_allocator().live() == 0 && slabs(right) == 0);
+}
+
+// Nodes freed on other threads go to those threads' caches; live() must
+// still match, and blocks a thread cached before the arena was released
+// must not come back, neither from its cache nor from its exit flush.
+void cross_thread() {
+    tree t(arena{cached()});
+    std::map<int, int> m;
+    fill(t, m, 0, 10000);
+
+    std::thread eraser([&] {
+        for (int i = 0; i < 10000; i += 3)
+            t.erase(i);
+    });
+    eraser.join();
+    for (int i = 0; i < 10000; i += 3)
+        m.erase(i);
+    CHECK(same_contents(t, m) && t.get_allocator().live() == t.size());
+
+    // A thread that frees nodes and keeps its cache across the release.
+    std::promise<void> erased, cleared;
+    std::future<void> erased_done = erased.get_future();
+    std::shared_future<void> cleared_done = cleared.get_future().share();
+    std::thread holder([&] {
+        for (int i = 1; i < 10000; i += 3)
+            t.erase(i);
+        erased.set_value();
+        cleared_done.wait();
+    });
+    erased_done.wait();
+    for (int i = 1; i < 10000; i += 3)
+        m.erase(i);
+    CHECK(same_contents(t, m) && t.get_allocator().live() == t.size());
+
+    // The main thread's cache holds blocks too when the tree is cleared.
+    for (int i = 2; i < 1000; i += 3) {
+        t.erase(i);
+        m.erase(i);
+    }
+    t.clear();
+    m.clear();
+    CHECK(t.get_allocator().live() == 0 && slabs(t) == 0);
+    cleared.set_value();
+    holder.join();
+
+    // Everything allocated from here on comes from fresh slabs.
+    fill(t, m, 0, 5000);
+    std::thread inserter([&] {
+        for (int i = 5000; i < 10000; ++i)
+            t.emplace(i, i);
+    });
+    inserter.join();
+    for (int i = 5000; i < 10000; ++i)
+        m.emplace(i, i);
+    CHECK(same_contents(t, m) && aa_invariants(t) && t.get_allocator().live() == t.size());
+}
+
+} // namespace
+
+int main() {
+    freelist();
+    owned({});
+    owned(cached());
+    shared_split({});
+    shared_split(cached());
+    cross_thread();
+    return aa_test::status();
+}
@@ -0,0 +1,180 @@
+// Augmented trees against std::map: after random inserts, erases, batches,
+// splits and joins, rank, select and count_range must match positions in
+// the map, and range aggregates must match folds over it.
+
+#include <aa/aa_tree.hpp>
+#include <aa/augment.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+
+namespace {
+
+using aa_test::aa_invariants;
+using aa_test::rng;
+using aa_test::same_contents;
+
+struct ranked_traits : aa::default_tree_traits {
+    using augment = aa::order_statistics;
+};
+
+using ranked_tree = aa::aa_tree<int, int, std::less<int>,
+                                std::allocator<std::pair<const int, int>>, ranked_traits>;
+
+// A polynomial hash of the key sequence: associative but not commutative,
+// so a fold that visits keys out of order gives a different result.
+struct sequence_monoid {
+    struct type {
+        std::uint64_t hash;
+        std::uint64_t power;
+        bool operator==(const type& o) const { return hash == o.hash && power == o.power; }
+    };
+    static constexpr std::uint64_t base = 1000003;
+    static type identity() noexcept { return {0, 1}; }
+    static type combine(const type& a, const type& b) noexcept {
+        return {a.hash * b.power + b.hash, a.power * b.power};
+    }
+    template <class Value>
+    static type lift(const Value& v) noexcept {
+        return {static_cast<std::uint64_t>(v.first) + 1, base};
+    }
+};
+
+// The stock monoids promise not to throw for arithmetic types, as
+// monoid_augment requires.
+using int_pair = std::pair<const int, int>;
+static_assert(noexcept(aa::sum_monoid<long>::combine(1, 2)) &&
+                  noexcept(aa::min_monoid<double>::identity()) &&
+                  noexcept(aa::max_monoid<int>::lift(std::declval<const int_pair&>())) &&
+                  noexcept(aa::or_monoid<unsigned>::combine(1, 2)),
+              "stock monoids must be noexcept");
+
+struct folded_traits : aa::default_tree_traits {
+    using augment = aa::augments<aa::order_statistics, aa::monoid_augment<sequence_monoid>>;
+};
+
+struct sum_traits : aa::default_tree_traits {
+    using augment = aa::monoid_augment<aa::sum_monoid<long>>;
+};
+
+struct min_traits : aa::default_tree_traits {
+    using augment = aa::monoid_augment<aa::min_monoid<int>>;
+};
+
+std::size_t map_rank(const std::map<int, int>& m, int k) {
+    return static_cast<std::size_t>(std::distance(m.begin(), m.lower_bound(k)));
+}
+
+// Changes t and m alike with one randomly chosen structural update.
+template <class Tree>
+void random_update(Tree& t, std::map<int, int>& m, rng& r, int keys) {
+    int k = r.below(keys);
+    switch (r.below(6)) {
+    case 0:
+    case 1:
+        t.emplace(k, k * 7 % 1000 - 500);
+        m.emplace(k, k * 7 % 1000 - 500);
+        break;
+    case 2:
+        t.erase(k);
+        m.erase(k);
+        break;
+    case 3: {
+        std::vector<std::pair<int, int>> batch;
+        for (int i = r.below(keys / 4); i > 0; --i) {
+            int b = r.below(keys);
+            batch.emplace_back(b, b);
+        }
+        t.insert_batch(batch.begin(), batch.end());
+        m.insert(batch.begin(), batch.end());
+        break;
+    }
+    case 4: {
+        std::vector<int> batch;
+        for (int i = r.below(keys / 4); i > 0; --i)
+            batch.push_back(r.below(keys));
+        t.erase_batch(batch.begin(), batch.end());
+        for (int b : batch)
+            m.erase(b);
+        break;
+    }
+    case 5: {
+        Tree right = t.split_off(k);
+        CHECK(t.size() == map_rank(m, k) && right.size() == m.size() - t.size());
+        t = Tree::join(std::move(t), std::move(right));
+        break;
+    }
+    }
+}
+
+void order_statistics() {
+    ranked_tree t;
+    std::map<int, int> m;
+    rng r(21);
+    for (int i = 0; i < 20000; ++i) {
+        random_update(t, m, r, 2000);
+        int k = r.below(2000);
+        CHECK(t.rank(k) == map_rank(m, k));
+        int pos = m.empty() ? 0 : r.below(static_cast<int>(m.size()));
+        auto it = t.select(static_cast<std::size_t>(pos));
+        CHECK(aa_test::same_position(it, t, std::next(m.begin(), pos), m));
+        CHECK(t.select(m.size()) == t.end());
+        int hi = r.below(2000);
+        std::size_t expect = k < hi ? map_rank(m, hi) - map_rank(m, k) : 0;
+        CHECK(t.count_range(k, hi) == expect);
+    }
+    CHECK(same_contents(t, m) && aa_invariants(t));
+
+    // Sizes stay exact through sorted builds and copies.
+    std::vector<std::pair<int, int>> sorted(m.begin(), m.end());
+    ranked_tree built;
+    built.build_from_sorted(sorted.begin(), sorted.end());
+    CHECK(aa_invariants(built));
+    ranked_tree copy(built);
+    for (std::size_t i = 0; i < sorted.size(); i += 7) {
+        CHECK(built.select(i)->first == sorted[i].first);
+        CHECK(copy.rank(sorted[i].first) == i);
+    }
+}
+
+template <class Monoid, class Traits>
+void aggregates(std::uint64_t seed) {
+    using tree = aa::aa_tree<int, int, std::less<int>, std::allocator<std::pair<const int, int>>,
+                             Traits>;
+    auto fold = [](const std::map<int, int>& m, int lo, int hi) {
+        auto acc = Monoid::identity();
+        for (auto it = m.lower_bound(lo); it != m.end() && it->first < hi; ++it)
+            acc = Monoid::combine(acc, Monoid::lift(*it));
+        return acc;
+    };
+    tree t;
+    std::map<int, int> m;
+    rng r(seed);
+    for (int i = 0; i < 5000; ++i) {
+        random_update(t, m, r, 500);
+        // Assignment changes a value without rebalancing anything.
+        int k = r.below(500), v = r.below(1000) - 500;
+        t.insert_or_assign(k, v);
+        m.insert_or_assign(k, v);
+        int lo = r.below(520) - 10, hi = r.below(520) - 10;
+        CHECK(t.aggregate(lo, hi) == fold(m, lo, hi));
+        CHECK(t.aggregate() == fold(m, -1, 1000));
+    }
+    CHECK(aa_invariants(t));
+}
+
+} // namespace
+
+int main() {
+    order_statistics();
+    aggregates<sequence_monoid, folded_traits>(31);
+    aggregates<aa::sum_monoid<long>, sum_traits>(32);
+    aggregates<aa::min_monoid<int>, min_traits>(33);
+    return aa_test::status();
+}
@@ -0,0 +1,105 @@
+// Minimal test support shared by the test programs.
+//
+// CHECK(cond) reports a failed condition with its location and lets the
+// test continue; main returns aa_test::status(), which is nonzero after
+// any failure. rng is a seeded splitmix64 so failures reproduce.
+
+#ifndef AA_TESTS_CHECK_HPP
+#define AA_TESTS_CHECK_HPP
+
+#include <aa/aa_tree.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace aa_test {
+
+inline int failures = 0;
+
+inline void fail(const char* expr, const char* file, int line) {
+    if (++failures <= 20)
+        std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, expr);
+}
+
+inline int status() {
+    if (failures)
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
+
+class rng {
+public:
+    explicit rng(std::uint64_t seed) : s_(seed) {}
+    std::uint64_t operator()() {
+        std::uint64_t x = s_ += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+    // Uniform in [0, n).
+    int below(int n) { return static_cast<int>((*this)() % static_cast<std::uint64_t>(n)); }
+
+private:
+    std::uint64_t s_;
+};
+
+// True when both ranges hold equal elements in the same order, walked
+// forwards and backwards.
+template <class A, class B>
+bool same_contents(const A& a, const B& b) {
+    if (a.size() != b.size() || a.empty() != b.empty())
+        return false;
+    auto i = a.begin();
+    for (auto j = b.begin(); j != b.end(); ++i, ++j)
+        if (i == a.end() || i->first != j->first || i->second != j->second)
+            return false;
+    if (i != a.end())
+        return false;
+    auto ri = a.rbegin();
+    for (auto rj = b.rbegin(); rj != b.rend(); ++ri, ++rj)
+        if (ri->first != rj->first || ri->second != rj->second)
+            return false;
+    return ri == a.rend();
+}
+
+// True when two iterators, each into its own container, are both at the
+// end or point at equal elements.
+template <class I, class A, class J, class B>
+bool same_position(I i, const A& a, J j, const B& b) {
+    if (i == a.end() || j == b.end())
+        return (i == a.end()) == (j == b.end());
+    return i->first == j->first && i->second == j->second;
+}
+
+// True when every node of t keeps the AA invariants: a left child is one
+// level below its parent, a right child at most at its parent's level, and
+// a right grandchild strictly below it. Leaves then have level 1 and every
+// node above level 1 has two children.
+template <class Tree>
+bool aa_invariants(const Tree& t) {
+    auto level = [](const auto* n) { return n ? static_cast<unsigned>(n->level()) : 0u; };
+    std::vector<decltype(aa::detail::root_access::root(t))> stack;
+    if (auto root = aa::detail::root_access::root(t))
+        stack.push_back(root);
+    while (!stack.empty()) {
+        auto n = stack.back();
+        stack.pop_back();
+        unsigned l = level(n);
+        unsigned rl = level(n->right());
+        if (level(n->left()) + 1 != l || rl + 1 < l || rl > l ||
+            (n->right() && level(n->right()->right()) >= l))
+            return false;
+        if (n->left())
+            stack.push_back(n->left());
+        if (n->right())
+            stack.push_back(n->right());
+    }
+    return true;
+}
+
+} // namespace aa_test
+
+#define CHECK(cond) ((cond) ? void() : aa_test::fail(#cond, __FILE__, __LINE__))
+
+#endif // AA_TESTS_CHECK_HPP
@@ -0,0 +1,276 @@
+// concurrent_aa_tree under concurrent updates.
+//
+// Threads run mixed inserts, assignments, erases and lookups on a few keys
+// and record when each call started and returned. Since keys are
+// independent and linearizability is local, the whole history is
+// linearizable if each key's is: some order of that key's calls that
+// respects real time must replay against a sequential map with the same
+// results. A second run spreads updates over many keys, and quiescent
+// walks check key order, element counts and, after rebuild(), the AA
+// level invariants. Meant to be run under AA_TREE_TEST_SANITIZER=thread as
+// well.
+
+#include <aa/concurrent.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+
+namespace {
+
+using aa_test::rng;
+
+using tree = aa::concurrent_aa_tree<int, int>;
+
+enum class op { insert, assign, erase, contains, get };
+
+// One call: its arguments, its result (a value or absent for get, 0 or 1
+// otherwise) and its interval on a global clock.
+struct event {
+    op kind;
+    int key;
+    int arg;
+    int result;
+    std::uint64_t call;
+    std::uint64_t ret;
+};
+
+constexpr int absent = -1;
+
+std::atomic<std::uint64_t> clock_ticks{0};
+
+std::uint64_t now() { return clock_ticks.fetch_add(1); }
+
+event run(tree& t, op kind, int key, int arg) {
+    event e{kind, key, arg, 0, now(), 0};
+    switch (kind) {
+    case op::insert:
+        e.result = t.insert({key, arg});
+        break;
+    case op::assign:
+        e.result = t.insert_or_assign(key, arg);
+        break;
+    case op::erase:
+        e.result = static_cast<int>(t.erase(key));
+        break;
+    case op::contains:
+        e.result = t.contains(key);
+        break;
+    case op::get:
+        e.result = t.get(key).value_or(absent);
+        break;
+    }
+    e.ret = now();
+    return e;
+}
+
+// Applies e to the value a key maps to (absent if none), as std::map
+// would; false if the result e recorded is not what the map returns.
+bool replay(const event& e, int value, int& next) {
+    next = value;
+    switch (e.kind) {
+    case op::insert:
+        if (value == absent)
+            next = e.arg;
+        return e.result == (value == absent);
+    case op::assign:
+        next = e.arg;
+        return e.result == (value == absent);
+    case op::erase:
+        next = absent;
+        return e.result == (value != absent);
+    case op::contains:
+        return e.result == (value != absent);
+    case op::get:
+        return e.result == value;
+    }
+    return false;
+}
+
+// Searches for a linearization of one key's calls: at each step any call
+// that started before every pending call returned may take effect next.
+// Visited (calls done, value) states are remembered, which keeps the
+// search small while few calls overlap.
+class key_history {
+public:
+    explicit key_history(std::vector<event> events) : events_(std::move(events)) {}
+
+    bool linearizable() {
+        std::vector<bool> done(events_.size());
+        return search(done, events_.size(), absent);
+    }
+
+private:
+    bool search(std::vector<bool>& done, std::size_t left, int value) {
+        if (left == 0)
+            return true;
+        if (!seen_.insert({done, value}).second)
+            return false;
+        std::uint64_t horizon = UINT64_MAX;
+        for (std::size_t i = 0; i < events_.size(); ++i)
+            if (!done[i])
+                horizon = std::min(horizon, events_[i].ret);
+        for (std::size_t i = 0; i < events_.size(); ++i) {
+            int next;
+            if (done[i] || events_[i].call > horizon || !replay(events_[i], value, next))
+                continue;
+            done[i] = true;
+            if (search(done, left - 1, next))
+                return true;
+            done[i] = false;
+        }
+        return false;
+    }
+
+    std::vector<event> events_;
+    std::set<std::pair<std::vector<bool>, int>> seen_;
+};
+
+// Random calls from several threads, each thread drawing its own values
+// so that every write is told apart by what get returns later.
+template <class Record>
+void hammer(tree& t, unsigned threads, int ops, int keys, std::uint64_t seed, Record record) {
+    std::vector<std::thread> pool;
+    for (unsigned id = 0; id < threads; ++id) {
+        pool.emplace_back([&, id] {
+            rng r(seed + id);
+            for (int i = 0; i < ops; ++i) {
+                int key = r.below(keys);
+                int arg = static_cast<int>(id) * ops + i;
+                int pick = r.below(10);
+                op kind = pick < 3   ? op::insert
+                          : pick < 4 ? op::assign
+                          : pick < 7 ? op::erase
+                          : pick < 9 ? op::contains
+                                     : op::get;
+                record(id, run(t, kind, key, arg));
+            }
+        });
+    }
+    for (std::thread& th : pool)
+        th.join();
+}
+
+// What a quiescent walk over every node, routing nodes included, finds.
+struct shape {
+    bool ordered = true;
+    bool balanced = true;
+    std::size_t present = 0;
+    std::size_t routing = 0;
+    std::size_t height = 0;
+};
+
+shape walk(const tree& t) {
+    using node = std::remove_pointer_t<decltype(aa::detail::root_access::root(t))>;
+    auto level = [](const node* n) { return n ? n->level.load() : 0u; };
+    shape s;
+    std::vector<std::pair<const node*, std::size_t>> stack;
+    const node* prev = nullptr;
+    const node* n = aa::detail::root_access::root(t);
+    for (std::size_t depth = 1;; ++depth) {
+        for (; n; n = n->left(), ++depth)
+            stack.emplace_back(n, depth);
+        if (stack.empty())
+            break;
+        std::tie(n, depth) = stack.back();
+        stack.pop_back();
+        s.height = std::max(s.height, depth);
+        if (prev && !(prev->value.first < n->value.first))
+            s.ordered = false;
+        prev = n;
+        unsigned l = level(n);
+        unsigned rl = level(n->right());
+        if (level(n->left()) + 1 != l || rl + 1 < l || rl > l ||
+            (n->right() && level(n->right()->right()) >= l))
+            s.balanced = false;
+        ++(n->present.load() ? s.present : s.routing);
+        n = n->right();
+    }
+    return s;
+}
+
+std::map<int, int> contents(const tree& t) {
+    std::map<int, int> m;
+    t.for_each([&](const std::pair<const int, int>& e) { m.insert(e); });
+    return m;
+}
+
+void linearizability() {
+    const unsigned threads = 4;
+    const int keys = 16;
+    tree t;
+    std::vector<std::vector<event>> logs(threads);
+    hammer(t, threads, 4000, keys, 91, [&](unsigned id, const event& e) { logs[id].push_back(e); });
+
+    std::vector<std::vector<event>> by_key(keys);
+    for (const auto& log : logs)
+        for (const event& e : log)
+            by_key[e.key].push_back(e);
+    for (auto& events : by_key) {
+        std::sort(events.begin(), events.end(),
+                  [](const event& a, const event& b) { return a.call < b.call; });
+        CHECK(key_history(events).linearizable());
+    }
+
+    shape s = walk(t);
+    CHECK(s.ordered && s.present == t.size());
+    CHECK(contents(t).size() == t.size());
+}
+
+void stress() {
+    const unsigned threads = 4;
+    const int keys = 20000;
+    tree t;
+    // Fill first so that erases have something to hit and the tree is deep.
+    hammer(t, threads, 20000, keys, 93, [](unsigned, const event&) {});
+    hammer(t, threads, 50000, keys, 97, [](unsigned, const event&) {});
+
+    shape before = walk(t);
+    CHECK(before.ordered && before.present == t.size());
+    std::map<int, int> m = contents(t);
+    CHECK(m.size() == t.size());
+    for (const auto& e : m)
+        CHECK(t.get(e.first) == e.second);
+
+    t.rebuild();
+    shape after = walk(t);
+    CHECK(after.ordered && after.balanced && after.routing == 0);
+    CHECK(after.present == m.size() && contents(t) == m);
+    std::size_t bound = 1;
+    while ((std::size_t(1) << bound) <= m.size())
+        ++bound;
+    CHECK(after.height <= bound);
+
+    // Updates keep working on the rebuilt tree, and a single writer keeps
+    // it balanced.
+    rng r(99);
+    for (int i = 0; i < 20000; ++i) {
+        int k = r.below(keys);
+        if (r.below(2)) {
+            t.insert_or_assign(k, i);
+            m[k] = i;
+        } else {
+            CHECK(t.erase(k) == m.erase(k));
+        }
+    }
+    shape single = walk(t);
+    CHECK(single.ordered && single.balanced && contents(t) == m && t.size() == m.size());
+}
+
+} // namespace
+
+int main() {
+    linearizability();
+    stress();
+    return aa_test::status();
+}
@@ -0,0 +1,206 @@
+// frozen_map against std::map: lower_bound, upper_bound, find and at for
+// every stored key, the keys next to it and keys outside the range, over
+// sizes that end on and just past search-node and level boundaries. Runs
+// for each key type with a rank kernel, for the same types under a
+// comparator the kernels do not handle, and for a key type that only has
+// the scalar search. Each kernel the CPU supports is also checked on its
+// own against a plain count, whichever one frozen_map picks. freeze()
+// must copy the tree out without a single comparison.
+
+#include <aa/aa_tree.hpp>
+#include <aa/frozen.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+
+namespace {
+
+using aa_test::rng;
+using aa_test::same_contents;
+using aa_test::same_position;
+
+// Random keys spread over the whole range of K, so that unsigned keys with
+// the top bit set and negative signed ones both occur.
+template <class K>
+K random_key(rng& r) {
+    if constexpr (std::is_integral<K>::value)
+        return static_cast<K>(r());
+    else if constexpr (std::is_floating_point<K>::value)
+        return static_cast<K>(static_cast<std::int32_t>(r())) / K(7);
+    else
+        return std::to_string(r() % 100000);
+}
+
+// Probes around k: k itself and, where the type has them, its neighbours.
+template <class K>
+std::vector<K> around(const K& k) {
+    if constexpr (std::is_integral<K>::value)
+        return {k, static_cast<K>(k - 1), static_cast<K>(k + 1)};
+    else if constexpr (std::is_floating_point<K>::value)
+        return {k, std::nextafter(k, -std::numeric_limits<K>::infinity()),
+                std::nextafter(k, std::numeric_limits<K>::infinity())};
+    else
+        return {k, k + ' ', k.substr(0, k.size() - 1)};
+}
+
+template <class Frozen, class Map>
+void same_lookups(const Frozen& f, const Map& m, const typename Map::key_type& k) {
+    CHECK(same_position(f.lower_bound(k), f, m.lower_bound(k), m));
+    CHECK(same_position(f.upper_bound(k), f, m.upper_bound(k), m));
+    CHECK(same_position(f.find(k), f, m.find(k), m));
+    CHECK(f.count(k) == m.count(k) && f.contains(k) == (m.count(k) != 0));
+    bool threw = false;
+    try {
+        CHECK(f.at(k) == m.at(k));
+    } catch (const std::out_of_range&) {
+        threw = true;
+    }
+    CHECK(threw == (m.count(k) == 0));
+}
+
+template <class K, class Compare>
+void lookups(std::uint64_t seed) {
+    using frozen = aa::frozen_map<K, int, Compare>;
+    constexpr std::size_t b = frozen::block_keys;
+    // Empty, one node, node boundaries, the first two-level index and its
+    // boundary, and a three-level one.
+    const std::size_t sizes[] = {0, 1, b - 1, b, b + 1, 2 * b + 1, b * (b + 1),
+                                 b * (b + 1) + 1, 5000};
+    rng r(seed);
+    for (std::size_t n : sizes) {
+        std::map<K, int, Compare> m;
+        while (m.size() < n)
+            m.emplace(random_key<K>(r), r.below(1000));
+        aa::aa_tree<K, int, Compare> t(m.begin(), m.end());
+        frozen f = t.freeze();
+        CHECK(same_contents(f, m));
+        for (const auto& e : m)
+            for (const K& k : around(e.first))
+                same_lookups(f, m, k);
+        for (int i = 0; i < 200; ++i)
+            same_lookups(f, m, random_key<K>(r));
+        if constexpr (std::is_arithmetic<K>::value) {
+            same_lookups(f, m, std::numeric_limits<K>::lowest());
+            same_lookups(f, m, std::numeric_limits<K>::max());
+        }
+    }
+}
+
+void copies() {
+    std::map<int, int> m{{1, 10}, {2, 20}, {3, 30}};
+    aa::frozen_map<int, int> a(m.begin(), m.end());
+    aa::frozen_map<int, int> b;
+    b = a;
+    CHECK(b == a && same_contents(b, m) && b.find(2)->second == 20);
+    const auto& self = b;
+    b = self;
+    CHECK(b == a);
+    aa::frozen_map<int, int> c(std::move(b));
+    CHECK(c == a);
+    b = std::move(c);
+    CHECK(b == a && b.contains(3));
+    b = aa::frozen_map<int, int>();
+    CHECK(b.empty() && b.find(1) == b.end() && b.lower_bound(1) == b.end());
+}
+
+#ifdef AA_SIMD_X86
+// Nodes of random sorted keys, some with repeats as in a padded last node,
+// ranked by both kernels for keys inside, on and outside them.
+template <class K>
+void kernels(std::uint64_t seed) {
+    constexpr std::size_t width = 64 / sizeof(K);
+    static_assert(aa::detail::simd_block<K, std::less<K>, width>::value, "no kernel for K");
+    aa::detail::simd_level level = aa::detail::simd_support();
+    rng r(seed);
+    for (int round = 0; round < 2000; ++round) {
+        K node[width];
+        for (K& k : node)
+            k = random_key<K>(r);
+        std::sort(node, node + width);
+        for (std::size_t i = width - static_cast<std::size_t>(r.below(width)); i < width; ++i)
+            node[i] = node[i - 1];
+        std::vector<K> probes{random_key<K>(r), std::numeric_limits<K>::lowest(),
+                              std::numeric_limits<K>::max()};
+        for (const K& k : around(node[r.below(width)]))
+            probes.push_back(k);
+        for (const K& x : probes) {
+            std::size_t below = 0, not_above = 0;
+            for (const K& k : node) {
+                below += k < x;
+                not_above += !(x < k);
+            }
+            if (level >= aa::detail::simd_level::sse42) {
+                CHECK(aa::detail::rank_sse42<false>(node, x) == below);
+                CHECK(aa::detail::rank_sse42<true>(node, x) == not_above);
+            }
+            if (level >= aa::detail::simd_level::avx2) {
+                CHECK(aa::detail::rank_avx2<false>(node, x) == below);
+                CHECK(aa::detail::rank_avx2<true>(node, x) == not_above);
+            }
+        }
+    }
+}
+#endif
+
+// Counts its calls, so a test can tell a walk from repeated searches.
+struct counting_less {
+    std::size_t* calls;
+    bool operator()(int a, int b) const {
+        ++*calls;
+        return a < b;
+    }
+};
+
+void freeze_walks() {
+    std::size_t calls = 0;
+    counting_less comp{&calls};
+    aa::aa_tree<int, int, counting_less> t(comp);
+    std::map<int, int> m;
+    rng r(77);
+    for (int i = 0; i < 5000; ++i) {
+        int k = r.below(100000);
+        t.emplace(k, i);
+        m.emplace(k, i);
+    }
+    calls = 0;
+    auto f = t.freeze();
+    CHECK(calls == 0);
+    CHECK(same_contents(f, m));
+}
+
+template <class K>
+void key_type(std::uint64_t seed) {
+    lookups<K, std::less<K>>(seed);
+    lookups<K, std::greater<K>>(seed + 1);
+#ifdef AA_SIMD_X86
+    kernels<K>(seed);
+#endif
+}
+
+} // namespace
+
+int main() {
+    key_type<std::int32_t>(61);
+    key_type<std::int64_t>(63);
+    key_type<std::uint32_t>(65);
+    key_type<std::uint64_t>(67);
+    key_type<float>(69);
+    key_type<double>(71);
+    lookups<std::uint32_t, std::less<>>(73);
+    lookups<std::string, std::less<std::string>>(75);
+    copies();
+    freeze_walks();
+    return aa_test::status();
+}
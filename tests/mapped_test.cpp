@@ -0,0 +1,171 @@
+// mapped_aa_tree against std::map across reopenings: a tree created in a
+// file, updated, synced and reopened must hold the same elements as the
+// map and keep the AA invariants. Opening must reject a file that was
+// modified and not synced, one whose header or nodes were changed after
+// it was sealed, and one written for other types.
+
+#include <aa/mapped.hpp>
+
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+
+namespace {
+
+namespace fs = std::filesystem;
+
+using aa_test::aa_invariants;
+using aa_test::rng;
+using aa_test::same_contents;
+
+using tree = aa::mapped_aa_tree<std::uint64_t, std::uint64_t>;
+using narrow_tree = aa::mapped_aa_tree<std::uint32_t, std::uint64_t>;
+
+// A fresh path in the temporary directory, removed on destruction.
+class temp_file {
+public:
+    explicit temp_file(const std::string& name)
+        : path_(fs::temp_directory_path() /
+                ("aa_mapped_test_" + std::to_string(::getpid()) + "_" + name)) {
+        fs::remove(path_);
+    }
+    ~temp_file() { fs::remove(path_); }
+    std::string path() const { return path_.string(); }
+
+private:
+    fs::path path_;
+};
+
+std::vector<char> read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string& path, const std::vector<char>& bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+template <class Tree = tree>
+bool rejected(const std::string& path, aa::mapped_options opts = {}) {
+    try {
+        Tree t(path, opts);
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+void random_updates(tree& t, std::map<std::uint64_t, std::uint64_t>& m, rng& r, int n) {
+    for (int i = 0; i < n; ++i) {
+        std::uint64_t k = r() % 5000;
+        if (r.below(3)) {
+            t.tree().insert_or_assign(k, r());
+            m[k] = t.tree().at(k);
+        } else {
+            CHECK(t.tree().erase(k) == m.erase(k));
+        }
+    }
+}
+
+void create_update_reopen() {
+    temp_file file("reopen");
+    std::map<std::uint64_t, std::uint64_t> m;
+    rng r(111);
+    {
+        tree t(file.path());
+        CHECK(t.tree().empty());
+        random_updates(t, m, r, 20000);
+        CHECK(same_contents(t.tree(), m) && aa_invariants(t.tree()));
+        t.sync();
+        // Updates after a sync are synced again when the tree closes.
+        random_updates(t, m, r, 5000);
+    }
+    for (int round = 0; round < 3; ++round) {
+        tree t(file.path());
+        const tree& ct = t;
+        CHECK(same_contents(ct.tree(), m) && aa_invariants(ct.tree()));
+        random_updates(t, m, r, 5000);
+        t.sync();
+    }
+    // Freed nodes were reused from the file's freelist.
+    tree t(file.path());
+    CHECK(same_contents(t.tree(), m) && aa_invariants(t.tree()));
+}
+
+void rejects_unsynced() {
+    temp_file file("unsynced");
+    temp_file crashed("crashed");
+    std::map<std::uint64_t, std::uint64_t> m;
+    rng r(113);
+    {
+        tree t(file.path());
+        random_updates(t, m, r, 2000);
+        t.sync();
+        // What a crash would leave: the file after updates and no sync.
+        random_updates(t, m, r, 100);
+        write_file(crashed.path(), read_file(file.path()));
+    }
+    CHECK(rejected(crashed.path()));
+    aa::mapped_options fast;
+    fast.verify_data = false;
+    CHECK(rejected(crashed.path(), fast));
+    CHECK(!rejected(file.path()));
+}
+
+void rejects_corruption() {
+    temp_file file("corrupt");
+    temp_file damaged("damaged");
+    {
+        tree t(file.path());
+        for (std::uint64_t i = 0; i < 1000; ++i)
+            t.tree().emplace(i, i * i);
+    }
+    std::vector<char> good = read_file(file.path());
+    CHECK(!rejected(file.path()));
+
+    // Each header field: magic, format, block size, root, count, end,
+    // freelist, clean flag, data checksum, header checksum.
+    for (std::size_t field = 0; field < 10; ++field) {
+        std::vector<char> bad = good;
+        bad[field * 8 + 1] ^= 0x10;
+        write_file(damaged.path(), bad);
+        CHECK(rejected(damaged.path()));
+    }
+
+    // A node byte is caught by the data checksum, unless that is skipped.
+    std::vector<char> bad = good;
+    bad[aa::detail::mapped_file::data_begin + 100] ^= 0x10;
+    write_file(damaged.path(), bad);
+    CHECK(rejected(damaged.path()));
+    aa::mapped_options fast;
+    fast.verify_data = false;
+    CHECK(!rejected(damaged.path(), fast));
+
+    // Truncated files and files of other types.
+    write_file(damaged.path(), std::vector<char>(good.begin(), good.begin() + 100));
+    CHECK(rejected(damaged.path()));
+    CHECK(rejected<narrow_tree>(file.path()));
+    write_file(damaged.path(), std::vector<char>(8192, 'x'));
+    CHECK(rejected(damaged.path()));
+}
+
+} // namespace
+
+int main() {
+    create_update_reopen();
+    rejects_unsynced();
+    rejects_corruption();
+    return aa_test::status();
+}
@@ -0,0 +1,143 @@
+// parallel_build_from_sorted and parallel_for_each against their serial
+// counterparts: a parallel build must give the tree build_from_sorted
+// gives, node for node and level for level, and a parallel visit must
+// reach every element exactly once. Sizes run from empty to well past the
+// point where subtrees are handed to other threads, for several thread
+// counts, with the default allocator, a thread-caching arena and threaded
+// nodes.
+
+#include <aa/aa_tree.hpp>
+#include <aa/arena.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+
+namespace {
+
+using aa_test::aa_invariants;
+using aa_test::same_contents;
+
+struct threaded_traits : aa::default_tree_traits {
+    static constexpr bool threaded = true;
+};
+
+// True when a and b have the same shape, keys, values and levels.
+template <class Tree>
+bool same_shape(const Tree& a, const Tree& b) {
+    using node = decltype(aa::detail::root_access::root(a));
+    std::vector<std::pair<node, node>> stack{
+        {aa::detail::root_access::root(a), aa::detail::root_access::root(b)}};
+    while (!stack.empty()) {
+        auto [x, y] = stack.back();
+        stack.pop_back();
+        if (!x || !y) {
+            if (x != y)
+                return false;
+            continue;
+        }
+        if (x->value != y->value || x->level() != y->level())
+            return false;
+        stack.emplace_back(x->left(), y->left());
+        stack.emplace_back(x->right(), y->right());
+    }
+    return true;
+}
+
+template <class Tree>
+void builds_and_visits(const typename Tree::allocator_type& alloc) {
+    const std::size_t sizes[] = {0, 1, 2, 4095, 4096, 8191, 8192, 100000};
+    const unsigned thread_counts[] = {0, 1, 2, 3, 8};
+    for (std::size_t n : sizes) {
+        std::vector<std::pair<int, int>> sorted;
+        for (std::size_t i = 0; i < n; ++i)
+            sorted.emplace_back(static_cast<int>(3 * i), static_cast<int>(i));
+        std::map<int, int> m(sorted.begin(), sorted.end());
+        Tree serial(alloc);
+        serial.build_from_sorted(sorted.begin(), sorted.end());
+
+        for (unsigned threads : thread_counts) {
+            Tree t(alloc);
+            t.emplace(-1, -1);
+            t.parallel_build_from_sorted(sorted.begin(), sorted.end(), threads);
+            CHECK(same_shape(t, serial) && same_contents(t, m) && aa_invariants(t));
+
+            // Every element once, from several threads, and writes through
+            // the non-const visit stick.
+            std::vector<std::atomic<int>> seen(n);
+            std::atomic<bool> updated{true};
+            t.parallel_for_each(
+                [&](std::pair<const int, int>& e) {
+                    seen[static_cast<std::size_t>(e.second)].fetch_add(1);
+                    e.second += 1;
+                },
+                threads);
+            CHECK(std::all_of(seen.begin(), seen.end(), [](const std::atomic<int>& c) {
+                return c.load() == 1;
+            }));
+
+            const Tree& ct = t;
+            std::mutex lock;
+            std::vector<int> keys;
+            ct.parallel_for_each(
+                [&](const std::pair<const int, int>& e) {
+                    if (e.second != e.first / 3 + 1)
+                        updated = false;
+                    std::lock_guard<std::mutex> g(lock);
+                    keys.push_back(e.first);
+                },
+                threads);
+            std::sort(keys.begin(), keys.end());
+            CHECK(updated && keys.size() == n &&
+                  std::adjacent_find(keys.begin(), keys.end()) == keys.end());
+        }
+    }
+}
+
+// An exception thrown on any thread reaches the caller once all are done,
+// and the tree is left intact.
+void exceptions() {
+    std::vector<std::pair<int, int>> sorted;
+    for (int i = 0; i < 50000; ++i)
+        sorted.emplace_back(i, i);
+    aa::aa_tree<int, int> t;
+    t.parallel_build_from_sorted(sorted.begin(), sorted.end(), 4);
+    std::atomic<int> calls{0};
+    bool threw = false;
+    try {
+        t.parallel_for_each(
+            [&](std::pair<const int, int>& e) {
+                calls.fetch_add(1);
+                if (e.first == 40000)
+                    throw std::runtime_error("stop");
+            },
+            4);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw && calls.load() > 0);
+    CHECK(same_contents(t, std::map<int, int>(sorted.begin(), sorted.end())));
+}
+
+} // namespace
+
+int main() {
+    using pair_alloc = std::allocator<std::pair<const int, int>>;
+    using arena = aa::arena_allocator<std::pair<const int, int>>;
+    builds_and_visits<aa::aa_tree<int, int>>(pair_alloc());
+    aa::arena_options opts;
+    opts.thread_cache = true;
+    builds_and_visits<aa::aa_tree<int, int, std::less<int>, arena>>(arena(opts));
+    builds_and_visits<aa::aa_tree<int, int, std::less<int>, pair_alloc, threaded_traits>>(
+        pair_alloc());
+    exceptions();
+    return aa_test::status();
+}
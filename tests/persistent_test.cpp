@@ -0,0 +1,65 @@
+// persistent_aa_tree and rcu_aa_tree against std::map: versions are
+// iterated both ways, through read guards as well, and compared with the
+// map holding the same updates.
+
+#include <aa/persistent.hpp>
+#include <aa/rcu.hpp>
+
+#include <cstdint>
+#include <map>
+#include <utility>
+
+#include "check.hpp"
+
+namespace {
+
+using aa_test::aa_invariants;
+using aa_test::rng;
+using aa_test::same_contents;
+
+void iterate_versions() {
+    aa::persistent_aa_tree<int, int> v;
+    std::map<int, int> m;
+    rng r(11);
+    for (int i = 0; i < 2000; ++i) {
+        int k = r.below(500);
+        v = v.insert_or_assign(k, i);
+        m[k] = i;
+    }
+    CHECK(same_contents(v, m) && aa_invariants(v));
+
+    // Iterator steps from interior positions, where the walk has to
+    // re-descend from the root.
+    auto it = v.find(m.begin()->first);
+    for (auto j = m.begin(); j != m.end(); ++j, ++it)
+        CHECK(it != v.end() && it->first == j->first && it->second == j->second);
+    CHECK(it == v.end());
+    for (auto j = m.rbegin(); j != m.rend(); ++j) {
+        --it;
+        CHECK(it->first == j->first);
+    }
+    CHECK(it == v.begin());
+}
+
+void iterate_rcu() {
+    aa::rcu_aa_tree<int, int> map;
+    std::map<int, int> m;
+    for (int i = 0; i < 1000; ++i) {
+        map.insert_or_assign(i * 7 % 1000, i);
+        m[i * 7 % 1000] = i;
+    }
+    auto g = map.read();
+    std::map<int, int> seen;
+    for (const auto& [key, value] : *g)
+        seen.emplace(key, value);
+    CHECK(seen == m);
+    CHECK(same_contents(*g, m));
+}
+
+} // namespace
+
+int main() {
+    iterate_versions();
+    iterate_rcu();
+    return aa_test::status();
+}
@@ -0,0 +1,214 @@
+// serialize and deserialize round trips: snapshots written to a buffer or a
+// stream, with and without levels, must load back the same contents, and
+// with levels the same shape. Several snapshots read one after another
+// from a stream that cannot seek must each end where the next begins.
+// Malformed input, whether truncated at any byte, out of order, with
+// levels that do not form an AA-tree or with a bad header, must be
+// rejected and leave the tree empty.
+
+#include <aa/serialize.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+
+namespace {
+
+using aa_test::aa_invariants;
+using aa_test::rng;
+using aa_test::same_contents;
+
+// Header: magic, flags, count.
+constexpr std::size_t header_size = 16;
+
+// A stream buffer over a string that hands out a few bytes at a time and,
+// like a pipe, cannot seek or put back more than it holds.
+class pipe_buf : public std::streambuf {
+public:
+    explicit pipe_buf(std::string data) : data_(std::move(data)) {}
+
+protected:
+    int_type underflow() override {
+        if (at_ == data_.size())
+            return traits_type::eof();
+        std::size_t n = std::min<std::size_t>(7, data_.size() - at_);
+        data_.copy(chunk_, n, at_);
+        at_ += n;
+        setg(chunk_, chunk_, chunk_ + n);
+        return traits_type::to_int_type(chunk_[0]);
+    }
+
+private:
+    std::string data_;
+    std::size_t at_ = 0;
+    char chunk_[7];
+};
+
+template <class Tree>
+std::vector<char> bytes_of(const Tree& t, bool levels) {
+    aa::serialize_options opts;
+    opts.levels = levels;
+    std::vector<char> out;
+    aa::serialize(t, out, opts);
+    return out;
+}
+
+template <class Tree>
+bool rejected(const std::vector<char>& in) {
+    Tree t;
+    t.emplace();
+    bool threw = false;
+    try {
+        aa::deserialize(in.data(), in.data() + in.size(), t);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    return threw && t.empty();
+}
+
+template <class Tree>
+bool rejected_stream(const std::vector<char>& in) {
+    Tree t;
+    t.emplace();
+    std::istringstream is(std::string(in.begin(), in.end()));
+    bool threw = false;
+    try {
+        aa::deserialize(is, t);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    return threw && t.empty();
+}
+
+template <class Tree, class Make>
+void round_trips(std::uint64_t seed, Make make) {
+    using map = std::map<typename Tree::key_type, typename Tree::mapped_type,
+                         typename Tree::key_compare>;
+    const int sizes[] = {0, 1, 2, 3, 100, 5000};
+    rng r(seed);
+    for (int n : sizes) {
+        Tree t;
+        map m;
+        // Random inserts, so that the shape is not the sorted builder's.
+        while (static_cast<int>(m.size()) < n) {
+            auto e = make(r);
+            t.insert(e);
+            m.insert(e);
+        }
+        for (bool levels : {false, true}) {
+            std::vector<char> bytes = bytes_of(t, levels);
+
+            Tree a;
+            a.insert(make(r));
+            const char* end = aa::deserialize(bytes.data(), bytes.data() + bytes.size(), a);
+            CHECK(end == bytes.data() + bytes.size());
+            CHECK(same_contents(a, m) && aa_invariants(a));
+            // With levels the shape comes back too, so it saves the same.
+            if (levels)
+                CHECK(bytes_of(a, true) == bytes);
+
+            // Two snapshots and a trailer through a stream that cannot
+            // seek: each read stops at the end of its snapshot.
+            std::ostringstream os;
+            aa::serialize_options opts;
+            opts.levels = levels;
+            aa::serialize(t, os, opts);
+            aa::serialize(Tree(), os, opts);
+            os << "tail";
+            pipe_buf buf(os.str());
+            std::istream is(&buf);
+            Tree b, c;
+            c.insert(make(r));
+            aa::deserialize(is, b);
+            aa::deserialize(is, c);
+            std::string rest;
+            is >> rest;
+            CHECK(same_contents(b, m) && aa_invariants(b) && c.empty() && rest == "tail");
+            if (levels)
+                CHECK(bytes_of(b, true) == bytes);
+        }
+    }
+}
+
+void rejects_malformed() {
+    using tree = aa::aa_tree<int, int>;
+    const std::size_t stride = 1 + 2 * sizeof(int);
+    tree t;
+    rng r(123);
+    for (int i = 0; i < 200; ++i)
+        t.emplace(r.below(1000), i);
+    std::vector<char> plain = bytes_of(t, false);
+    std::vector<char> shaped = bytes_of(t, true);
+    CHECK(!rejected<tree>(plain) && !rejected<tree>(shaped));
+
+    // Every truncation, through memory and through a stream.
+    for (std::vector<char>* full : {&plain, &shaped}) {
+        for (std::size_t n = 0; n < full->size(); n += n < 64 ? 1 : 37) {
+            std::vector<char> cut(full->begin(), full->begin() + n);
+            CHECK(rejected<tree>(cut) && rejected_stream<tree>(cut));
+        }
+    }
+
+    // Bad magic and unknown flags.
+    std::vector<char> bad = plain;
+    bad[0] = 'X';
+    CHECK(rejected<tree>(bad));
+    bad = plain;
+    bad[4] |= 2;
+    CHECK(rejected<tree>(bad));
+
+    // Two keys swapped.
+    bad = plain;
+    std::size_t k0 = header_size, k1 = header_size + 2 * sizeof(int);
+    for (std::size_t i = 0; i < sizeof(int); ++i)
+        std::swap(bad[k0 + i], bad[k1 + i]);
+    CHECK(rejected<tree>(bad));
+
+    // Levels that do not form an AA-tree: the first node raised above the
+    // leaves, a level of zero, and every node flattened to level 1.
+    bad = shaped;
+    bad[header_size] = 2;
+    CHECK(rejected<tree>(bad) && rejected_stream<tree>(bad));
+    bad = shaped;
+    bad[header_size + 5 * stride] = 0;
+    CHECK(rejected<tree>(bad));
+    bad = shaped;
+    for (std::size_t at = header_size; at < bad.size(); at += stride)
+        bad[at] = 1;
+    CHECK(rejected<tree>(bad));
+
+    // A string whose length runs past the input.
+    using strings = aa::aa_tree<std::string, std::string>;
+    strings s;
+    s.emplace("key", "value");
+    bad = bytes_of(s, false);
+    bad[header_size] = 100;
+    CHECK(rejected<strings>(bad) && rejected_stream<strings>(bad));
+}
+
+} // namespace
+
+int main() {
+    round_trips<aa::aa_tree<int, int>>(
+        11, [](rng& r) { return std::pair<const int, int>(r.below(100000), r.below(100)); });
+    round_trips<aa::aa_tree<std::uint64_t, double, std::greater<std::uint64_t>>>(13, [](rng& r) {
+        return std::pair<const std::uint64_t, double>(r(), static_cast<double>(r.below(1000)) / 8);
+    });
+    round_trips<aa::aa_tree<std::string, std::string>>(17, [](rng& r) {
+        std::string k(static_cast<std::size_t>(r.below(12)), 'a');
+        for (char& c : k)
+            c = static_cast<char>('a' + r.below(26));
+        return std::pair<const std::string, std::string>(k, std::string(r.below(40), 'v'));
+    });
+    rejects_malformed();
+    return aa_test::status();
+}
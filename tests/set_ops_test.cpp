@@ -0,0 +1,151 @@
+// join, split_off and the set algebra against the same operations on
+// std::map, for trees sharing one arena and trees with separate ones, and
+// for threaded trees, whose neighbour links must survive the relinking.
+// Operands from another arena are copied over with a linear walk, not
+// with an iterator that searches again at each step.
+
+#include <aa/aa_tree.hpp>
+#include <aa/arena.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <utility>
+
+#include "check.hpp"
+
+namespace {
+
+using aa_test::aa_invariants;
+using aa_test::rng;
+using aa_test::same_contents;
+
+using alloc = aa::arena_allocator<std::pair<const int, int>>;
+
+struct threaded_traits : aa::default_tree_traits {
+    static constexpr bool threaded = true;
+};
+
+// Random contents with keys in [0, keys), values tagging the operand.
+template <class Tree>
+void fill(Tree& t, std::map<int, int>& m, rng& r, int n, int keys, int tag) {
+    for (int i = 0; i < n; ++i) {
+        int k = r.below(keys);
+        t.emplace(k, tag);
+        m.emplace(k, tag);
+    }
+}
+
+template <class Tree>
+void split_and_join(std::uint64_t seed, bool shared) {
+    rng r(seed);
+    alloc a;
+    for (int round = 0; round < 200; ++round) {
+        int keys = 1 + r.below(3000);
+        Tree t(shared ? a : alloc());
+        std::map<int, int> m;
+        fill(t, m, r, r.below(2000), keys, 0);
+        int k = r.below(keys);
+
+        Tree right = t.split_off(k);
+        std::map<int, int> mr(m.lower_bound(k), m.end());
+        m.erase(m.lower_bound(k), m.end());
+        CHECK(same_contents(t, m) && same_contents(right, mr));
+        CHECK(aa_invariants(t) && aa_invariants(right));
+
+        if (round % 2 && !mr.count(k)) {
+            Tree joined = Tree::join(std::move(t), std::make_pair(k, -1), std::move(right));
+            m.emplace(k, -1);
+            m.insert(mr.begin(), mr.end());
+            CHECK(same_contents(joined, m) && aa_invariants(joined));
+        } else {
+            Tree joined = Tree::join(std::move(t), std::move(right));
+            m.insert(mr.begin(), mr.end());
+            CHECK(same_contents(joined, m) && aa_invariants(joined));
+        }
+    }
+}
+
+template <class Tree>
+void algebra(std::uint64_t seed, bool shared) {
+    rng r(seed);
+    alloc a;
+    for (int round = 0; round < 300; ++round) {
+        // Sizes from equal to very lopsided.
+        int keys = 1 + r.below(4000);
+        Tree x(shared ? a : alloc()), y(shared ? a : alloc());
+        std::map<int, int> mx, my;
+        fill(x, mx, r, r.below(3000), keys, 1);
+        fill(y, my, r, r.below(round % 3 ? 3000 : 30), keys, 2);
+
+        std::map<int, int> expect;
+        Tree z(shared ? a : alloc());
+        switch (round % 3) {
+        case 0:
+            expect = mx;
+            expect.insert(my.begin(), my.end());
+            z = set_union(std::move(x), std::move(y));
+            break;
+        case 1:
+            for (const auto& e : mx)
+                if (my.count(e.first))
+                    expect.insert(e);
+            z = set_intersection(std::move(x), std::move(y));
+            break;
+        case 2:
+            for (const auto& e : mx)
+                if (!my.count(e.first))
+                    expect.insert(e);
+            z = set_difference(std::move(x), std::move(y));
+            break;
+        }
+        CHECK(same_contents(z, expect) && aa_invariants(z));
+    }
+}
+
+// Counts its calls, so a test can tell a walk from repeated searches.
+struct counting_less {
+    std::size_t* calls;
+    bool operator()(int a, int b) const {
+        ++*calls;
+        return a < b;
+    }
+};
+
+void copies_linearly() {
+    using counted = aa::aa_tree<int, int, counting_less, alloc>;
+    const int n = 20000;
+    std::size_t calls = 0;
+    counting_less comp{&calls};
+    counted left(comp, alloc()), right(comp, alloc());
+    std::map<int, int> m;
+    rng r(47);
+    for (int i = 0; i < n; ++i) {
+        int k = r.below(1 << 20);
+        (k < (1 << 19) ? left : right).emplace(k, i);
+        m.emplace(k, i);
+    }
+    calls = 0;
+    counted joined = counted::join(std::move(left), std::move(right));
+    // A few per element at most (build checks order in debug builds);
+    // stepping an iterator would search again for most of them.
+    CHECK(calls <= 3 * static_cast<std::size_t>(n));
+    CHECK(same_contents(joined, m) && aa_invariants(joined));
+}
+
+} // namespace
+
+int main() {
+    using plain = aa::aa_tree<int, int, std::less<int>, alloc>;
+    using threaded = aa::aa_tree<int, int, std::less<int>, alloc, threaded_traits>;
+    split_and_join<plain>(41, true);
+    split_and_join<plain>(42, false);
+    split_and_join<threaded>(43, true);
+    algebra<plain>(44, true);
+    algebra<plain>(45, false);
+    algebra<threaded>(46, true);
+    copies_linearly();
+    return aa_test::status();
+}
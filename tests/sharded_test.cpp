@@ -0,0 +1,153 @@
+// sharded_aa_map against std::map: random batches routed to the shards in
+// parallel, single-element updates and resplits must leave the same
+// contents as the map, with every shard holding only its splitter range
+// and keeping the AA invariants. Runs with one shard and with several,
+// over the default allocator and a thread-caching arena shared by all
+// shards, and with order statistics, which resplit() samples through
+// select() instead of a walk; both must pick the same splitters.
+
+#include <aa/arena.hpp>
+#include <aa/sharded.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+
+namespace {
+
+using aa_test::aa_invariants;
+using aa_test::rng;
+using aa_test::same_contents;
+using aa_test::same_position;
+
+// Every shard holds only keys of its range and is a valid AA-tree.
+template <class K, class T, std::size_t Shards, class C, class A, class Tr>
+bool shards_in_range(const aa::sharded_aa_map<K, T, Shards, C, A, Tr>& s) {
+    const auto& split = s.splitters();
+    for (std::size_t i = 0; i < Shards; ++i) {
+        const auto& shard = s.shard(i);
+        if (!aa_invariants(shard))
+            return false;
+        if (shard.empty())
+            continue;
+        if (i > 0 && (i > split.size() || shard.begin()->first < split[i - 1]))
+            return false;
+        if (i < split.size() && !(shard.rbegin()->first < split[i]))
+            return false;
+    }
+    return true;
+}
+
+template <class Map>
+void random_batches(std::uint64_t seed, Map s) {
+    std::map<int, int> m;
+    rng r(seed);
+    const int keys = 20000;
+    for (int round = 0; round < 100; ++round) {
+        int v = round;
+        switch (r.below(6)) {
+        case 0:
+        case 1: {
+            std::vector<std::pair<int, int>> batch;
+            for (int n = r.below(3000); n > 0; --n)
+                batch.emplace_back(r.below(keys), v);
+            std::size_t before = m.size();
+            m.insert(batch.begin(), batch.end());
+            CHECK(s.insert_batch(batch.begin(), batch.end()) == m.size() - before);
+            break;
+        }
+        case 2: {
+            std::vector<int> batch;
+            for (int n = r.below(3000); n > 0; --n)
+                batch.push_back(r.below(keys));
+            std::size_t before = m.size();
+            for (int k : batch)
+                m.erase(k);
+            CHECK(s.erase_batch(batch.begin(), batch.end()) == before - m.size());
+            break;
+        }
+        case 3:
+            for (int n = 0; n < 50; ++n) {
+                int k = r.below(keys);
+                auto a = s.insert({k, v});
+                auto b = m.insert({k, v});
+                CHECK(a.second == b.second && same_position(a.first, s, b.first, m));
+                k = r.below(keys);
+                CHECK(s.erase(k) == m.erase(k));
+            }
+            break;
+        case 4:
+            for (int n = 0; n < 50; ++n) {
+                int k = r.below(keys + 10) - 5;
+                CHECK(same_position(s.find(k), s, m.find(k), m));
+                CHECK(same_position(s.lower_bound(k), s, m.lower_bound(k), m));
+                CHECK(same_position(s.upper_bound(k), s, m.upper_bound(k), m));
+            }
+            break;
+        case 5:
+            if (round % 2) {
+                s.resplit();
+            } else {
+                // Splitters from a sample skewed to the low keys.
+                std::vector<int> sample;
+                for (int n = 0; n < 500; ++n)
+                    sample.push_back(r.below(keys / 4));
+                s.resplit(sample.begin(), sample.end());
+            }
+            break;
+        }
+        CHECK(same_contents(s, m) && shards_in_range(s));
+    }
+}
+
+struct ranked_traits : aa::default_tree_traits {
+    using augment = aa::order_statistics;
+};
+
+template <std::size_t Shards>
+void same_splitters(std::uint64_t seed) {
+    using ranked = aa::sharded_aa_map<int, int, Shards, std::less<int>,
+                                      std::allocator<std::pair<const int, int>>, ranked_traits>;
+    aa::sharded_aa_map<int, int, Shards> walked;
+    ranked selected;
+    rng r(seed);
+    for (int n : {0, 1, 5, 100, 3000, 50000}) {
+        while (static_cast<int>(walked.size()) < n) {
+            int k = r.below(1 << 30);
+            walked.insert({k, 0});
+            selected.insert({k, 0});
+        }
+        walked.resplit();
+        selected.resplit();
+        CHECK(walked.splitters() == selected.splitters());
+        CHECK(same_contents(walked, selected) && shards_in_range(selected));
+    }
+}
+
+template <std::size_t Shards>
+void run_all(std::uint64_t seed) {
+    using arena = aa::arena_allocator<std::pair<const int, int>>;
+    random_batches(seed, aa::sharded_aa_map<int, int, Shards>());
+    aa::arena_options opts;
+    opts.thread_cache = true;
+    random_batches(seed + 1, aa::sharded_aa_map<int, int, Shards, std::less<int>, arena>(
+                                 std::less<int>(), arena(opts)));
+    random_batches(seed + 2, aa::sharded_aa_map<int, int, Shards, std::less<int>,
+                                                std::allocator<std::pair<const int, int>>,
+                                                ranked_traits>());
+    same_splitters<Shards>(seed + 3);
+}
+
+} // namespace
+
+int main() {
+    run_all<1>(101);
+    run_all<8>(103);
+    return aa_test::status();
+}
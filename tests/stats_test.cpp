@@ -0,0 +1,125 @@
+// tree_stats against the work the tree is documented to do: one search per
+// lookup, insert and erase, path lengths within the AA height bound, only
+// splits for ascending inserts, skews for descending ones, level
+// decrements on erase, and counters that stay with the tree object.
+
+#include <aa/aa_tree.hpp>
+#include <aa/stats.hpp>
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "check.hpp"
+
+namespace {
+
+using aa_test::rng;
+
+struct counted_traits : aa::default_tree_traits {
+    using stats = aa::tree_stats;
+};
+
+using counted_tree = aa::aa_tree<int, int, std::less<int>,
+                                 std::allocator<std::pair<const int, int>>, counted_traits>;
+
+bool all_zero(const aa::tree_stats& s) {
+    return s.skews() == 0 && s.splits() == 0 && s.rotations() == 0 &&
+           s.level_decrements() == 0 && s.searches() == 0 && s.path_nodes() == 0 &&
+           s.mean_path_length() == 0.0;
+}
+
+// The histogram accounts for every search and every node visited.
+bool histogram_adds_up(const aa::tree_stats& s) {
+    std::uint64_t searches = 0, nodes = 0;
+    for (std::size_t i = 0; i < aa::tree_stats::histogram_size; ++i) {
+        searches += s.path_histogram(i);
+        nodes += i * s.path_histogram(i);
+    }
+    return searches == s.searches() && nodes == s.path_nodes();
+}
+
+void ascending_and_descending() {
+    const int n = 4096;
+    counted_tree up;
+    CHECK(all_zero(up.stats()));
+    for (int i = 0; i < n; ++i)
+        up.emplace(i, i);
+    const aa::tree_stats& s = up.stats();
+    CHECK(s.searches() == static_cast<std::uint64_t>(n));
+    CHECK(s.skews() >= s.skew_rotations() && s.splits() >= s.split_rotations());
+    CHECK(s.skew_rotations() == 0 && s.split_rotations() > 0);
+    CHECK(s.rotations() == s.skew_rotations() + s.split_rotations());
+    CHECK(s.level_decrements() == 0);
+    CHECK(histogram_adds_up(s));
+
+    counted_tree down;
+    for (int i = n; i-- > 0;)
+        down.emplace(i, i);
+    CHECK(down.stats().skew_rotations() > 0 && down.stats().split_rotations() > 0);
+
+    // Each lookup is one search no longer than the height bound.
+    up.reset_stats();
+    CHECK(all_zero(up.stats()));
+    for (int i = 0; i < n; ++i)
+        CHECK(up.find(i) != up.end());
+    CHECK(up.find(-1) == up.end());
+    CHECK(s.searches() == static_cast<std::uint64_t>(n) + 1);
+    CHECK(s.skews() == 0 && s.splits() == 0);
+    double bound = 2 * std::log2(n + 1.0);
+    CHECK(s.mean_path_length() >= 1.0 && s.mean_path_length() <= bound);
+    for (std::size_t i = static_cast<std::size_t>(bound) + 1; i < aa::tree_stats::histogram_size; ++i)
+        CHECK(s.path_histogram(i) == 0);
+    CHECK(s.path_histogram(aa::tree_stats::histogram_size) == 0);
+    CHECK(histogram_adds_up(s));
+
+    // find_batch records one path per key.
+    std::vector<int> keys{1, 5, 9, -3, 4000};
+    std::vector<counted_tree::iterator> hits;
+    up.reset_stats();
+    up.find_batch(keys.begin(), keys.end(), std::back_inserter(hits));
+    CHECK(s.searches() == keys.size() && histogram_adds_up(s));
+
+    // Erasing lowers levels.
+    up.reset_stats();
+    for (int i = 0; i < n; i += 2)
+        CHECK(up.erase(i) == 1);
+    CHECK(s.searches() == static_cast<std::uint64_t>(n / 2));
+    CHECK(s.level_decrements() > 0);
+    CHECK(aa_test::aa_invariants(up));
+}
+
+void counters_stay_with_the_tree() {
+    counted_tree t;
+    rng r(51);
+    std::map<int, int> m;
+    for (int i = 0; i < 2000; ++i) {
+        int k = r.below(1000);
+        t.emplace(k, i);
+        m.emplace(k, i);
+    }
+    aa::tree_stats snapshot = t.stats();
+    CHECK(snapshot.searches() == 2000);
+    t.find(1);
+    CHECK(snapshot.searches() == 2000 && t.stats().searches() == 2001);
+
+    counted_tree copy(t);
+    CHECK(all_zero(copy.stats()) && t.stats().searches() == 2001);
+    counted_tree moved(std::move(copy));
+    CHECK(all_zero(moved.stats()));
+    swap(moved, t);
+    CHECK(all_zero(moved.stats()) && t.stats().searches() == 2001);
+    CHECK(aa_test::same_contents(t, m));
+}
+
+} // namespace
+
+int main() {
+    ascending_and_descending();
+    counters_stay_with_the_tree();
+    return aa_test::status();
+}
@@ -0,0 +1,380 @@
+// durable_aa_tree recovery against std::map: after committed updates, with
+// and without checkpoints in between, reopening the directory must give
+// back what the map holds. Covers replay of the records past the
+// snapshot's LSN, a log torn or corrupted in its last record, a crash
+// between the snapshot rename and the log truncation, snapshots that fail
+// their checksum, a checkpoint that fails inside commit(), updates whose
+// record cannot be encoded, commits of LSNs never issued, and commits from
+// several threads at once.
+
+#include <aa/wal.hpp>
+
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "check.hpp"
+
+namespace {
+
+namespace fs = std::filesystem;
+
+using aa_test::rng;
+using aa_test::same_contents;
+
+using tree = aa::durable_aa_tree<int, std::string>;
+using model = std::map<int, std::string>;
+
+// A value whose encoding throws when asked to.
+struct flaky {
+    std::string text;
+    bool fail = false;
+};
+
+} // namespace
+
+template <>
+struct aa::serial_traits<flaky> {
+    template <class Writer>
+    static void write(Writer& w, const flaky& v) {
+        serial_traits<std::string>::write(w, v.text);
+        if (v.fail)
+            throw std::runtime_error("flaky: cannot encode");
+    }
+    template <class Reader>
+    static flaky read(Reader& r) {
+        return {serial_traits<std::string>::read(r), false};
+    }
+};
+
+namespace {
+
+// A fresh directory in the temporary directory, removed on destruction.
+class temp_dir {
+public:
+    explicit temp_dir(const std::string& name)
+        : path_(fs::temp_directory_path() /
+                ("aa_wal_test_" + std::to_string(::getpid()) + "_" + name)) {
+        fs::remove_all(path_);
+    }
+    ~temp_dir() { fs::remove_all(path_); }
+    std::string path() const { return path_.string(); }
+    std::string file(const char* name) const { return (path_ / name).string(); }
+
+private:
+    fs::path path_;
+};
+
+std::vector<char> read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string& path, const std::vector<char>& bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+aa::durable_options manual() {
+    aa::durable_options opts;
+    opts.checkpoint_bytes = 0;
+    return opts;
+}
+
+// Random assignments and erases, committed together at the end.
+void random_updates(tree& t, model& m, rng& r, int n) {
+    for (int i = 0; i < n; ++i) {
+        int k = r.below(500);
+        if (r.below(3)) {
+            std::string v(static_cast<std::size_t>(r.below(20)), static_cast<char>('a' + i % 26));
+            t.insert_or_assign(k, v);
+            m[k] = v;
+        } else {
+            t.erase(k);
+            m.erase(k);
+        }
+    }
+    t.commit();
+}
+
+bool holds(const tree& t, const model& m) {
+    return t.read([&](const tree::tree_type& x) { return same_contents(x, m); });
+}
+
+bool rejected(const std::string& dir) {
+    try {
+        tree t(dir, manual());
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+void recovery() {
+    temp_dir dir("recovery");
+    model m;
+    rng r(71);
+    tree::lsn_type last;
+    {
+        tree t(dir.path(), manual());
+        CHECK(t.size() == 0 && t.last_lsn() == 0);
+        random_updates(t, m, r, 2000);
+        last = t.last_lsn();
+        CHECK(t.durable_lsn() == last);
+    }
+    // Log only, then a snapshot plus the records after its LSN.
+    for (int round = 0; round < 3; ++round) {
+        tree t(dir.path(), manual());
+        CHECK(holds(t, m) && t.last_lsn() == last);
+        if (round == 1) {
+            t.checkpoint();
+            CHECK(fs::file_size(dir.file("log")) == 0);
+        }
+        random_updates(t, m, r, 500);
+        last = t.last_lsn();
+    }
+    // An erase of a missing key is not logged.
+    tree t(dir.path(), manual());
+    CHECK(t.erase(-1) == last && holds(t, m));
+}
+
+void torn_tail() {
+    temp_dir dir("torn");
+    model m;
+    rng r(73);
+    {
+        tree t(dir.path(), manual());
+        random_updates(t, m, r, 300);
+    }
+    model before = m;
+    std::uintmax_t intact = fs::file_size(dir.file("log"));
+    {
+        tree t(dir.path(), manual());
+        t.insert_or_assign(1000, std::string(50, 'z'));
+        t.commit();
+    }
+    std::vector<char> full = read_file(dir.file("log"));
+
+    // Every cut inside the last record loses only that record, and the
+    // log is cut back to the intact prefix.
+    for (std::size_t n = intact; n < full.size(); ++n) {
+        write_file(dir.file("log"), std::vector<char>(full.begin(), full.begin() + n));
+        tree t(dir.path(), manual());
+        CHECK(holds(t, before));
+        CHECK(fs::file_size(dir.file("log")) == intact);
+    }
+
+    // So does a damaged byte in it, and updates go on after it.
+    std::vector<char> bad = full;
+    bad.back() ^= 1;
+    write_file(dir.file("log"), bad);
+    {
+        tree t(dir.path(), manual());
+        CHECK(holds(t, before));
+        t.insert_or_assign(1001, "after");
+        t.commit();
+    }
+    before[1001] = "after";
+    tree t(dir.path(), manual());
+    CHECK(holds(t, before));
+}
+
+// A crash after the snapshot was renamed into place and before the log
+// was emptied leaves records the snapshot already holds; replaying them
+// on top of it must change nothing, and new records must follow on.
+void crash_before_truncate() {
+    temp_dir dir("rename");
+    model m;
+    rng r(79);
+    tree::lsn_type last;
+    {
+        tree t(dir.path(), manual());
+        random_updates(t, m, r, 1000);
+        std::vector<char> log = read_file(dir.file("log"));
+        t.checkpoint();
+        write_file(dir.file("log"), log);
+        last = t.last_lsn();
+    }
+    {
+        tree t(dir.path(), manual());
+        CHECK(holds(t, m) && t.last_lsn() == last);
+        t.insert_or_assign(7, "again");
+        t.commit();
+        m[7] = "again";
+    }
+    tree t(dir.path(), manual());
+    CHECK(holds(t, m) && t.last_lsn() == last + 1);
+}
+
+void snapshot_checksum() {
+    temp_dir dir("snapshot");
+    model m;
+    rng r(83);
+    {
+        tree t(dir.path(), manual());
+        random_updates(t, m, r, 500);
+        t.checkpoint();
+    }
+    std::vector<char> good = read_file(dir.file("snapshot"));
+    CHECK(!rejected(dir.path()));
+    // Magic, LSN, size, checksum and a byte of the tree.
+    for (std::size_t at : {std::size_t(0), std::size_t(9), std::size_t(17), std::size_t(25),
+                           good.size() / 2, good.size() - 1}) {
+        std::vector<char> bad = good;
+        bad[at] ^= 4;
+        write_file(dir.file("snapshot"), bad);
+        CHECK(rejected(dir.path()));
+    }
+    write_file(dir.file("snapshot"), std::vector<char>(good.begin(), good.end() - 1));
+    CHECK(rejected(dir.path()));
+    write_file(dir.file("snapshot"), std::vector<char>(good.begin(), good.begin() + 20));
+    CHECK(rejected(dir.path()));
+    write_file(dir.file("snapshot"), good);
+    tree t(dir.path(), manual());
+    CHECK(holds(t, m));
+}
+
+// A checkpoint that fails inside commit() leaves the commit successful and
+// the records durable; the error is reported on its own and a later
+// checkpoint clears it.
+void failed_checkpoint() {
+    temp_dir dir("checkpoint");
+    model m;
+    rng r(89);
+    aa::durable_options opts;
+    opts.checkpoint_bytes = 1;
+    {
+        tree t(dir.path(), opts);
+        // The snapshot cannot be written while a directory is in the way.
+        fs::create_directory(dir.file("snapshot.tmp"));
+        bool threw = false;
+        try {
+            random_updates(t, m, r, 200);
+        } catch (...) {
+            threw = true;
+        }
+        CHECK(!threw && t.checkpoint_error() != nullptr);
+        CHECK(!fs::exists(dir.file("snapshot")) && fs::file_size(dir.file("log")) > 0);
+        threw = false;
+        try {
+            t.checkpoint();
+        } catch (const std::system_error&) {
+            threw = true;
+        }
+        CHECK(threw);
+
+        fs::remove(dir.file("snapshot.tmp"));
+        random_updates(t, m, r, 200);
+        CHECK(t.checkpoint_error() == nullptr && fs::exists(dir.file("snapshot")));
+        CHECK(fs::file_size(dir.file("log")) == 0);
+    }
+    tree t(dir.path(), manual());
+    CHECK(holds(t, m));
+}
+
+// An update whose record cannot be encoded changes neither the tree nor
+// the log, and the LSNs go on without a gap.
+void failed_update() {
+    temp_dir dir("encode");
+    using flaky_tree = aa::durable_aa_tree<int, flaky>;
+    {
+        flaky_tree t(dir.path(), manual());
+        t.insert_or_assign(1, {"one"});
+        bool threw = false;
+        try {
+            t.insert_or_assign(2, {"two", true});
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        CHECK(threw && !t.contains(2) && t.size() == 1 && t.last_lsn() == 1);
+        threw = false;
+        try {
+            t.insert_or_assign(1, {"uno", true});
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        CHECK(threw && t.get(1)->text == "one");
+        CHECK(t.insert_or_assign(3, {"three"}) == 2);
+        t.commit();
+        t.checkpoint();
+        CHECK(t.erase(1) == 3);
+        t.commit();
+    }
+    flaky_tree t(dir.path(), manual());
+    CHECK(t.size() == 1 && t.get(3)->text == "three" && t.last_lsn() == 3);
+}
+
+// commit() of an LSN past the last one issued throws instead of waiting
+// for it forever.
+void unissued_lsn() {
+    temp_dir dir("unissued");
+    tree t(dir.path(), manual());
+    bool threw = false;
+    try {
+        t.commit(1);
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    CHECK(threw);
+    tree::lsn_type lsn = t.insert_or_assign(1, "one");
+    t.commit(lsn);
+    threw = false;
+    try {
+        t.commit(lsn + 1);
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    CHECK(threw && t.durable_lsn() == lsn);
+}
+
+// Threads committing each update; every one must survive a reopen.
+void group_commit() {
+    temp_dir dir("group");
+    const int threads = 4, each = 300;
+    aa::durable_options opts;
+    opts.checkpoint_bytes = 4096;
+    {
+        tree t(dir.path(), opts);
+        std::vector<std::thread> pool;
+        for (int id = 0; id < threads; ++id) {
+            pool.emplace_back([&t, id] {
+                for (int i = 0; i < each; ++i)
+                    t.commit(t.insert_or_assign(id * each + i, std::to_string(i)));
+            });
+        }
+        for (std::thread& th : pool)
+            th.join();
+        CHECK(t.durable_lsn() == t.last_lsn() && t.checkpoint_error() == nullptr);
+    }
+    model m;
+    for (int id = 0; id < threads; ++id)
+        for (int i = 0; i < each; ++i)
+            m[id * each + i] = std::to_string(i);
+    tree t(dir.path(), manual());
+    CHECK(holds(t, m) && t.last_lsn() == static_cast<tree::lsn_type>(threads * each));
+}
+
+} // namespace
+
+int main() {
+    recovery();
+    torn_tail();
+    crash_before_truncate();
+    snapshot_checksum();
+    failed_checkpoint();
+    failed_update();
+    unissued_lsn();
+    group_commit();
+    return aa_test::status();
+}